@@ -2,6 +2,8 @@
 #define __DIONYSUS_HPP__
 
 #include <libusb.h>
+#include <poll.h>
+#include <sys/time.h>
 #include <queue>
 #include "ftdi.h"
 #include "nysa.hpp"
@@ -10,6 +12,16 @@
 #define DIONYSUS_VID 0x0403
 #define DIONYSUS_PID 0x8530
 
+//Link profiles
+#define LINK_PROFILE_AUTO         -1
+#define LINK_PROFILE_LOW_LATENCY  0
+#define LINK_PROFILE_THROUGHPUT   1
+
+//Link QoS classes, lower numbers go on the link first
+#define QOS_CLASS_CONTROL         0
+#define QOS_CLASS_BULK            1
+#define QOS_CLASSES               2
+
 /*
 const DIONYSUS_ERROR[] = {
   "error"
@@ -20,6 +32,17 @@ const DIONYSUS_ERROR[] = {
 typedef struct _state_t state_t;
 typedef struct _command_header_t command_header_t;
 typedef struct _response_header_t response_header_t;
+typedef struct _write_segment_t write_segment_t;
+typedef struct _request_t request_t;
+typedef struct _ftdi_config_t ftdi_config_t;
+typedef struct _buffer_pool_t buffer_pool_t;
+typedef struct _usb_arena_t usb_arena_t;
+typedef struct _pipeline_t pipeline_t;
+typedef struct _arbiter_op_t arbiter_op_t;
+typedef struct _async_done_t async_done_t;
+
+//Called when an asynchronous operation is finished (result < 0 on error)
+typedef void (*dionysus_callback_t)(int result, void *user_data);
 
 class Dionysus : public Nysa {
 
@@ -29,14 +52,6 @@ class Dionysus : public Nysa {
     bool comm_mode;
     uint16_t vendor;
     uint16_t product;
-    //used to keep track of buffers
-    std::queue<uint8_t *> buffer_queue;
-    std::queue<uint8_t *> buffers;
-
-    //used to keep track of empty transfers
-    std::queue<struct libusb_transfer *> transfer_queue;
-    //Used to keep track of transfers in progress
-    std::queue<struct libusb_transfer *> transfers;
     state_t * state;
 
     struct ftdi_context * ftdi;
@@ -45,10 +60,56 @@ class Dionysus : public Nysa {
     int strobe_pin(unsigned char pin);
     int set_control_mode();
     int set_comm_mode();
+    void invalidate_comm_mode();
 
     void usb_constructor();
     void usb_destructor();
     int usb_open(int vendor, int product);
+    void usb_close();
+    int write_segments(write_segment_t *segments, uint32_t count, uint32_t timeout);
+    int read_requests(request_t *requests, uint32_t count, uint32_t timeout);
+    int queue_request(pipeline_t *pipeline, uint32_t header_len, uint32_t response_header_len, uint8_t *buffer, uint32_t size, bool read);
+    int flush_requests(pipeline_t *pipeline);
+
+    //Arbiter
+    int submit_op(arbiter_op_t *op);
+    void run_arbiter(arbiter_op_t *op);
+    bool op_is_batchable(arbiter_op_t *op);
+    bool owns_pipeline(arbiter_op_t *op);
+    int execute_op(arbiter_op_t *op);
+    int execute_batch(arbiter_op_t **ops, uint32_t count);
+    int execute_wait_for_interrupts(arbiter_op_t *op);
+    int execute_ping(arbiter_op_t *op);
+    int post_request(uint32_t header_len);
+    int drain_posted_writes();
+    int check_posted_writes(int retval, uint32_t count);
+    int take_posted_error();
+    void release_link();
+
+    //Asynchronous operations
+    int submit_async(arbiter_op_t *op);
+    int start_async_op();
+    void complete_async_op(int result);
+    void advance_async();
+    void handle_async_events(uint32_t usec);
+    int process_events_timeout(uint32_t usec);
+
+    //Transactions split in two for the asynchronous operations
+    int start_write_segments(write_segment_t *segments, uint32_t count, uint32_t timeout);
+    int finish_write_segments();
+    int start_read_requests(request_t *requests, uint32_t count, uint32_t timeout);
+    int finish_read_requests();
+    bool is_transaction_finished();
+
+    //Link tuning
+    void apply_link_profile(int profile);
+    void tune_link(uint32_t size);
+
+    //Link QoS
+    int pick_qos_class();
+    bool op_is_sliced(arbiter_op_t *op);
+    void start_qos_op(arbiter_op_t *op);
+    void charge_qos(int qos_class, uint32_t size);
 
    public:
     //Constructor, Destructor
@@ -62,6 +123,7 @@ class Dionysus : public Nysa {
 
     int write_periph_data(uint32_t dev_addr, uint32_t addr, uint8_t *buffer, uint32_t size);
     int read_periph_data(uint32_t dev_addr, uint32_t addr, uint8_t *buffer, uint32_t size);
+    int queue_read_periph_data(uint32_t dev_addr, uint32_t addr, uint8_t *buffer, uint32_t size);
 
     int wait_for_interrupts(uint32_t timeout, uint32_t *interrupts);
 
@@ -69,6 +131,31 @@ class Dionysus : public Nysa {
 
     int crash_report(uint32_t *buffer);
 
+    uint8_t * alloc_buffer(uint32_t size);
+    void free_buffer(uint8_t *buffer);
+
+    //Command pipelining
+    int begin_pipeline();
+    int end_pipeline();
+    int flush_pipeline();
+    bool is_pipelining();
+
+    //Posted writes
+    void set_posted_writes(bool enable);
+    bool is_posting_writes();
+    uint32_t get_posted_count();
+    int flush();
+
+    //Asynchronous interface for application event loops
+    int submit_write_periph_data(uint32_t dev_addr, uint32_t addr, uint8_t *buffer, uint32_t size, dionysus_callback_t callback, void *user_data = NULL);
+    int submit_read_periph_data(uint32_t dev_addr, uint32_t addr, uint8_t *buffer, uint32_t size, dionysus_callback_t callback, void *user_data = NULL);
+    int submit_write_memory(uint32_t address, uint8_t *buffer, uint32_t size, dionysus_callback_t callback, void *user_data = NULL);
+    int submit_read_memory(uint32_t address, uint8_t *buffer, uint32_t size, dionysus_callback_t callback, void *user_data = NULL);
+    int get_pollfds(struct pollfd *fds, int max_fds);
+    int get_next_timeout(struct timeval *tv);
+    int process_events();
+    uint32_t get_async_count();
+
     //Properties
     int open(int vendor = DIONYSUS_VID, int product = DIONYSUS_PID);
     int close();
@@ -76,10 +163,35 @@ class Dionysus : public Nysa {
     int reset();
 
     void cancel_all_transfers();
+    int start_event_thread();
+    void stop_event_thread();
+    bool is_event_thread_running();
+    int set_event_thread_scheduling(int cpu, int priority);
+    int lock_transfer_memory(bool enable);
+    int get_event_latency_histogram(uint32_t *buckets, int count);
+    uint32_t get_event_latency_max();
+    uint32_t get_event_latency_samples();
+    void reset_event_latency();
 
     /* I/O */
     int read(uint32_t header_len, uint8_t *buffer, uint32_t size, uint32_t timeout = 1000);
+    void set_read_prefetch(uint32_t count);
+    uint32_t get_read_prefetch();
+    void enable_bulk_read(bool enable);
+    int set_bulk_read(uint32_t transfer_size, uint32_t transfer_count, uint32_t threshold);
     int write(uint32_t header_len, unsigned char *buf, int size, uint32_t timeout = 1000);
+    int set_write_chunks(uint32_t chunk_size, uint32_t transfer_count);
+    uint32_t get_write_count();
+    int set_link_profile(int profile);
+    int get_link_profile();
+    bool is_link_profile_pinned();
+    uint32_t get_link_profile_switches();
+    int set_qos_slice_size(uint32_t size);
+    uint32_t get_qos_slice_size();
+    int set_qos_budget(int qos_class, uint32_t size);
+    int get_qos_latency(int qos_class, uint32_t *average_us, uint32_t *max_us);
+    uint32_t get_qos_slices();
+    void reset_qos_stats();
     int read_sync(uint8_t *buffer, uint16_t size);
     int write_sync(uint8_t *buffer, uint16_t size);
 
@@ -34,6 +34,13 @@ class DMA_DEMO_READER : public Driver {
 
     //Data transfer
     void dma_read(uint8_t *buffer);
+    int dma_read(uint8_t *buffer, uint32_t size, uint32_t *actual = NULL);
+
+    //Streaming capture
+    int start_capture(DMARing *ring);
+    int start_capture(DMAFileSink *sink);
+    void stop_capture();
+    DMA * get_dma();
 };
 
 
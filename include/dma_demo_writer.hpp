@@ -36,6 +36,7 @@ class DMA_DEMO_WRITER : public Driver {
 
     //Data transfer
     void dma_write(uint8_t *buffer);
+    int dma_write(uint8_t *buffer, uint32_t size);
 };
 
 
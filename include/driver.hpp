@@ -3,6 +3,13 @@
 
 #include "nysa.hpp"
 #include <stdint.h>
+#include <vector>
+#include <deque>
+#include <map>
+#include <pthread.h>
+#include <sys/time.h>
+#include <atomic>
+#include <string>
 
 #define REG_UNINITIALIZED 0xFFFFFFFF
 /*
@@ -25,13 +32,29 @@
 
 static char * get_message(int retval);
 
+/*
+ * Shadow Register
+ *
+ * Last value written to or read from a cacheable register, only the host
+ * changes a cacheable register so bit operations can be done on the
+ * shadow value instead of reading the register first
+ */
+struct _shadow_register_t {
+  bool          valid;
+  uint32_t      value;
+};
+
+typedef struct _shadow_register_t shadow_register_t;
+
 class DMA;
+class RegisterBatch;
 
 class Driver {
 
   //DMA is only used with a driver and need access to protected functions
   //but DMA may not be used in all drivers and multiple DMAs may be used
   friend class DMA;
+  friend class RegisterBatch;
 
   private:
     Nysa * n;
@@ -43,6 +66,13 @@ class Driver {
     bool debug;
     int error;
 
+    //Shadow registers, only cacheable registers have an entry
+    std::map<uint32_t, shadow_register_t> shadow;
+
+    shadow_register_t * get_shadow(uint32_t reg_addr);
+    void update_shadow(uint32_t reg_addr, uint32_t value);
+    void invalidate_shadow(uint32_t reg_addr);
+
   protected:
     /*Nysa Functions
      * These won't be visible to the user but this is what you use to talk to
@@ -58,9 +88,17 @@ class Driver {
     void clear_register_bit(uint32_t reg_addr, uint8_t bit);
     bool read_register_bit(uint32_t reg_addr, uint8_t bit);
 
+    //Register cache
+    void set_register_cacheable(uint32_t reg_addr, bool cacheable = true);
+    bool is_register_cacheable(uint32_t reg_addr);
+    uint32_t refresh_register(uint32_t reg_addr);
+
     void set_device_id(uint16_t id);
     void set_device_sub_id(uint16_t sub_id);
 
+    //DMA blocks from the memory allocator, the fixed ones as a fallback
+    void alloc_dma_blocks(DMA *dma, uint32_t size, uint32_t *mem_base0, uint32_t *mem_base1);
+
 
   public:
     Driver(Nysa *nysa, bool debug = false);
@@ -70,10 +108,127 @@ class Driver {
     void set_unique_id(uint16_t id);
     bool is_interrupt_for_device(uint32_t interrupts);
 
+    //Read all cacheable registers back from the device
+    void resync_registers();
+    //Forget the cached values, the next access reads the device
+    void invalidate_registers();
+
     virtual int open();         //Initialized a device that is found inside the DRT
     virtual int close();        //Clean up the device
 };
 
+/*
+ * Register Batch
+ *
+ * Records register reads, writes and bit operations of a driver and sends
+ * them to the device in a single pipelined burst when commit() is called,
+ * read results are written to the locations given when they were recorded
+ *
+ * Bit operations on a register that was not written earlier in the batch
+ * read it at the start of the commit, so a batch with bit operations costs
+ * two round trips and one without costs one
+ */
+
+enum _REGISTER_OP {
+  REG_OP_WRITE      = 0,
+  REG_OP_READ       = 1,
+  REG_OP_SET_BIT    = 2,
+  REG_OP_CLEAR_BIT  = 3,
+  REG_OP_READ_BIT   = 4
+};
+
+struct _register_op_t {
+  int           type;
+  uint32_t      reg_addr;
+  uint32_t      data;
+  uint8_t       bit;
+  uint32_t      *result;
+  bool          *bit_result;
+  uint8_t       buffer[4];
+};
+
+typedef struct _register_op_t register_op_t;
+
+class RegisterBatch {
+  private:
+    Driver                      *driver;
+    std::vector<register_op_t>  ops;
+
+    void add(int type, uint32_t reg_addr, uint32_t data, uint8_t bit);
+    int  run();
+
+  public:
+  RegisterBatch(Driver *driver);
+  ~RegisterBatch();
+
+  void write_register(uint32_t reg_addr, uint32_t data);
+  void read_register(uint32_t reg_addr, uint32_t *data);
+
+  void set_register_bit(uint32_t reg_addr, uint8_t bit);
+  void clear_register_bit(uint32_t reg_addr, uint8_t bit);
+  void read_register_bit(uint32_t reg_addr, uint8_t bit, bool *value);
+
+  uint32_t size();
+  void clear();
+  void commit();
+};
+
+/*
+ * DMA File Sink
+ *
+ * Destination for a streaming DMA capture that writes blocks to disk
+ * without an intermediate copy
+ *
+ *  FILE_SINK_MMAP: every output file is preallocated and mapped, blocks
+ *    are read from the FPGA straight into the mapping
+ *  FILE_SINK_DIRECT: the file is opened with O_DIRECT, blocks are read into
+ *    a page aligned buffer that is handed to the kernel as is (the block
+ *    size must be a multiple of the page size)
+ *
+ * Files are named with a printf style pattern that takes the file index
+ * (e.g. "capture_%04u.raw") and a new file is started once 'file_size'
+ * bytes have been written
+ */
+enum _FILE_SINK_MODE {
+  FILE_SINK_MMAP    = 0,
+  FILE_SINK_DIRECT  = 1
+};
+
+typedef enum _FILE_SINK_MODE FILE_SINK_MODE;
+
+class DMAFileSink {
+  private:
+    std::string         path_format;
+    uint64_t            file_size;
+    FILE_SINK_MODE      mode;
+    uint32_t            block_size;
+    uint32_t            blocks_per_file;
+
+    int                 fd;
+    uint8_t             *map;
+    uint8_t             *buffer;
+    uint32_t            block_index;
+    uint32_t            file_index;
+    uint64_t            bytes_written;
+
+    int  open_file();
+    void close_file();
+
+  public:
+  DMAFileSink(const char *path_format, uint64_t file_size, FILE_SINK_MODE mode = FILE_SINK_MMAP);
+  ~DMAFileSink();
+
+  int open(uint32_t block_size);
+  void close();
+
+  //Where the next block goes and hand it to the file once it is there
+  uint8_t * get_slot();
+  int commit();
+
+  uint32_t get_file_count();
+  uint64_t get_bytes_written();
+};
+
 /*
  * DMA Controller
  *
@@ -89,6 +244,52 @@ enum _RXTX_STRATEGY {
 
 typedef enum _RXTX_STRATEGY RXTX_STRATEGY;
 
+/*
+ * What a non blocking enqueue does when the write queue is full
+ *  QUEUE_DROP_NEWEST: the new buffer is not queued
+ *  QUEUE_DROP_OLDEST: the oldest queued buffer that is not being written
+ *    is dropped to make room
+ */
+enum _QUEUE_POLICY {
+  QUEUE_DROP_NEWEST = 0,
+  QUEUE_DROP_OLDEST = 1
+};
+
+typedef enum _QUEUE_POLICY QUEUE_POLICY;
+
+/*
+ * DMA Ring
+ *
+ * Single producer, single consumer ring of DMA blocks in memory the
+ * application provides. The DMA capture thread fills slots, the
+ * application drains them, neither side takes a lock
+ */
+class DMARing {
+  private:
+    uint8_t                 *memory;
+    uint32_t                slot_size;
+    uint32_t                slot_count;
+    //Free running counters, the slot is the counter modulo slot_count
+    std::atomic<uint32_t>   head;
+    std::atomic<uint32_t>   tail;
+
+  public:
+  DMARing(uint8_t *memory, uint32_t slot_size, uint32_t slot_count);
+  ~DMARing();
+
+  uint32_t get_slot_size();
+  uint32_t get_slot_count();
+  uint32_t count();
+
+  //Producer
+  uint8_t * write_slot();
+  void commit_write();
+
+  //Consumer
+  uint8_t * read_slot();
+  void commit_read();
+};
+
 class DMA {
   private:
 
@@ -102,6 +303,11 @@ class DMA {
     uint32_t            BASE[2];
     uint32_t            REG_BASE[2];
     uint32_t            REG_SIZE[2];
+    uint32_t            REG_COUNT;
+    bool                allocated;
+    uint32_t            mem_alloc[2];
+    uint32_t            transfer_size;
+    uint32_t            block_size[2];
     bool                blocking;
     uint32_t            timeout;
 
@@ -114,8 +320,68 @@ class DMA {
     uint32_t            read_state;
     bool                test_bit;
 
-
-    void update_block_state(uint32_t interrupts);
+    //Background writer
+    pthread_t           writer_thread;
+    pthread_mutex_t     queue_lock;
+    pthread_cond_t      queue_ready_cond;
+    pthread_cond_t      queue_space_cond;
+    bool                writer_running;
+    bool                writer_busy;
+    std::deque<uint8_t *> queue_ready;
+    std::vector<uint8_t *> queue_free;
+    std::vector<uint8_t *> queue_frames;
+    QUEUE_POLICY        queue_policy;
+    uint32_t            frames_written;
+    uint32_t            frames_dropped;
+    int                 writer_error;
+
+    static void * writer_thread_func(void *arg);
+    void run_writer();
+
+    //Streaming capture, the flag and the counters are shared with the
+    //capture thread
+    pthread_t               capture_thread;
+    std::atomic<bool>       capture_running;
+    DMARing                 *capture_ring;
+    DMAFileSink             *capture_file;
+    uint8_t                 *capture_scratch;
+    std::atomic<uint32_t>   capture_blocks;
+    std::atomic<uint64_t>   capture_bytes;
+    std::atomic<uint32_t>   capture_overruns;
+    std::atomic<uint32_t>   capture_underruns;
+    std::atomic<int>        capture_error;
+    struct timeval      capture_start;
+
+    //Transfer statistics
+    uint32_t            transfer_handoffs;
+    uint32_t            transfer_overlapped;
+    uint32_t            transfer_blocks;
+    uint64_t            transfer_bytes;
+    struct timeval      transfer_start;
+
+    void count_handoff(uint32_t block);
+    void count_transfer(uint32_t size);
+
+    static void * capture_thread_func(void *arg);
+    void run_capture();
+    void arm_block(uint32_t block);
+    int  begin_capture();
+
+    void request_block(uint32_t block);
+    void upload_block(uint32_t block, uint8_t *buffer, uint32_t size);
+    int read_block(uint32_t block, uint8_t *buffer, uint32_t *actual);
+    //Status shadow
+    bool                shadow_status;
+    uint32_t            inflight[2];
+    uint32_t            inflight_count;
+    uint32_t            status_reads;
+    uint32_t            status_reads_avoided;
+
+    void sync_status();
+    void mark_busy(uint32_t block);
+    bool update_block_state(uint32_t interrupts);
+    void wait_block();
+    bool write_ready();
     void process_status(uint32_t status);
     int  setup(
             uint32_t mem_base0,
@@ -133,6 +399,8 @@ class DMA {
   ~DMA();
 
   //DMA Setup
+  int alloc_blocks(uint32_t size, uint32_t *mem_base0, uint32_t *mem_base1);
+  int reserve_blocks(uint32_t size, uint32_t mem_base0, uint32_t mem_base1);
   int setup_write(
             uint32_t mem_base0,
             uint32_t mem_base1,
@@ -166,11 +434,49 @@ class DMA {
   void set_timeout(uint32_t timeout);
   void enable_blocking(bool enable);
   void set_strategy(RXTX_STRATEGY = CADENCE);
+  void enable_status_shadow(bool enable);
+  void set_count_register(uint32_t reg_count);
+  uint32_t get_transfer_count();
 
   //Write
   int write(uint8_t *buffer);
+  int write(uint8_t *buffer, uint32_t size);
+
+  //Background writer, buffers are copied into a queue and written by a
+  //thread while the core consumes the previous block
+  int start_write_queue(uint32_t depth = 2, QUEUE_POLICY policy = QUEUE_DROP_OLDEST);
+  void stop_write_queue();
+  int enqueue(uint8_t *buffer, bool block = false);
+  int flush_write_queue();
+  void set_queue_policy(QUEUE_POLICY policy);
+  uint32_t get_queue_count();
+  uint32_t get_frames_written();
+  uint32_t get_frames_dropped();
+
+  //Streaming capture, both blocks stay armed and every finished block is
+  //read straight into the next slot of the ring
+  int start_capture(DMARing *ring);
+  int start_capture(DMAFileSink *sink);
+  void stop_capture();
+  bool is_capturing();
+  uint32_t get_capture_blocks();
+  uint64_t get_capture_bytes();
+  uint32_t get_capture_overruns();
+  uint32_t get_capture_underruns();
+  double get_capture_throughput();
+  int get_capture_error();
+  //Blocks moved and how many of them kept both blocks busy
+  void reset_transfer_stats();
+  uint32_t get_transfer_blocks();
+  uint64_t get_transfer_bytes();
+  uint32_t get_overlapped_blocks();
+  double get_transfer_throughput();
+  uint32_t get_status_reads();
+  uint32_t get_status_reads_avoided();
+
   //Read
   int read(uint8_t *buffer);
+  int read(uint8_t *buffer, uint32_t size, uint32_t *actual = NULL);
 };
 
 
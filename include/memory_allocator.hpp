@@ -0,0 +1,57 @@
+#ifndef __MEMORY_ALLOCATOR_HPP__
+#define __MEMORY_ALLOCATOR_HPP__
+
+#include <stdint.h>
+#include <map>
+#include <set>
+
+/*
+ * Memory Allocator
+ *
+ * Hands out regions of the FPGA memory bus (e.g. DMA blocks) so several
+ * drivers can share the memory devices of an image without overlapping
+ *
+ * Buddy allocator: every region is a power of two in size and aligned to
+ * its size, freed regions are merged with their buddy again. Memory is
+ * added as regions (usually one per memory device in the DRT) that are cut
+ * into the largest aligned power of two chunks that fit, a chunk is never
+ * merged with memory outside of it
+ *
+ * Fixed ranges (e.g. hard coded DMA addresses) can be reserved so 'alloc'
+ * never hands them out, a reservation is given back with 'free'
+ */
+
+class MemoryAllocator {
+  private:
+    const static uint32_t MIN_ORDER     = 12;   //4 KB
+    const static uint32_t MAX_ORDER     = 31;
+
+    bool debug;
+    std::set<uint32_t>              free_blocks[MAX_ORDER + 1];
+    std::map<uint32_t, uint32_t>    allocated;  //address -> order
+    std::map<uint32_t, uint32_t>    chunks;     //address -> order
+    std::map<uint32_t, uint32_t>    reserved;   //address -> size
+
+    uint32_t order_for_size(uint32_t size);
+    uint32_t chunk_order(uint32_t address);
+    bool is_reserved(uint64_t start, uint64_t end);
+    void release_block(uint32_t address, uint32_t order);
+    void remove_free(uint64_t start, uint64_t end);
+
+  public:
+    MemoryAllocator(bool debug = false);
+    ~MemoryAllocator();
+
+    int add_region(uint32_t address, uint32_t size);
+    void reset();
+
+    int alloc(uint32_t size, uint32_t *address);
+    int reserve(uint32_t address, uint32_t size);
+    int free(uint32_t address);
+
+    uint32_t get_free_size();
+    uint32_t get_largest_free();
+    uint32_t get_allocated_size(uint32_t address);
+};
+
+#endif //__MEMORY_ALLOCATOR_HPP__
@@ -21,7 +21,7 @@ class NH_LCD_480_272 : public Driver {
     //DMA Size is the size of an entire pixel (32 bits)
     const static uint32_t DMA_SIZE                    = ((NH_LCD_480_272_HEIGHT) * (NH_LCD_480_272_WIDTH) * 4);
     const static uint32_t DMA_BASE0                   = 0x00000000;
-    const static uint32_t DMA_BASE1                   = (NH_LCD_480_272_HEIGHT * NH_LCD_480_272_WIDTH);
+    const static uint32_t DMA_BASE1                   = DMA_SIZE;
 
 
     //LCD Constants
@@ -40,11 +40,31 @@ class NH_LCD_480_272 : public Driver {
     const static uint16_t PAGE_START                  =  0;
     const static uint16_t PAGE_END                    =  NH_LCD_480_272_HEIGHT;
 
+    //Bring up timing (us)
+    const static uint32_t RESET_PULSE_TIME            =  30000;
+    const static uint32_t SOFT_RESET_TIME             =  5000;
+    const static uint32_t PLL_LOCK_TIMEOUT            =  100000;
+
+    //Status bits
+    const static uint8_t PLL_STATUS_LOCKED            =  0x04;
+    const static uint8_t PWR_MODE_DISPLAY_ON          =  0x04;
+    const static uint8_t PWR_MODE_PARTIAL             =  0x20;
+    const static uint8_t PWR_MODE_IDLE                =  0x40;
+    const static uint8_t TEAR_EF_ON                   =  0x80;
+    const static uint8_t TEAR_EF_MODE                 =  0x40;
+
+    //Controller setup
+    const static uint8_t PIXEL_DATA_INTERFACE         =  0x00;
+    const static uint8_t PIXEL_FORMAT                 =  0x60;
+    const static uint8_t ADDRESS_MODE                 =  0x00;
+    const static uint8_t TEAR_MODE                    =  0x00;
+
     //MCU Addresses
     const static uint8_t MEM_ADR_NOP                  =  0x00;
     const static uint8_t MEM_ADR_RESET                =  0x01;
     const static uint8_t MEM_ADR_PWR_MODE             =  0x0A;
     const static uint8_t MEM_ADR_ADR_MODE             =  0x0B;
+    const static uint8_t MEM_ADR_GET_PIXEL_FORMAT     =  0x0C;
     const static uint8_t MEM_ADR_DISP_MODE            =  0x0D;
     const static uint8_t MEM_ADR_GET_TEAR_EF          =  0x0E;
     const static uint8_t MEM_ADR_ENTER_SLEEP_MODE     =  0x10;
@@ -122,6 +142,7 @@ class NH_LCD_480_272 : public Driver {
 
     void write_lcd_command(uint8_t command, uint32_t data_count = 0, uint8_t *data = NULL);
     void read_lcd_command(uint8_t command, uint32_t data_count, uint8_t *data);
+    void queue_lcd_command(RegisterBatch *batch, uint8_t command, uint32_t data_count = 0, uint8_t *data = NULL, uint32_t *read_data = NULL);
 
     void enable_tearing(bool enable);
     void enable_backlight(bool enable);
@@ -129,14 +150,23 @@ class NH_LCD_480_272 : public Driver {
     void enable_chip_select(bool enable);
     void pixel_frequency_to_array(double pll_clock = 100, double pixel_freq = 5.3, uint8_t *buffer = NULL);
 
+    bool poll_lcd_command(uint8_t command, uint8_t mask, uint8_t value, uint32_t timeout);
+    void lcd_mode_params(uint8_t *buffer);
+    void horiz_period_params(uint8_t *buffer);
+    void vert_period_params(uint8_t *buffer);
+    void lshift_freq_params(uint8_t *buffer);
+    void column_window_params(uint8_t *buffer);
+    void page_window_params(uint8_t *buffer);
+
   public:
     NH_LCD_480_272(Nysa *nysa, uint32_t dev_addr, bool debug = false);
     ~NH_LCD_480_272();
 
     //Control
     void start();
-    void setup();
+    void setup(bool warm_start = false);
     void stop();
+    bool is_configured();
 
     uint32_t get_buffer_size();
     uint32_t get_image_width();
@@ -146,6 +176,11 @@ class NH_LCD_480_272 : public Driver {
 
     //Data Transfer
     void dma_write(uint8_t *buffer);
+
+    //Frame queue, frames are written by a background thread
+    int start_frame_queue(uint32_t depth = 2, QUEUE_POLICY policy = QUEUE_DROP_OLDEST);
+    void stop_frame_queue();
+    int queue_frame(uint8_t *buffer, bool block = false);
 };
 
 
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include "print_colors.hpp"
+#include "memory_allocator.hpp"
 
 #define printd(x)                                 \
 do{                                               \
@@ -31,6 +32,11 @@ class Nysa {
     int num_devices;
     uint8_t version;
 
+    //Memory on the FPGA side, seeded from the DRT memory devices
+    MemoryAllocator *memory;
+    bool memory_seeded;
+    int seed_memory();
+
   public:
     Nysa (bool debug = false);
     ~Nysa();
@@ -51,6 +57,30 @@ class Nysa {
 
     virtual int crash_report(uint32_t *buffer);
 
+    //Buffers for large transfers, a subclass may hand out memory that its
+    //transport can move without copying
+    virtual uint8_t * alloc_buffer(uint32_t size);
+    virtual void free_buffer(uint8_t *buffer);
+
+    //Wait for everything that was sent without waiting (posted writes)
+    //to be acknowledged, reports errors that were held back
+    virtual int flush();
+
+    //Group commands so they go out back to back. A read is a barrier, it
+    //sends everything queued before it and returns with its buffer filled.
+    //queue_read_periph_data keeps a read in the pipeline instead, its buffer
+    //is only filled after end_pipeline() and has to stay valid until then.
+    //An implementation that can't pipeline runs every command right away
+    virtual int begin_pipeline();
+    virtual int end_pipeline();
+    virtual int queue_read_periph_data(uint32_t dev_addr, uint32_t addr, uint8_t *buffer, uint32_t size);
+
+    //FPGA memory regions (DMA blocks), shared by every driver on the image
+    int alloc_memory(uint32_t size, uint32_t *address);
+    int reserve_memory(uint32_t address, uint32_t size);
+    int free_memory(uint32_t address);
+    MemoryAllocator * get_memory_allocator();
+
     //Helper Functions
     int write_register(uint32_t dev_addr, uint32_t reg_addr, uint32_t data);
     int set_register_bit(uint32_t dev_addr, uint32_t reg_addr, uint8_t bit);
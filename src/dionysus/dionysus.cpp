@@ -49,17 +49,26 @@ bool Dionysus::is_open(){
 }
 int Dionysus::close(){
   if (this->debug) printf ("Dionysus: Close FTDI\n");
+  this->usb_close();
   this->usb_is_open = false;
+  this->invalidate_comm_mode();
   return ftdi_usb_close(this->ftdi);
 }
 int Dionysus::reset(){
   if (this->debug) printf ("Dionysus: Reset FTDI\n");
+  this->invalidate_comm_mode();
   return ftdi_usb_reset(this->ftdi);
 }
 int Dionysus::soft_reset(){
-  return this->strobe_pin((unsigned char)RESET_BUTTON);
+  arbiter_op_t op;
+  arbiter_op_init(&op, OP_STROBE);
+  op.addr = RESET_BUTTON;
+  return this->submit_op(&op);
 }
 int Dionysus::program_fpga(){
-  return this->strobe_pin((unsigned char)PROGRAM_BUTTON);
+  arbiter_op_t op;
+  arbiter_op_init(&op, OP_STROBE);
+  op.addr = PROGRAM_BUTTON;
+  return this->submit_op(&op);
 }
 
@@ -0,0 +1,185 @@
+#include "dionysus_local.hpp"
+#include <stdio.h>
+
+//Command arbiter, serializes operations from any number of threads onto the link
+
+void arbiter_op_init(arbiter_op_t *op, int type){
+  op->type        = type;
+  op->dev_addr    = 0;
+  op->addr        = 0;
+  op->buffer      = NULL;
+  op->size        = 0;
+  op->timeout     = 1000;
+  op->interrupts  = NULL;
+  op->posted      = false;
+  op->deferred    = false;
+  op->qos_class   = ((type == OP_WRITE_MEM) || (type == OP_READ_MEM)) ? QOS_CLASS_BULK : QOS_CLASS_CONTROL;
+  op->started     = false;
+  op->result      = 0;
+  op->done        = false;
+  op->next        = NULL;
+  op->callback    = NULL;
+  op->user_data   = NULL;
+}
+
+/*
+ *  Small reads and writes that are next to each other in the queue can go
+ *  out in a single burst
+ */
+bool Dionysus::op_is_batchable(arbiter_op_t *op){
+  switch (op->type){
+    case (OP_WRITE_PERIPH):
+    case (OP_READ_PERIPH):
+    case (OP_WRITE_MEM):
+    case (OP_READ_MEM):
+      return !op->posted && !this->owns_pipeline(op) && !this->op_is_sliced(op);
+    default:
+      break;
+  }
+  return false;
+}
+
+/*
+ *  Serve queued operations until 'op' is finished
+ *    Called with the arbiter lock held by the thread that currently owns the
+ *    link, the lock is released while an operation runs so other threads
+ *    can queue theirs. Once the callers operation is finished the link is
+ *    handed to the next waiting thread
+ *
+ *    The next operation comes from the QoS class picked by 'pick_qos_class',
+ *    a large memory operation stays at the head of its queue and goes out
+ *    one slice at a time so register operations can get in between
+ */
+void Dionysus::run_arbiter(arbiter_op_t *op){
+  arbiter_op_t * batch[MAX_PIPELINE_DEPTH];
+  arbiter_op_t ** head;
+  arbiter_op_t slice;
+  uint32_t count = 0;
+  uint32_t size = 0;
+  int qos_class = 0;
+  int retval = 0;
+  bool sliced = false;
+  bool last = true;
+
+  while (!op->done && ((qos_class = this->pick_qos_class()) >= 0)){
+    head = &this->state->op_head[qos_class];
+    count = 0;
+    size = 0;
+    last = true;
+    sliced = this->op_is_sliced(*head);
+    if (sliced){
+      //Next slice of the operation at the head
+      batch[count++] = *head;
+      this->start_qos_op(*head);
+      slice = **head;
+      slice.addr   += this->state->qos_offset;
+      slice.buffer += this->state->qos_offset;
+      slice.size    = slice.size - this->state->qos_offset;
+      if ((this->state->qos_slice_size > 0) && (slice.size > this->state->qos_slice_size)){
+        slice.size = this->state->qos_slice_size;
+        last = false;
+      }
+      size = slice.size;
+      this->state->qos_offset += slice.size;
+      this->state->qos_slices++;
+    }
+    else {
+      //Take the head and whatever can be batched with it
+      do {
+        batch[count] = *head;
+        this->start_qos_op(batch[count]);
+        size += batch[count]->size;
+        count++;
+        *head = (*head)->next;
+      } while ((*head != NULL) &&
+               (count < MAX_PIPELINE_DEPTH) &&
+               this->op_is_batchable(batch[0]) &&
+               this->op_is_batchable(*head) &&
+               //A batch is no longer on the link than a slice
+               ((this->state->qos_slice_size == 0) ||
+                ((size + (*head)->size) <= this->state->qos_slice_size)));
+      if (*head == NULL){
+        this->state->op_tail[qos_class] = NULL;
+      }
+    }
+    pthread_mutex_unlock(&this->state->arbiter_lock);
+
+    if (sliced){
+      retval = this->execute_op(&slice);
+    }
+    else if (count == 1){
+      retval = this->execute_op(batch[0]);
+    }
+    else {
+      retval = this->execute_batch(&batch[0], count);
+    }
+
+    pthread_mutex_lock(&this->state->arbiter_lock);
+    this->charge_qos(qos_class, size + (count * QOS_OP_COST));
+    if (sliced){
+      if (!last && (retval >= 0)){
+        //More slices to go, the operation stays queued
+        continue;
+      }
+      *head = (*head)->next;
+      if (*head == NULL){
+        this->state->op_tail[qos_class] = NULL;
+      }
+      this->state->qos_offset = 0;
+    }
+    for (uint32_t i = 0; i < count; i++){
+      batch[i]->result = (retval < 0) ? retval : 0;
+      batch[i]->done = true;
+    }
+    pthread_cond_broadcast(&this->state->arbiter_cond);
+  }
+}
+
+/*
+ *  Queue an operation and wait for it to finish
+ *    Operations of a class run in the order they were submitted, so
+ *    operations from one thread are never reordered (a thread waits for
+ *    each of its operations). The first waiting thread runs the operations
+ *    of the others along with its own
+ *
+ *  \retval result of the operation
+ */
+int Dionysus::submit_op(arbiter_op_t *op){
+  arbiter_op_t ** tail = &this->state->op_tail[op->qos_class];
+  op->thread  = pthread_self();
+  op->done    = false;
+  op->next    = NULL;
+  op->started = false;
+  gettimeofday(&op->queued, NULL);
+
+  pthread_mutex_lock(&this->state->arbiter_lock);
+  if (*tail == NULL){
+    this->state->op_head[op->qos_class] = op;
+  }
+  else {
+    (*tail)->next = op;
+  }
+  *tail = op;
+
+  while (!op->done){
+    if (!this->state->arbiter_busy){
+      this->state->arbiter_busy = true;
+      this->run_arbiter(op);
+      //Let asynchronous operations or a waiting thread take over the link
+      this->release_link();
+    }
+    else if (this->state->async_phase != ASYNC_PHASE_IDLE){
+      //Asynchronous operations have the link, help them along instead of
+      //waiting on an event loop that might be this thread. Their callbacks
+      //still wait for the application's process_events()
+      pthread_mutex_unlock(&this->state->arbiter_lock);
+      this->handle_async_events(ASYNC_WAIT_US);
+      pthread_mutex_lock(&this->state->arbiter_lock);
+    }
+    else {
+      pthread_cond_wait(&this->state->arbiter_cond, &this->state->arbiter_lock);
+    }
+  }
+  pthread_mutex_unlock(&this->state->arbiter_lock);
+  return op->result;
+}
@@ -0,0 +1,160 @@
+#include "dionysus_local.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <libusb.h>
+#include <sys/mman.h>
+
+//Transfer buffers and transfers used by the Dionysus I/O engine
+
+/*
+ *  Free buffers are kept in a singly linked list that runs through the
+ *  first bytes of each buffer, taking and returning a buffer never
+ *  allocates
+ */
+static void buffer_pool_init(buffer_pool_t *pool, uint8_t *base, uint32_t buffer_size, uint32_t count){
+  pool->base        = base;
+  pool->buffer_size = buffer_size;
+  pool->count       = count;
+  pool->free_list   = NULL;
+  pool->free_count  = 0;
+  //Push in reverse so buffers are handed out in address order
+  for (uint32_t i = count; i > 0; i--){
+    buffer_pool_put(pool, &base[(i - 1) * buffer_size]);
+  }
+}
+
+uint8_t * buffer_pool_get(buffer_pool_t *pool){
+  uint8_t * buffer = pool->free_list;
+  if (buffer == NULL){
+    return NULL;
+  }
+  memcpy(&pool->free_list, buffer, sizeof(uint8_t *));
+  pool->free_count--;
+  return buffer;
+}
+
+void buffer_pool_put(buffer_pool_t *pool, uint8_t *buffer){
+  memcpy(buffer, &pool->free_list, sizeof(uint8_t *));
+  pool->free_list = buffer;
+  pool->free_count++;
+}
+
+bool buffer_pool_owns(buffer_pool_t *pool, const uint8_t *buffer){
+  return (pool->base != NULL) &&
+         (buffer >= pool->base) &&
+         (buffer < (pool->base + ((size_t) pool->buffer_size * pool->count)));
+}
+
+/*
+ *  Free transfers are linked through their user_data pointer, it is filled
+ *  in again when the transfer is submitted
+ */
+struct libusb_transfer * usb_arena_get_transfer(usb_arena_t *arena){
+  struct libusb_transfer * transfer = arena->free_transfers;
+  if (transfer == NULL){
+    return NULL;
+  }
+  arena->free_transfers = (struct libusb_transfer *) transfer->user_data;
+  arena->free_transfer_count--;
+  return transfer;
+}
+
+void usb_arena_put_transfer(usb_arena_t *arena, struct libusb_transfer *transfer){
+  transfer->user_data = arena->free_transfers;
+  arena->free_transfers = transfer;
+  arena->free_transfer_count++;
+}
+
+void usb_arena_init(usb_arena_t *arena){
+  memset(arena, 0, sizeof(usb_arena_t));
+}
+
+/*
+ *  Allocate every transfer buffer in one block
+ *    The block comes from libusb_dev_mem_alloc when the kernel supports it,
+ *    usbfs then DMAs straight to and from these buffers, otherwise the
+ *    block is allocated on the heap
+ *
+ *  \param arena: arena to set up
+ *  \param dev: open device handle
+ *
+ *  \retval  0: all fine
+ *          -1: failed to allocate the buffers
+ *          -2: failed to allocate the transfers
+ */
+int usb_arena_open(usb_arena_t *arena, struct libusb_device_handle *dev){
+  size_t read_size = (size_t) NUM_TRANSFERS * BUFFER_SIZE;
+  size_t bulk_size = (size_t) BULK_NUM_TRANSFERS * BULK_BUFFER_SIZE;
+  size_t user_size = (size_t) USER_NUM_BUFFERS * USER_BUFFER_SIZE;
+  struct libusb_transfer * transfer;
+
+  if (arena->memory != NULL){
+    return 0;
+  }
+  arena->size = read_size + bulk_size + user_size;
+  arena->dev_mem = false;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+  arena->memory = libusb_dev_mem_alloc(dev, arena->size);
+  if (arena->memory != NULL){
+    arena->dev_mem = true;
+  }
+#endif
+  if (arena->memory == NULL){
+    arena->memory = (uint8_t *) memalign(4096, arena->size);
+  }
+  if (arena->memory == NULL){
+    arena->size = 0;
+    return -1;
+  }
+  buffer_pool_init(&arena->read_pool, arena->memory, BUFFER_SIZE, NUM_TRANSFERS);
+  buffer_pool_init(&arena->bulk_pool, &arena->memory[read_size], BULK_BUFFER_SIZE, BULK_NUM_TRANSFERS);
+  buffer_pool_init(&arena->user_pool, &arena->memory[read_size + bulk_size], USER_BUFFER_SIZE, USER_NUM_BUFFERS);
+
+  arena->free_transfers = NULL;
+  arena->free_transfer_count = 0;
+  for (int i = 0; i < NUM_TRANSFERS; i++){
+    transfer = libusb_alloc_transfer(0);
+    arena->transfers[i] = transfer;
+    if (!transfer){
+      printf ("Dionysus: Error while creating index %d usb transfer\n", i);
+      usb_arena_close(arena, dev);
+      return -2;
+    }
+    usb_arena_put_transfer(arena, transfer);
+  }
+  return 0;
+}
+
+void usb_arena_close(usb_arena_t *arena, struct libusb_device_handle *dev){
+  for (int i = 0; i < NUM_TRANSFERS; i++){
+    if (arena->transfers[i] != NULL){
+      libusb_free_transfer(arena->transfers[i]);
+      arena->transfers[i] = NULL;
+    }
+  }
+  arena->free_transfers = NULL;
+  arena->free_transfer_count = 0;
+  if (arena->locked){
+    munlock(arena->memory, arena->size);
+    arena->locked = false;
+  }
+  if (arena->memory != NULL){
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    if (arena->dev_mem){
+      libusb_dev_mem_free(dev, arena->memory, arena->size);
+    }
+    else {
+      free(arena->memory);
+    }
+#else
+    free(arena->memory);
+#endif
+  }
+  arena->memory = NULL;
+  arena->size = 0;
+  arena->dev_mem = false;
+  memset(&arena->read_pool, 0, sizeof(buffer_pool_t));
+  memset(&arena->bulk_pool, 0, sizeof(buffer_pool_t));
+  memset(&arena->user_pool, 0, sizeof(buffer_pool_t));
+}
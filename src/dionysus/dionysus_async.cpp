@@ -0,0 +1,332 @@
+#include "dionysus_local.hpp"
+#include <stdio.h>
+#include <poll.h>
+#include <libusb.h>
+
+//Asynchronous interface, lets an application event loop drive the link
+
+/*
+ *  Set up the current asynchronous operation and put its command on the bus
+ *  Called with the arbiter lock held by the owner of the link, nothing here
+ *  waits for the device
+ */
+int Dionysus::start_async_op(){
+  arbiter_op_t * op = &this->state->async_ops[this->state->async_head];
+  request_t * request = &this->state->async_request;
+  uint32_t header_len = 0;
+  uint32_t count = 0;
+  int retval = 0;
+
+  //Responses have to line up with the requests, the posted
+  //acknowledgements are read first and advance_async() comes back here
+  //once they are in
+  if (this->state->posted.count > 0){
+    count = this->state->posted.count;
+    this->state->posted.count = 0;
+    this->state->async_drain_count = count;
+    this->state->async_phase = ASYNC_PHASE_DRAIN;
+    retval = this->start_read_requests(&this->state->posted.requests[0], count, 1000);
+    if (retval < 0){
+      this->check_posted_writes(retval, count);
+      return this->take_posted_error();
+    }
+    return 0;
+  }
+  retval = this->take_posted_error();
+  if (retval < 0){
+    return retval;
+  }
+  this->tune_link(op->size);
+  header_len = populate_op_command(&request->command_header, op);
+  memset(&request->response_header, 0, sizeof(response_header_t));
+  request->header_len           = header_len;
+  request->response_header_len  = RESPONSE_HEADER_LEN;
+  request->read                 = op_is_read(op);
+  request->buffer               = request->read ? op->buffer : NULL;
+  request->size                 = request->read ? op->size : 0;
+  request->data_offset          = 0;
+
+  this->state->async_segments[count].data = (uint8_t *) &request->command_header;
+  this->state->async_segments[count].size = header_len;
+  count++;
+  if (!request->read && (op->size > 0)){
+    this->state->async_segments[count].data = op->buffer;
+    this->state->async_segments[count].size = op->size;
+    count++;
+  }
+  this->state->async_phase = ASYNC_PHASE_WRITE;
+  return this->start_write_segments(&this->state->async_segments[0], count, op->timeout);
+}
+
+/*
+ *  Retire the current operation, start the next one or give the link back
+ *  to the arbiter when there is nothing left. The callback is queued for
+ *  process_events(), whichever thread got the operation this far
+ */
+void Dionysus::complete_async_op(int result){
+  arbiter_op_t * op = &this->state->async_ops[this->state->async_head];
+  async_done_t * done = &this->state->async_done[(this->state->async_done_head +
+                                                  this->state->async_done_count) % MAX_ASYNC_OPS];
+  done->callback  = op->callback;
+  done->user_data = op->user_data;
+  done->result    = (result < 0) ? result : 0;
+  this->state->async_done_count++;
+
+  this->state->async_head = (this->state->async_head + 1) % MAX_ASYNC_OPS;
+  this->state->async_count--;
+  this->state->async_phase = ASYNC_PHASE_IDLE;
+  this->release_link();
+}
+
+/*
+ *  Hand the link to the next asynchronous operation, or back to threads
+ *  waiting in the arbiter. Called with the arbiter lock held by the owner of
+ *  the link
+ */
+void Dionysus::release_link(){
+  int retval = 0;
+  if (this->state->async_count > 0){
+    this->state->arbiter_busy = true;
+    retval = this->start_async_op();
+    if (retval < 0){
+      //Could not even get started, report it on the next process_events()
+      this->state->async_ops[this->state->async_head].result = retval;
+      this->state->async_phase = ASYNC_PHASE_FAILED;
+    }
+    return;
+  }
+  this->state->arbiter_busy = false;
+  pthread_cond_broadcast(&this->state->arbiter_cond);
+}
+
+/*
+ *  Move the current asynchronous operation along once its transaction is
+ *  finished, called with the arbiter lock held
+ */
+void Dionysus::advance_async(){
+  int retval = 0;
+  while (this->state->async_phase != ASYNC_PHASE_IDLE){
+    if (this->state->async_phase == ASYNC_PHASE_FAILED){
+      this->complete_async_op(this->state->async_ops[this->state->async_head].result);
+      continue;
+    }
+    if (!this->is_transaction_finished()){
+      return;
+    }
+    if (this->state->async_phase == ASYNC_PHASE_DRAIN){
+      //Errors are kept for take_posted_error() in start_async_op()
+      this->check_posted_writes(this->finish_read_requests(), this->state->async_drain_count);
+      this->state->async_drain_count = 0;
+      retval = this->start_async_op();
+      if (retval < 0){
+        this->complete_async_op(retval);
+      }
+      continue;
+    }
+    if (this->state->async_phase == ASYNC_PHASE_WRITE){
+      retval = this->finish_write_segments();
+      if (retval >= 0){
+        this->state->async_phase = ASYNC_PHASE_READ;
+        retval = this->start_read_requests( &this->state->async_request,
+                                            1,
+                                            this->state->async_ops[this->state->async_head].timeout);
+      }
+      if (retval < 0){
+        this->complete_async_op(retval);
+      }
+    }
+    else {
+      retval = this->finish_read_requests();
+      this->complete_async_op(retval);
+    }
+  }
+}
+
+/*
+ *  Queue an operation without waiting for it, an operation holds its slot
+ *  until its callback has been delivered
+ */
+int Dionysus::submit_async(arbiter_op_t *op){
+  uint32_t index = 0;
+  pthread_mutex_lock(&this->state->arbiter_lock);
+  if ((this->state->async_count + this->state->async_done_count) >= MAX_ASYNC_OPS){
+    pthread_mutex_unlock(&this->state->arbiter_lock);
+    return -1;
+  }
+  index = (this->state->async_head + this->state->async_count) % MAX_ASYNC_OPS;
+  this->state->async_ops[index] = *op;
+  this->state->async_ops[index].thread = pthread_self();
+  this->state->async_count++;
+  if (!this->state->arbiter_busy){
+    //The link is free, get started right away
+    this->release_link();
+  }
+  pthread_mutex_unlock(&this->state->arbiter_lock);
+  return 0;
+}
+
+/*
+ *  Handle USB events for up to 'usec' microseconds and move the
+ *  asynchronous operations along, finished operations are queued but
+ *  their callbacks are left for process_events(). A thread blocked in the
+ *  arbiter uses this to help the asynchronous operations off the link
+ */
+void Dionysus::handle_async_events(uint32_t usec){
+  struct timeval tv;
+
+  if (!this->state->event_thread_running && (this->state->usb_ctx != NULL)){
+    tv.tv_sec = usec / 1000000;
+    tv.tv_usec = usec % 1000000;
+    libusb_handle_events_timeout_completed(this->state->usb_ctx, &tv, NULL);
+  }
+  pthread_mutex_lock(&this->state->arbiter_lock);
+  this->advance_async();
+  pthread_mutex_unlock(&this->state->arbiter_lock);
+}
+
+/*
+ *  Handle USB events for up to 'usec' microseconds and run the callbacks of
+ *  every asynchronous operation that finished, including the ones other
+ *  threads finished, on the calling thread
+ *
+ *  \retval number of callbacks delivered
+ */
+int Dionysus::process_events_timeout(uint32_t usec){
+  async_done_t done[MAX_ASYNC_OPS];
+  uint32_t done_count = 0;
+
+  this->handle_async_events(usec);
+
+  pthread_mutex_lock(&this->state->arbiter_lock);
+  while (this->state->async_done_count > 0){
+    done[done_count++] = this->state->async_done[this->state->async_done_head];
+    this->state->async_done_head = (this->state->async_done_head + 1) % MAX_ASYNC_OPS;
+    this->state->async_done_count--;
+  }
+  pthread_mutex_unlock(&this->state->arbiter_lock);
+
+  for (uint32_t i = 0; i < done_count; i++){
+    if (done[i].callback != NULL){
+      done[i].callback(done[i].result, done[i].user_data);
+    }
+  }
+  return done_count;
+}
+
+/*
+ *  Non blocking, call when one of the file descriptors from get_pollfds()
+ *  is ready or the time from get_next_timeout() has passed
+ *
+ *  \retval number of operations completed
+ */
+int Dionysus::process_events(){
+  return this->process_events_timeout(0);
+}
+
+/*
+ *  File descriptors the application should poll for the USB events
+ *
+ *  \param fds: array to fill in
+ *  \param max_fds: size of the array
+ *
+ *  \retval number of file descriptors (can be larger than max_fds)
+ *          < 0: device is not open
+ */
+int Dionysus::get_pollfds(struct pollfd *fds, int max_fds){
+  const struct libusb_pollfd ** usb_fds;
+  int count = 0;
+  if (this->state->usb_ctx == NULL){
+    return -1;
+  }
+  usb_fds = libusb_get_pollfds(this->state->usb_ctx);
+  if (usb_fds == NULL){
+    return -1;
+  }
+  for (count = 0; usb_fds[count] != NULL; count++){
+    if (count < max_fds){
+      fds[count].fd       = usb_fds[count]->fd;
+      fds[count].events   = usb_fds[count]->events;
+      fds[count].revents  = 0;
+    }
+  }
+  libusb_free_pollfds(usb_fds);
+  return count;
+}
+
+/*
+ *  How long the application may wait before it has to call process_events()
+ *  even when no file descriptor is ready (libusb handles timeouts itself)
+ *
+ *  \retval  1: tv holds the timeout
+ *           0: no timeout pending, wait on the file descriptors alone
+ *         < 0: error
+ */
+int Dionysus::get_next_timeout(struct timeval *tv){
+  if (this->state->usb_ctx == NULL){
+    return -1;
+  }
+  return libusb_get_next_timeout(this->state->usb_ctx, tv);
+}
+
+/*
+ *  Operations that are queued, running or waiting for their callback
+ */
+uint32_t Dionysus::get_async_count(){
+  uint32_t count = 0;
+  pthread_mutex_lock(&this->state->arbiter_lock);
+  count = this->state->async_count + this->state->async_done_count;
+  pthread_mutex_unlock(&this->state->arbiter_lock);
+  return count;
+}
+
+/*
+ *  Asynchronous versions of the Nysa operations
+ *    Return as soon as the operation is queued (-1 if the queue is full),
+ *    'callback' is called from process_events() when the operation is done.
+ *    The buffer must stay valid until then
+ */
+int Dionysus::submit_write_periph_data(uint32_t dev_addr, uint32_t addr, uint8_t *buffer, uint32_t size, dionysus_callback_t callback, void *user_data){
+  arbiter_op_t op;
+  arbiter_op_init(&op, OP_WRITE_PERIPH);
+  op.dev_addr   = dev_addr;
+  op.addr       = addr;
+  op.buffer     = buffer;
+  op.size       = size;
+  op.callback   = callback;
+  op.user_data  = user_data;
+  return this->submit_async(&op);
+}
+
+int Dionysus::submit_read_periph_data(uint32_t dev_addr, uint32_t addr, uint8_t *buffer, uint32_t size, dionysus_callback_t callback, void *user_data){
+  arbiter_op_t op;
+  arbiter_op_init(&op, OP_READ_PERIPH);
+  op.dev_addr   = dev_addr;
+  op.addr       = addr;
+  op.buffer     = buffer;
+  op.size       = size;
+  op.callback   = callback;
+  op.user_data  = user_data;
+  return this->submit_async(&op);
+}
+
+int Dionysus::submit_write_memory(uint32_t address, uint8_t *buffer, uint32_t size, dionysus_callback_t callback, void *user_data){
+  arbiter_op_t op;
+  arbiter_op_init(&op, OP_WRITE_MEM);
+  op.addr       = address;
+  op.buffer     = buffer;
+  op.size       = size;
+  op.callback   = callback;
+  op.user_data  = user_data;
+  return this->submit_async(&op);
+}
+
+int Dionysus::submit_read_memory(uint32_t address, uint8_t *buffer, uint32_t size, dionysus_callback_t callback, void *user_data){
+  arbiter_op_t op;
+  arbiter_op_init(&op, OP_READ_MEM);
+  op.addr       = address;
+  op.buffer     = buffer;
+  op.size       = size;
+  op.callback   = callback;
+  op.user_data  = user_data;
+  return this->submit_async(&op);
+}
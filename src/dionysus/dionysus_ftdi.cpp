@@ -15,6 +15,9 @@ int Dionysus::strobe_pin(unsigned char pin){
   if (this->debug) printf ("Strobe signal\n");
   retval = ftdi_set_bitmode(this->ftdi, 0x00, BITMODE_BITBANG);
     CHECK_ERROR("Failed to reset Bitmode");
+  //Interface A left the synchronous FIFO mode
+  this->comm_mode = false;
+  this->state->ftdi_config.bitmode = BITMODE_BITBANG;
 
   ftdi_context *bb_ftdi;
   bb_ftdi = ftdi_new();
@@ -54,7 +57,6 @@ int Dionysus::strobe_pin(unsigned char pin){
     CHECK_ERROR("Failed to disable bitbang mode");
   ftdi_usb_close(bb_ftdi);
   ftdi_free(bb_ftdi);
-  this->comm_mode = false;
   return 0;
 }
 
@@ -1,6 +1,9 @@
 #ifndef __DIONYSUS_LOCAL_H__
 #define __DIONYSUS_LOCAL_H__
 #include "dionysus.hpp"
+#include <deque>
+#include <vector>
+#include <pthread.h>
 
 #define RESET_BUTTON 0x40
 #define PROGRAM_BUTTON 0x10
@@ -16,6 +19,74 @@
 #define BUFFER_SIZE 512
 //#define BUFFER_SIZE DEFAULT_BUFFER_SIZE
 
+//Every packet from the FTDI chip starts with two modem status bytes
+#define MODEM_STATUS_LEN 2
+#define READ_PAYLOAD_SIZE (BUFFER_SIZE - MODEM_STATUS_LEN)
+//Extra read transfers submitted beyond the expected response size
+#define DEFAULT_READ_PREFETCH 1
+
+//Bulk read mode, large transfers made up of many FTDI packets
+#define FTDI_PACKET_SIZE 512
+#define FTDI_PACKET_PAYLOAD (FTDI_PACKET_SIZE - MODEM_STATUS_LEN)
+#define BULK_BUFFER_SIZE 65536
+#define BULK_NUM_TRANSFERS 16
+//Arena buffers that callers can borrow for large payloads
+#define USER_BUFFER_SIZE (1 << 20)
+#define USER_NUM_BUFFERS 2
+#define DEFAULT_BULK_TRANSFER_SIZE 16384
+//Responses at least this large use the bulk read mode
+#define DEFAULT_BULK_READ_THRESHOLD 16384
+
+//Writes are split into chunks with a limited number in flight
+#define DEFAULT_WRITE_CHUNK_SIZE 16384
+#define DEFAULT_WRITE_TRANSFERS 8
+
+//Asynchronous operations queued at once
+#define MAX_ASYNC_OPS 64
+//How long a blocking call waiting on asynchronous operations handles events
+#define ASYNC_WAIT_US 10000
+
+//Latency timer used in synchronous FIFO mode (ms)
+#define COMM_LATENCY_TIMER 2
+
+//Posted writes are acknowledged in groups of up to this many
+#define MAX_POSTED_WRITES MAX_PIPELINE_DEPTH
+
+//Link tuning, throughput profile
+#define THROUGHPUT_LATENCY_TIMER 8
+#define THROUGHPUT_BULK_READ_THRESHOLD 4096
+#define THROUGHPUT_READ_PREFETCH 2
+//Operations this large (or an average this large) switch to throughput
+#define TUNE_THROUGHPUT_SIZE 16384
+//The average has to drop below this to switch back to low latency
+#define TUNE_LATENCY_SIZE 2048
+//Running average weight of a new operation: 1 / 2^TUNE_AVERAGE_SHIFT
+#define TUNE_AVERAGE_SHIFT 3
+
+//Link QoS, bulk memory operations go out in slices of this size so
+//register operations can get in between
+#define DEFAULT_QOS_SLICE_SIZE 65536
+//Bytes each class may move in a round while the other class is waiting
+#define DEFAULT_QOS_CONTROL_BUDGET 4096
+#define DEFAULT_QOS_BULK_BUDGET DEFAULT_QOS_SLICE_SIZE
+//Link cost charged for every operation on top of its data (command header)
+#define QOS_OP_COST 16
+
+//How often the event thread checks if it should stop
+#define EVENT_THREAD_POLL_US 100000
+//Buckets of the event thread wake up latency histogram (powers of two us)
+#define LATENCY_BUCKETS 20
+//Period of the timer the event thread measures its wake up latency with
+#define LATENCY_SAMPLE_US 1000
+//libusb file descriptors the event thread polls
+#define EVENT_THREAD_MAX_FDS 16
+
+//Maximum number of commands queued before a pipeline is flushed
+#define MAX_PIPELINE_DEPTH 64
+//Responses queued in a pipeline must fit in the FTDI receive buffer, otherwise
+//the FPGA stalls on its output and stops accepting the commands behind it
+#define PIPELINE_RESPONSE_LIMIT FTDI_BUFFER_SIZE
+
 #define ID    0xCD
 #define PING  0x00
 #define WRITE 0x01
@@ -99,10 +170,198 @@ struct _response_header_t {
 };
 
 
+/*
+ * A single command and the context of its response, pipelined commands
+ * each get their own request so responses can be completed individually
+ */
+struct _request_t {
+  command_header_t command_header;
+  response_header_t response_header;
+  //Length of the command header and the expected response header
+  uint32_t header_len;
+  uint32_t response_header_len;
+  //Write: payload to send, Read: where to put the response data
+  uint8_t * buffer;
+  uint32_t size;
+  bool read;
+  //Offset of a queued write payload in the pipeline data
+  uint32_t data_offset;
+
+  uint32_t header_pos;
+  uint32_t buffer_pos;
+  int error;
+};
+
+typedef struct _response_parser_t response_parser_t;
+typedef void (*response_parser_cb_t)( response_parser_t *parser,
+                                      int event,
+                                      const uint8_t *data,
+                                      uint32_t length);
+
+#define RESPONSE_EVENT_HEADER 0
+#define RESPONSE_EVENT_DATA   1
+#define RESPONSE_EVENT_DONE   2
+#define RESPONSE_EVENT_DESYNC 3
+
+#define RESPONSE_PHASE_ID     0
+#define RESPONSE_PHASE_STATUS 1
+#define RESPONSE_PHASE_HEADER 2
+#define RESPONSE_PHASE_DATA   3
+
+/*
+ * Resumable parser for the response stream
+ */
+struct _response_parser_t {
+  int phase;
+  response_header_t header;
+  uint32_t header_pos;
+  uint32_t header_size;
+  uint32_t data_size;
+  uint32_t data_pos;
+
+  //Statistics
+  uint32_t response_count;
+  uint32_t desync_count;
+
+  response_parser_cb_t callback;
+  void * user_data;
+};
+
+/*
+ * Transfer setup of the low latency profile, what set_bulk_read(),
+ * set_write_chunks() and set_read_prefetch() configured
+ */
+typedef struct _link_config_t link_config_t;
+struct _link_config_t {
+  uint32_t bulk_transfer_size;
+  uint32_t bulk_transfer_count;
+  uint32_t bulk_threshold;
+  uint32_t write_chunk_size;
+  uint32_t write_transfer_count;
+  uint32_t read_prefetch;
+};
+
+/*
+ * Configuration the FTDI chip is known to be in
+ */
+struct _ftdi_config_t {
+  bool valid;
+  unsigned char bitmode;
+  unsigned char latency;
+  //The FTDI buffers need to be purged before the next transaction
+  bool purge;
+};
+
+/*
+ * Fixed size buffers carved out of the arena, free buffers are linked
+ * through their first bytes
+ */
+struct _buffer_pool_t {
+  uint8_t * base;
+  uint32_t buffer_size;
+  uint32_t count;
+  uint8_t * free_list;
+  uint32_t free_count;
+};
+
+/*
+ * All transfer buffers live in one block of (DMA capable) memory
+ */
+struct _usb_arena_t {
+  uint8_t * memory;
+  size_t size;
+  //memory came from libusb_dev_mem_alloc instead of the heap
+  bool dev_mem;
+  //memory is locked in RAM
+  bool locked;
+  buffer_pool_t read_pool;
+  buffer_pool_t bulk_pool;
+  buffer_pool_t user_pool;
+
+  struct libusb_transfer * transfers[NUM_TRANSFERS];
+  //free transfers are linked through their user_data
+  struct libusb_transfer * free_transfers;
+  uint32_t free_transfer_count;
+};
+
+struct _write_segment_t {
+  uint8_t * data;
+  uint32_t size;
+};
+
+/*
+ * Commands queued to be sent back to back
+ */
+struct _pipeline_t {
+  request_t requests[MAX_PIPELINE_DEPTH];
+  uint32_t count;
+  uint32_t response_size;
+  //Copy write payloads when they are queued so the caller can keep going
+  bool copy_data;
+  std::vector<uint8_t> data;
+  write_segment_t segments[MAX_PIPELINE_DEPTH * 2];
+};
+
+#define OP_WRITE_PERIPH     0
+#define OP_READ_PERIPH      1
+#define OP_WRITE_MEM        2
+#define OP_READ_MEM         3
+#define OP_PING             4
+#define OP_INTERRUPTS       5
+#define OP_STROBE           6
+#define OP_BEGIN_PIPELINE   7
+#define OP_FLUSH            8
+#define OP_END_PIPELINE     9
+#define OP_FLUSH_POSTED     10
+
+/*
+ * An operation waiting for the link, lives on the stack of the caller
+ */
+struct _arbiter_op_t {
+  int type;
+  uint32_t dev_addr;
+  uint32_t addr;
+  uint8_t * buffer;
+  uint32_t size;
+  uint32_t timeout;
+  uint32_t * interrupts;
+  //Peripheral write that returns without waiting for the acknowledgement
+  bool posted;
+  //Read that stays in the pipeline, its buffer outlives the call
+  bool deferred;
+  //Link QoS class and when the operation was queued
+  int qos_class;
+  struct timeval queued;
+  bool started;
+
+  pthread_t thread;
+  int result;
+  bool done;
+  arbiter_op_t * next;
+
+  //Asynchronous operations
+  dionysus_callback_t callback;
+  void * user_data;
+};
+
+#define ASYNC_PHASE_IDLE    0
+#define ASYNC_PHASE_WRITE   1
+#define ASYNC_PHASE_READ    2
+#define ASYNC_PHASE_FAILED  3
+#define ASYNC_PHASE_DRAIN   4
+
+/*
+ * A finished asynchronous operation waiting for its callback
+ */
+struct _async_done_t {
+  dionysus_callback_t callback;
+  void * user_data;
+  int result;
+};
+
 struct _state_t {
 
-  std::queue<struct libusb_transfer *> *transfer_queue;
-  std::queue<uint8_t *> *buffer_queue;
+  usb_arena_t arena;
   //Context of FTDI to continue transactions
   struct libusb_context * usb_ctx;
   struct libusb_device_handle * usb_dev;
@@ -111,26 +370,97 @@ struct _state_t {
 
   uint32_t transfer_index;
 
-  //Dionysus Memory Buffer used to store data
-  uint8_t * buffer;
-  uint32_t buffer_size;
-  uint32_t buffer_pos;
-
-  uint32_t header_pos;
-  uint32_t header_size;
+  //Requests whose responses are being read, in the order they were sent
+  request_t * requests;
+  uint32_t request_count;
+  uint32_t request_index;
+  //Context used by single (non pipelined) reads
+  request_t request;
+  response_parser_t parser;
+  //Request the response being parsed belongs to
+  request_t * response_request;
+  //Interrupt packets that arrived while reading other responses
+  bool response_interrupt;
+  uint8_t interrupt_data[4];
+  bool interrupt_pending;
+  uint32_t interrupts;
 
   uint32_t usb_total_size;
-  int32_t  usb_size_left;
-  uint32_t usb_pos;
   //USB Total size position
   uint32_t usb_actual_pos;
 
+  //Read transfers currently submitted to libusb
+  uint32_t transfers_in_flight;
+  uint32_t read_prefetch;
+  bool response_complete;
+
+  //Bulk read mode
+  bool bulk_enable;
+  bool bulk_mode;
+  uint32_t bulk_threshold;
+  uint32_t bulk_transfer_size;
+  uint32_t bulk_transfer_count;
+
+  //Write engine
+  write_segment_t * write_segments;
+  uint32_t write_segment_count;
+  uint32_t write_segment_index;
+  uint32_t write_segment_pos;
+  uint32_t write_completed;
+  uint32_t write_chunk_size;
+  uint32_t write_transfer_count;
+  uint32_t writes_in_flight;
+
+  //Command pipeline, commands queued until the pipeline is flushed
+  bool pipelining;
+  pthread_t pipeline_owner;
+  pipeline_t pipeline;
+  //Operations from different threads sent together by the arbiter
+  pipeline_t batch;
+
+  //Posted writes, acknowledgements that have not been read yet
+  bool posting_writes;
+  pipeline_t posted;
+  int posted_error;
+
+  //Arbiter
+  pthread_mutex_t arbiter_lock;
+  pthread_cond_t arbiter_cond;
+  //One queue per QoS class
+  arbiter_op_t * op_head[QOS_CLASSES];
+  arbiter_op_t * op_tail[QOS_CLASSES];
+  bool arbiter_busy;
+
+  //Link QoS
+  uint32_t qos_slice_size;
+  uint32_t qos_budget[QOS_CLASSES];
+  int64_t qos_credit[QOS_CLASSES];
+  //Bytes of the sliced operation at the head of the bulk queue already sent
+  uint32_t qos_offset;
+  uint32_t qos_slices;
+  uint32_t qos_ops[QOS_CLASSES];
+  uint64_t qos_wait_total_us[QOS_CLASSES];
+  uint32_t qos_wait_max_us[QOS_CLASSES];
+
+  //Asynchronous operations, run one after the other
+  arbiter_op_t async_ops[MAX_ASYNC_OPS];
+  uint32_t async_head;
+  uint32_t async_count;
+  //Finished operations, their callbacks run from process_events()
+  async_done_t async_done[MAX_ASYNC_OPS];
+  uint32_t async_done_head;
+  uint32_t async_done_count;
+  int async_phase;
+  //Posted write acknowledgements read before the operation starts
+  uint32_t async_drain_count;
+  request_t async_request;
+  write_segment_t async_segments[2];
+
 
   uint32_t read_data_count;
   uint32_t read_dev_addr;
   uint32_t read_reg_addr;
   uint32_t read_mem_addr;
-  bool mem_response;
 
   uint32_t timeout;
   struct timeval timeout_start;
@@ -138,15 +468,65 @@ struct _state_t {
 
   //Reference to the class
   Dionysus *d;
-  bool header_found;
   command_header_t command_header;
   response_header_t response_header;
 
   int finished;
   bool debug;
   int error;
+
+  ftdi_config_t ftdi_config;
+
+  //Link tuning
+  int link_profile;
+  bool link_pinned;
+  int link_wanted;
+  unsigned char link_latency;
+  link_config_t link_config;
+  uint32_t link_average;
+  uint32_t link_switches;
+
+  //Event handling
+  pthread_mutex_t lock;
+  pthread_cond_t finished_cond;
+  pthread_t event_thread;
+  bool event_thread_running;
+  int event_thread_stop;
+  int event_thread_cpu;
+  int event_thread_priority;
+  uint32_t latency_histogram[LATENCY_BUCKETS];
+  uint32_t latency_max_us;
+  uint32_t latency_samples;
 };
 
+//dionysus_stream.cpp
+uint32_t ftdi_strip_modem_status( uint8_t       *dest,
+                                  uint32_t      dest_size,
+                                  const uint8_t *src,
+                                  uint32_t      src_size,
+                                  uint32_t      packet_size);
+void response_parser_init(response_parser_t *parser, response_parser_cb_t callback, void *user_data);
+void response_parser_reset(response_parser_t *parser);
+uint32_t response_parser_feed(response_parser_t *parser, const uint8_t *buffer, uint32_t size);
+uint32_t response_parser_data_left(response_parser_t *parser);
+void response_parser_skip(response_parser_t *parser, uint32_t size);
+void consume_packets(state_t *state, uint8_t *buffer, uint32_t buf_size);
+
+//dionysus_arena.cpp
+void usb_arena_init(usb_arena_t *arena);
+int usb_arena_open(usb_arena_t *arena, struct libusb_device_handle *dev);
+void usb_arena_close(usb_arena_t *arena, struct libusb_device_handle *dev);
+struct libusb_transfer * usb_arena_get_transfer(usb_arena_t *arena);
+void usb_arena_put_transfer(usb_arena_t *arena, struct libusb_transfer *transfer);
+uint8_t * buffer_pool_get(buffer_pool_t *pool);
+void buffer_pool_put(buffer_pool_t *pool, uint8_t *buffer);
+bool buffer_pool_owns(buffer_pool_t *pool, const uint8_t *buffer);
+
+//dionysus_arbiter.cpp
+void arbiter_op_init(arbiter_op_t *op, int type);
 
+//dionysus_nysa.cpp
+uint32_t populate_op_command(command_header_t *ch, arbiter_op_t *op);
+bool op_is_read(arbiter_op_t *op);
 
 #endif
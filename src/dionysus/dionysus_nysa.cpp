@@ -91,75 +91,444 @@ static uint32_t populate_interrupt_command (command_header_t *ch){
   return COMMAND_HEADER_LEN;
 }
 
+/*
+ *  Build the command header for an arbiter operation
+ */
+uint32_t populate_op_command(command_header_t *ch, arbiter_op_t *op){
+  switch (op->type){
+    case (OP_WRITE_PERIPH):
+      return populate_write_periph_command(ch, (op->size / 4), op->dev_addr, op->addr);
+    case (OP_READ_PERIPH):
+      return populate_read_periph_command(ch, (op->size / 4), op->dev_addr, op->addr);
+    case (OP_WRITE_MEM):
+      return populate_write_mem_command(ch, (op->size / 4), op->addr);
+    case (OP_READ_MEM):
+      return populate_read_mem_command(ch, (op->size / 4), op->addr);
+    case (OP_PING):
+      return populate_ping_command(ch);
+    case (OP_INTERRUPTS):
+      return populate_interrupt_command(ch);
+    default:
+      break;
+  }
+  return 0;
+}
 
-//Nysa Overrides
-int Dionysus::write_periph_data(uint32_t dev_addr, uint32_t addr, uint8_t *buffer, uint32_t size){
-  //Construct a packet header
+bool op_is_read(arbiter_op_t *op){
+  return (op->type == OP_READ_PERIPH) || (op->type == OP_READ_MEM);
+}
+
+//Command Pipeline
+
+/*
+ *  Send every queued command and read back all of their responses
+ *
+ *  \retval  0: all fine
+ *          < 0: error
+ */
+int Dionysus::flush_requests(pipeline_t *pipeline){
   int retval = 0;
-  uint32_t header_len = populate_write_periph_command(&this->state->command_header, (size / 4), dev_addr, addr);
-  retval = this->write(header_len, buffer, size);
-    CHECK_ERROR("Failed to Write Data");
-  retval = this->read(header_len, NULL, 0);
-    CHECK_ERROR("Failed to Read Data");
+  uint32_t count = pipeline->count;
+  uint32_t seg_count = 0;
+  request_t * request;
+
+  if (count == 0){
+    return 0;
+  }
+  for (uint32_t i = 0; i < count; i++){
+    request = &pipeline->requests[i];
+    pipeline->segments[seg_count].data = (uint8_t *) &request->command_header;
+    pipeline->segments[seg_count].size = request->header_len;
+    seg_count++;
+    if (!request->read && (request->size > 0)){
+      if (pipeline->copy_data){
+        pipeline->segments[seg_count].data = &pipeline->data[request->data_offset];
+      }
+      else {
+        pipeline->segments[seg_count].data = request->buffer;
+      }
+      pipeline->segments[seg_count].size = request->size;
+      seg_count++;
+    }
+  }
+  if (this->debug){
+    printf ("%s(): Flushing %d commands\n", __func__, count);
+  }
+
+  //The queue is empty from here on, even when the transfer fails
+  pipeline->count = 0;
+  pipeline->response_size = 0;
+
+  retval = this->write_segments(&pipeline->segments[0], seg_count, 1000);
+  if (retval >= 0){
+    retval = this->read_requests(&pipeline->requests[0], count, 1000);
+  }
+  pipeline->data.clear();
+  if (retval < 0){
+    return retval;
+  }
+  memcpy(&this->state->response_header,
+         &pipeline->requests[count - 1].response_header,
+         sizeof(response_header_t));
   return 0;
 }
 
-int Dionysus::read_periph_data(uint32_t dev_addr, uint32_t addr, uint8_t *buffer, uint32_t size){
-  //Construct a packet header
+/*
+ *  Add the command in the state command header to a pipeline, the
+ *  pipeline is flushed first when it is full
+ */
+int Dionysus::queue_request(pipeline_t *pipeline, uint32_t header_len, uint32_t response_header_len, uint8_t *buffer, uint32_t size, bool read){
   int retval = 0;
-  uint32_t header_len = populate_read_periph_command(&this->state->command_header, (size / 4), dev_addr, addr);
-  //retval = this->write_sync((uint8_t *) &this->state->command_header, header_len);
-  retval = this->write(header_len, NULL, 0);
-  //retval = this->write(header_len, buffer, size);
-    CHECK_ERROR("Failed to Write Data");
-  retval = this->read(RESPONSE_HEADER_LEN, buffer, size);
-    CHECK_ERROR("Failed to Read Data");
+  request_t * request;
+  uint32_t response_size = response_header_len;
+  if (read){
+    response_size += size;
+  }
+
+  if ((pipeline->count >= MAX_PIPELINE_DEPTH) ||
+      ((pipeline->count > 0) &&
+       ((pipeline->response_size + response_size) > PIPELINE_RESPONSE_LIMIT))){
+    retval = this->flush_requests(pipeline);
+    if (retval < 0){
+      return retval;
+    }
+  }
+
+  request = &pipeline->requests[pipeline->count];
+  memcpy(&request->command_header, &this->state->command_header, sizeof(command_header_t));
+  memset(&request->response_header, 0, sizeof(response_header_t));
+  request->header_len           = header_len;
+  request->response_header_len  = response_header_len;
+  request->size                 = size;
+  request->read                 = read;
+  request->data_offset          = 0;
+  request->buffer               = buffer;
+  if (!read && (size > 0) && pipeline->copy_data){
+    //Keep a copy so the caller can reuse the buffer right away
+    request->buffer = NULL;
+    request->data_offset = pipeline->data.size();
+    pipeline->data.insert(pipeline->data.end(), buffer, buffer + size);
+  }
+  pipeline->count++;
+  pipeline->response_size += response_size;
   return 0;
+}
 
+/*
+ *  Start queueing commands instead of sending them one at a time
+ *    Writes from the calling thread are held until the pipeline is flushed,
+ *    then all of the commands are sent back to back and the responses are
+ *    read in a single pass. Write data is copied when queued. A read flushes
+ *    the pipeline so its buffer is filled when it returns, reads queued with
+ *    queue_read_periph_data are held like writes and only filled on flush
+ *
+ *  \retval  0: all fine
+ *          -1: another thread has a pipeline open
+ */
+int Dionysus::begin_pipeline(){
+  arbiter_op_t op;
+  arbiter_op_init(&op, OP_BEGIN_PIPELINE);
+  return this->submit_op(&op);
 }
 
-int Dionysus::write_memory(uint32_t address, uint8_t *buffer, uint32_t size){
-  //Construct a packet header
-  int retval = 0;
-  uint32_t header_len = populate_write_mem_command(&this->state->command_header, (size / 4), address);
-  retval = this->write(header_len, buffer, size);
-    CHECK_ERROR("Failed to Write Data");
-  retval = this->read(RESPONSE_HEADER_LEN, NULL, 0);
-    CHECK_ERROR("Failed to Read Data");
+/*
+ *  Flush the queued commands and go back to sending commands one at a time
+ *
+ *  \retval  0: all fine
+ *          < 0: error while flushing
+ */
+int Dionysus::end_pipeline(){
+  arbiter_op_t op;
+  arbiter_op_init(&op, OP_END_PIPELINE);
+  return this->submit_op(&op);
+}
+
+int Dionysus::flush_pipeline(){
+  arbiter_op_t op;
+  arbiter_op_init(&op, OP_FLUSH);
+  return this->submit_op(&op);
+}
+
+bool Dionysus::is_pipelining(){
+  bool pipelining = false;
+  pthread_mutex_lock(&this->state->arbiter_lock);
+  pipelining = this->state->pipelining &&
+               pthread_equal(this->state->pipeline_owner, pthread_self());
+  pthread_mutex_unlock(&this->state->arbiter_lock);
+  return pipelining;
+}
+
+/*
+ *  Operations from the thread that opened the pipeline are queued in it
+ */
+bool Dionysus::owns_pipeline(arbiter_op_t *op){
+  return this->state->pipelining &&
+         pthread_equal(this->state->pipeline_owner, op->thread);
+}
+
+/*
+ *  Posted Writes
+ *    Peripheral writes return as soon as the command is on the bus, their
+ *    acknowledgements pile up in the chip and are read back in a single
+ *    pass when the window is full, before any other operation goes on the
+ *    link or on flush(). A failed acknowledgement is held until the next
+ *    operation (or flush) and reported there
+ */
+
+/*
+ *  Remember the acknowledgement of the command in the state command header
+ */
+int Dionysus::post_request(uint32_t header_len){
+  pipeline_t * posted = &this->state->posted;
+  request_t * request = &posted->requests[posted->count];
+  memcpy(&request->command_header, &this->state->command_header, sizeof(command_header_t));
+  memset(&request->response_header, 0, sizeof(response_header_t));
+  request->header_len           = header_len;
+  request->response_header_len  = RESPONSE_HEADER_LEN;
+  request->buffer               = NULL;
+  request->size                 = 0;
+  request->read                 = false;
+  request->data_offset          = 0;
+  posted->count++;
   return 0;
 }
-int Dionysus::read_memory(uint32_t address, uint8_t *buffer, uint32_t size){
-  //Construct a packet header
+
+/*
+ *  Read back and check the acknowledgements of all posted writes, the first
+ *  failure is kept until take_posted_error() reports it
+ */
+int Dionysus::drain_posted_writes(){
+  pipeline_t * posted = &this->state->posted;
+  uint32_t count = posted->count;
   int retval = 0;
-  uint32_t header_len = populate_read_mem_command(&this->state->command_header, (size / 4), address);
-  //retval = this->write_sync((uint8_t *) &this->state->command_header, header_len);
-  retval = this->write(header_len, NULL, 0);
-    CHECK_ERROR("Failed to Write Data");
-  retval = this->read(RESPONSE_HEADER_LEN, buffer, size);
-    CHECK_ERROR("Failed to Read Data");
+
+  if (count == 0){
+    return 0;
+  }
+  if (this->debug){
+    printf ("%s(): Checking %d posted writes\n", __func__, count);
+  }
+  posted->count = 0;
+  retval = this->read_requests(&posted->requests[0], count, 1000);
+  return this->check_posted_writes(retval, count);
+}
+
+/*
+ *  Look at the acknowledgements of 'count' posted writes after they were
+ *  read back, 'retval' is the result of the read
+ */
+int Dionysus::check_posted_writes(int retval, uint32_t count){
+  pipeline_t * posted = &this->state->posted;
+  if (retval >= 0){
+    for (uint32_t i = 0; i < count; i++){
+      if (posted->requests[i].error < 0){
+        retval = posted->requests[i].error;
+        break;
+      }
+    }
+  }
+  if ((retval < 0) && (this->state->posted_error == 0)){
+    this->state->posted_error = retval;
+  }
+  return (retval < 0) ? retval : 0;
+}
+
+int Dionysus::take_posted_error(){
+  int retval = this->state->posted_error;
+  this->state->posted_error = 0;
+  return retval;
+}
+
+/*
+ *  Let peripheral writes return before they are acknowledged
+ *    Errors of posted writes are returned by a later operation or flush(),
+ *    turning posting off does not wait for the outstanding writes
+ */
+void Dionysus::set_posted_writes(bool enable){
+  pthread_mutex_lock(&this->state->arbiter_lock);
+  this->state->posting_writes = enable;
+  pthread_mutex_unlock(&this->state->arbiter_lock);
+}
+
+bool Dionysus::is_posting_writes(){
+  return this->state->posting_writes;
+}
+
+/*
+ *  Number of posted writes that have not been acknowledged yet
+ */
+uint32_t Dionysus::get_posted_count(){
+  uint32_t count = 0;
+  pthread_mutex_lock(&this->state->arbiter_lock);
+  count = this->state->posted.count;
+  pthread_mutex_unlock(&this->state->arbiter_lock);
+  return count;
+}
+
+/*
+ *  Wait for all posted writes to be acknowledged
+ *
+ *  \retval  0: all fine
+ *          < 0: error from a posted write
+ */
+int Dionysus::flush(){
+  arbiter_op_t op;
+  arbiter_op_init(&op, OP_FLUSH_POSTED);
+  return this->submit_op(&op);
+}
+
+/*
+ *  Run a group of reads and writes from different threads as one
+ *  pipelined burst, the callers are all waiting so write data is sent
+ *  straight from their buffers
+ */
+int Dionysus::execute_batch(arbiter_op_t **ops, uint32_t count){
+  int retval = 0;
+  uint32_t header_len = 0;
+  uint32_t size = 0;
+  this->drain_posted_writes();
+  retval = this->take_posted_error();
+    CHECK_ERROR("Posted Write Failed");
+  for (uint32_t i = 0; i < count; i++){
+    size += ops[i]->size;
+  }
+  this->tune_link(size);
+  for (uint32_t i = 0; i < count; i++){
+    header_len = populate_op_command(&this->state->command_header, ops[i]);
+    retval = this->queue_request( &this->state->batch,
+                                  header_len,
+                                  RESPONSE_HEADER_LEN,
+                                  ops[i]->buffer,
+                                  ops[i]->size,
+                                  op_is_read(ops[i]));
+      CHECK_ERROR("Failed to Queue Request");
+  }
+  retval = this->flush_requests(&this->state->batch);
+    CHECK_ERROR("Failed to Flush Batch");
   return 0;
 }
 
-int Dionysus::wait_for_interrupts(uint32_t timeout, uint32_t *interrupts){
+/*
+ *  Run a single operation on the link, only called by the arbiter
+ */
+int Dionysus::execute_op(arbiter_op_t *op){
+  int retval = 0;
+  uint32_t header_len = 0;
+  bool posted = op->posted && !this->owns_pipeline(op);
+  //Anything but another posted write needs the link to itself
+  if (!posted || (this->state->posted.count >= MAX_POSTED_WRITES)){
+    this->drain_posted_writes();
+  }
+  retval = this->take_posted_error();
+    CHECK_ERROR("Posted Write Failed");
+  switch (op->type){
+    case (OP_WRITE_PERIPH):
+    case (OP_READ_PERIPH):
+    case (OP_WRITE_MEM):
+    case (OP_READ_MEM):
+      this->tune_link(op->size);
+      //Construct a packet header
+      header_len = populate_op_command(&this->state->command_header, op);
+      if (this->owns_pipeline(op)){
+        retval = this->queue_request( &this->state->pipeline,
+                                      header_len,
+                                      RESPONSE_HEADER_LEN,
+                                      op->buffer,
+                                      op->size,
+                                      op_is_read(op));
+          CHECK_ERROR("Failed to Queue Request");
+        if (op_is_read(op) && !op->deferred){
+          //A read is a barrier, the caller may be about to use its buffer
+          retval = this->flush_requests(&this->state->pipeline);
+            CHECK_ERROR("Failed to Flush Pipeline");
+        }
+        return 0;
+      }
+      if (op_is_read(op)){
+        retval = this->write(header_len, NULL, 0);
+          CHECK_ERROR("Failed to Write Data");
+        retval = this->read(RESPONSE_HEADER_LEN, op->buffer, op->size);
+          CHECK_ERROR("Failed to Read Data");
+      }
+      else if (posted){
+        retval = this->write(header_len, op->buffer, op->size);
+          CHECK_ERROR("Failed to Write Data");
+        return this->post_request(header_len);
+      }
+      else {
+        retval = this->write(header_len, op->buffer, op->size);
+          CHECK_ERROR("Failed to Write Data");
+        retval = this->read(RESPONSE_HEADER_LEN, NULL, 0);
+          CHECK_ERROR("Failed to Read Data");
+      }
+      return 0;
+    case (OP_INTERRUPTS):
+      return this->execute_wait_for_interrupts(op);
+    case (OP_PING):
+      return this->execute_ping(op);
+    case (OP_STROBE):
+      return this->strobe_pin((unsigned char) op->addr);
+    case (OP_BEGIN_PIPELINE):
+      if (this->state->pipelining && !this->owns_pipeline(op)){
+        return -1;
+      }
+      this->state->pipelining = true;
+      this->state->pipeline_owner = op->thread;
+      return 0;
+    case (OP_FLUSH):
+    case (OP_END_PIPELINE):
+      if (!this->owns_pipeline(op)){
+        return 0;
+      }
+      retval = this->flush_requests(&this->state->pipeline);
+      if (op->type == OP_END_PIPELINE){
+        this->state->pipelining = false;
+      }
+      return retval;
+    case (OP_FLUSH_POSTED):
+      //The acknowledgements were checked on the way in
+      return 0;
+    default:
+      break;
+  }
+  return -1;
+}
+
+int Dionysus::execute_wait_for_interrupts(arbiter_op_t *op){
   //Construct a packet header
   int retval = 0;
   uint32_t header_len = populate_interrupt_command(&this->state->command_header);
-  uint8_t buffer[RESPONSE_INT_HEADER_LEN];
   uint8_t local_interrupts[4];
-  *interrupts = 0;
-  retval = this->read(RESPONSE_INT_HEADER_LEN, (uint8_t *) &local_interrupts, 4, timeout);
+  *op->interrupts = 0;
+  //Interrupts are not ordered with the queued commands, send those first
+  if (this->owns_pipeline(op)){
+    retval = this->flush_requests(&this->state->pipeline);
+      CHECK_ERROR("Failed to Flush Pipeline");
+  }
+  if (this->state->interrupt_pending){
+    //An interrupt packet already came in with another response
+    *op->interrupts = this->state->interrupts;
+    this->state->interrupts = 0;
+    this->state->interrupt_pending = false;
+    return 0;
+  }
+  retval = this->read(RESPONSE_INT_HEADER_LEN, (uint8_t *) &local_interrupts, 4, op->timeout);
     CHECK_ERROR("Failed to Read Data");
 
-  *interrupts = local_interrupts[0] << 24 | \
-                local_interrupts[1] << 16 | \
-                local_interrupts[2] << 8  | \
-                local_interrupts[3];
+  *op->interrupts = local_interrupts[0] << 24 | \
+                    local_interrupts[1] << 16 | \
+                    local_interrupts[2] << 8  | \
+                    local_interrupts[3];
   return 0;
 }
 
-int Dionysus::ping(){
+int Dionysus::execute_ping(arbiter_op_t *op){
   if (this->debug) printf ("Ping...\n");
   int retval = 0;
+  if (this->owns_pipeline(op)){
+    retval = this->flush_requests(&this->state->pipeline);
+      CHECK_ERROR("Failed to Flush Pipeline");
+  }
   uint32_t len  = populate_ping_command(&this->state->command_header);
   //printf ("Length of write transfer: %d\n", len);
   retval = this->write(len, NULL, 0);
@@ -187,6 +556,76 @@ int Dionysus::ping(){
   return 0;
 }
 
+//Nysa Overrides, every operation goes through the arbiter
+int Dionysus::write_periph_data(uint32_t dev_addr, uint32_t addr, uint8_t *buffer, uint32_t size){
+  arbiter_op_t op;
+  arbiter_op_init(&op, OP_WRITE_PERIPH);
+  op.dev_addr = dev_addr;
+  op.addr     = addr;
+  op.buffer   = buffer;
+  op.size     = size;
+  op.posted   = this->state->posting_writes;
+  return this->submit_op(&op);
+}
+
+int Dionysus::read_periph_data(uint32_t dev_addr, uint32_t addr, uint8_t *buffer, uint32_t size){
+  arbiter_op_t op;
+  arbiter_op_init(&op, OP_READ_PERIPH);
+  op.dev_addr = dev_addr;
+  op.addr     = addr;
+  op.buffer   = buffer;
+  op.size     = size;
+  return this->submit_op(&op);
+}
+
+/*
+ *  Read that stays queued when the calling thread has a pipeline open,
+ *  'buffer' is filled when the pipeline is flushed and must stay valid
+ *  until then. Without a pipeline this is read_periph_data
+ */
+int Dionysus::queue_read_periph_data(uint32_t dev_addr, uint32_t addr, uint8_t *buffer, uint32_t size){
+  arbiter_op_t op;
+  arbiter_op_init(&op, OP_READ_PERIPH);
+  op.dev_addr = dev_addr;
+  op.addr     = addr;
+  op.buffer   = buffer;
+  op.size     = size;
+  op.deferred = true;
+  return this->submit_op(&op);
+}
+
+int Dionysus::write_memory(uint32_t address, uint8_t *buffer, uint32_t size){
+  arbiter_op_t op;
+  arbiter_op_init(&op, OP_WRITE_MEM);
+  op.addr     = address;
+  op.buffer   = buffer;
+  op.size     = size;
+  return this->submit_op(&op);
+}
+
+int Dionysus::read_memory(uint32_t address, uint8_t *buffer, uint32_t size){
+  arbiter_op_t op;
+  arbiter_op_init(&op, OP_READ_MEM);
+  op.addr     = address;
+  op.buffer   = buffer;
+  op.size     = size;
+  return this->submit_op(&op);
+}
+
+int Dionysus::wait_for_interrupts(uint32_t timeout, uint32_t *interrupts){
+  arbiter_op_t op;
+  arbiter_op_init(&op, OP_INTERRUPTS);
+  op.timeout    = timeout;
+  op.interrupts = interrupts;
+  return this->submit_op(&op);
+}
+
+int Dionysus::ping(){
+  arbiter_op_t op;
+  arbiter_op_init(&op, OP_PING);
+  return this->submit_op(&op);
+}
+
 int Dionysus::crash_report(uint32_t *buffer){
   return -1;
 }
@@ -0,0 +1,161 @@
+#include "dionysus_local.hpp"
+#include <stdio.h>
+
+//Link QoS, keeps register traffic moving while bulk memory traffic is on the link
+
+/*
+ *  Choose the class of the next operation, called by the arbiter with the
+ *  lock held
+ *
+ *    Classes are visited in order (control first), a class with waiting
+ *    operations goes next as long as it has budget left in this round. When
+ *    every waiting class has used up its budget a new round starts. Control
+ *    traffic goes ahead of bulk traffic but can't starve it
+ *
+ *  \retval class to serve, -1 if nothing is queued
+ */
+int Dionysus::pick_qos_class(){
+  state_t * state = this->state;
+  for (int round = 0; round < 2; round++){
+    for (int i = 0; i < QOS_CLASSES; i++){
+      if ((state->op_head[i] != NULL) && (state->qos_credit[i] > 0)){
+        return i;
+      }
+    }
+    for (int i = 0; i < QOS_CLASSES; i++){
+      state->qos_credit[i] = state->qos_budget[i];
+    }
+  }
+  //Every budget is zero, plain priority order
+  for (int i = 0; i < QOS_CLASSES; i++){
+    if (state->op_head[i] != NULL){
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+ *  True if the operation goes on the link in slices, memory operations
+ *  larger than a slice (memory bus addresses count bytes). Operations
+ *  queued in a command pipeline are not sliced
+ */
+bool Dionysus::op_is_sliced(arbiter_op_t *op){
+  state_t * state = this->state;
+  if ((op->type != OP_WRITE_MEM) && (op->type != OP_READ_MEM)){
+    return false;
+  }
+  if (this->owns_pipeline(op)){
+    return false;
+  }
+  if ((op == state->op_head[op->qos_class]) && (state->qos_offset > 0)){
+    //Already started
+    return true;
+  }
+  return (state->qos_slice_size > 0) && (op->size > state->qos_slice_size);
+}
+
+/*
+ *  An operation is about to go on the link, record how long it waited
+ */
+void Dionysus::start_qos_op(arbiter_op_t *op){
+  state_t * state = this->state;
+  struct timeval now;
+  uint32_t wait_us = 0;
+  if (op->started){
+    return;
+  }
+  op->started = true;
+  gettimeofday(&now, NULL);
+  wait_us = (now.tv_sec - op->queued.tv_sec) * 1000000 + (now.tv_usec - op->queued.tv_usec);
+  state->qos_ops[op->qos_class]++;
+  state->qos_wait_total_us[op->qos_class] += wait_us;
+  if (wait_us > state->qos_wait_max_us[op->qos_class]){
+    state->qos_wait_max_us[op->qos_class] = wait_us;
+  }
+}
+
+/*
+ *  Take the bytes an operation moved out of its class budget
+ */
+void Dionysus::charge_qos(int qos_class, uint32_t size){
+  this->state->qos_credit[qos_class] -= size;
+}
+
+/*
+ *  Size of the slices bulk memory operations are cut into
+ *
+ *  \param size: bytes per slice, 0 sends every operation in one piece
+ *
+ *  \retval  0: all fine
+ */
+int Dionysus::set_qos_slice_size(uint32_t size){
+  pthread_mutex_lock(&this->state->arbiter_lock);
+  this->state->qos_slice_size = size;
+  pthread_mutex_unlock(&this->state->arbiter_lock);
+  return 0;
+}
+
+uint32_t Dionysus::get_qos_slice_size(){
+  return this->state->qos_slice_size;
+}
+
+/*
+ *  Bytes a class may move in a round while another class is waiting
+ *
+ *  \param qos_class: QOS_CLASS_CONTROL or QOS_CLASS_BULK
+ *  \param size: budget in bytes (every operation also costs QOS_OP_COST)
+ *
+ *  \retval  0: all fine
+ *          -1: unknown class
+ */
+int Dionysus::set_qos_budget(int qos_class, uint32_t size){
+  if ((qos_class < 0) || (qos_class >= QOS_CLASSES)){
+    return -1;
+  }
+  pthread_mutex_lock(&this->state->arbiter_lock);
+  this->state->qos_budget[qos_class] = size;
+  this->state->qos_credit[qos_class] = size;
+  pthread_mutex_unlock(&this->state->arbiter_lock);
+  return 0;
+}
+
+/*
+ *  Time operations of a class waited in the queue before they went on the
+ *  link
+ *
+ *  \param qos_class: QOS_CLASS_CONTROL or QOS_CLASS_BULK
+ *  \param average_us: average wait in us
+ *  \param max_us: longest wait in us
+ *
+ *  \retval number of operations measured
+ *          -1: unknown class
+ */
+int Dionysus::get_qos_latency(int qos_class, uint32_t *average_us, uint32_t *max_us){
+  uint32_t count = 0;
+  if ((qos_class < 0) || (qos_class >= QOS_CLASSES)){
+    return -1;
+  }
+  pthread_mutex_lock(&this->state->arbiter_lock);
+  count = this->state->qos_ops[qos_class];
+  *average_us = (count > 0) ? (uint32_t) (this->state->qos_wait_total_us[qos_class] / count) : 0;
+  *max_us = this->state->qos_wait_max_us[qos_class];
+  pthread_mutex_unlock(&this->state->arbiter_lock);
+  return count;
+}
+
+/*
+ *  Number of slices bulk operations were cut into
+ */
+uint32_t Dionysus::get_qos_slices(){
+  return this->state->qos_slices;
+}
+
+void Dionysus::reset_qos_stats(){
+  this->state->qos_slices = 0;
+  for (int i = 0; i < QOS_CLASSES; i++){
+    this->state->qos_ops[i]           = 0;
+    this->state->qos_wait_total_us[i] = 0;
+    this->state->qos_wait_max_us[i]   = 0;
+  }
+}
@@ -0,0 +1,309 @@
+#include "dionysus_local.hpp"
+#include <string.h>
+//DIONYSUS_NO_SIMD builds the plain memcpy path (the stream tests run both)
+#if defined(__SSE2__) && !defined(DIONYSUS_NO_SIMD)
+#define DIONYSUS_SSE2
+#include <emmintrin.h>
+#endif
+
+//Byte stream helpers for data coming back from the FTDI chip
+
+/*
+ *  Copy one packet worth of payload, large packets are moved 32 bytes at a
+ *  time with unaligned vector loads/stores, the tail is left to memcpy
+ */
+static inline void copy_payload(uint8_t *dest, const uint8_t *src, uint32_t length){
+#if defined(DIONYSUS_SSE2)
+  while (length >= 32){
+    __m128i a = _mm_loadu_si128((const __m128i *) &src[0]);
+    __m128i b = _mm_loadu_si128((const __m128i *) &src[16]);
+    _mm_storeu_si128((__m128i *) &dest[0], a);
+    _mm_storeu_si128((__m128i *) &dest[16], b);
+    src     += 32;
+    dest    += 32;
+    length  -= 32;
+  }
+#endif
+  memcpy(dest, src, length);
+}
+
+/*
+ *  Compact a buffer of FTDI packets into a contiguous payload
+ *    Every 'packet_size' bytes of a bulk IN transfer begin with two modem
+ *    status bytes, the last packet may be short
+ *
+ *  \param dest: output buffer
+ *  \param dest_size: maximum number of bytes to write to dest
+ *  \param src: raw transfer buffer (must start on a packet boundary)
+ *  \param src_size: number of bytes in src (transfer actual length)
+ *  \param packet_size: size of an FTDI packet (max packet size of the
+ *    endpoint)
+ *
+ *  \retval number of payload bytes written to dest
+ */
+uint32_t ftdi_strip_modem_status( uint8_t       *dest,
+                                  uint32_t      dest_size,
+                                  const uint8_t *src,
+                                  uint32_t      src_size,
+                                  uint32_t      packet_size){
+  uint32_t written = 0;
+  uint32_t packet_len = 0;
+  uint32_t payload = 0;
+
+  while ((src_size > MODEM_STATUS_LEN) && (written < dest_size)){
+    packet_len = (src_size < packet_size) ? src_size : packet_size;
+    payload = packet_len - MODEM_STATUS_LEN;
+    if (payload > (dest_size - written)){
+      payload = dest_size - written;
+    }
+    copy_payload(&dest[written], &src[MODEM_STATUS_LEN], payload);
+    written   += payload;
+    src       += packet_len;
+    src_size  -= packet_len;
+  }
+  return written;
+}
+
+/*
+ *  Process a completed read transfer, the transfer is a sequence of FTDI
+ *  packets that each start with the modem status
+ *
+ *  Packets are handed to the response parser one at a time, while a
+ *  request is waiting on a large amount of data whole packets are compacted
+ *  straight into its buffer
+ */
+void consume_packets(state_t *state, uint8_t *buffer, uint32_t buf_size){
+  request_t * request;
+  uint32_t packet_len = 0;
+  uint32_t length = 0;
+  uint32_t data_left = 0;
+  uint32_t cpy_size = 0;
+
+  while (buf_size > 0){
+    request = state->response_request;
+    data_left = response_parser_data_left(&state->parser);
+    if ((request != NULL) &&
+        request->read &&
+        (request->buffer != NULL) &&
+        (data_left > 0)){
+      if (data_left > (request->size - request->buffer_pos)){
+        data_left = request->size - request->buffer_pos;
+      }
+      //Only hand over whole packets that fit in what the request is waiting for
+      length = (data_left / FTDI_PACKET_PAYLOAD) * FTDI_PACKET_SIZE;
+      if (length > buf_size){
+        length = buf_size;
+      }
+      if (length > 0){
+        cpy_size = ftdi_strip_modem_status( &request->buffer[request->buffer_pos],
+                                            data_left,
+                                            buffer,
+                                            length,
+                                            FTDI_PACKET_SIZE);
+        request->buffer_pos += cpy_size;
+        state->usb_actual_pos += cpy_size;
+        response_parser_skip(&state->parser, cpy_size);
+        buffer = &buffer[length];
+        buf_size -= length;
+        continue;
+      }
+    }
+    packet_len = (buf_size < FTDI_PACKET_SIZE) ? buf_size : FTDI_PACKET_SIZE;
+    if (packet_len > MODEM_STATUS_LEN){
+      response_parser_feed(&state->parser, &buffer[MODEM_STATUS_LEN], packet_len - MODEM_STATUS_LEN);
+    }
+    buffer = &buffer[packet_len];
+    buf_size -= packet_len;
+  }
+}
+
+/*
+ *  Response Parser
+ *    Resumable decoder for the 0xDC response stream, bytes can be fed in
+ *    fragments of any size, the parser keeps the partial header between
+ *    calls and reports each response through the callback:
+ *
+ *    RESPONSE_EVENT_HEADER: header is complete, parser->data_size holds the
+ *      number of data bytes that follow, the callback may change it
+ *    RESPONSE_EVENT_DATA: a span of data, points into the fed buffer
+ *    RESPONSE_EVENT_DONE: all data of the response has been delivered
+ *    RESPONSE_EVENT_DESYNC: bytes that could not be the start of a response
+ */
+
+void response_parser_reset(response_parser_t *parser){
+  parser->phase       = RESPONSE_PHASE_ID;
+  parser->header_pos  = 0;
+  parser->header_size = 0;
+  parser->data_size   = 0;
+  parser->data_pos    = 0;
+  memset(&parser->header, 0, sizeof(response_header_t));
+}
+
+void response_parser_init(response_parser_t *parser, response_parser_cb_t callback, void *user_data){
+  parser->callback      = callback;
+  parser->user_data     = user_data;
+  parser->response_count = 0;
+  parser->desync_count  = 0;
+  response_parser_reset(parser);
+}
+
+/*
+ *  Header length for a response status, 0 if the status is not a response
+ */
+static uint32_t response_header_size(uint8_t status){
+  switch ((~status) & 0xFF){
+    case (PING):
+      return PING_RESPONSE_HEADER_LEN;
+    case (WRITE):
+    case (MEM_FLAG | WRITE):
+    case (READ):
+    case (MEM_FLAG | READ):
+      return RESPONSE_HEADER_LEN;
+    case (INTERRUPT):
+      return RESPONSE_INT_HEADER_LEN;
+    default:
+      break;
+  }
+  return 0;
+}
+
+/*
+ *  Number of data bytes that follow a complete header
+ */
+static uint32_t response_data_size(response_header_t *header){
+  uint32_t dword_count = 0;
+  switch ((~header->status) & 0xFF){
+    case (READ):
+    case (MEM_FLAG | READ):
+      dword_count =  header->data_count[0] << 16;
+      dword_count |= header->data_count[1] << 8;
+      dword_count |= header->data_count[2];
+      return dword_count * 4;
+    case (INTERRUPT):
+      return 4;
+    default:
+      break;
+  }
+  return 0;
+}
+
+static void response_finish(response_parser_t *parser){
+  parser->response_count++;
+  parser->callback(parser, RESPONSE_EVENT_DONE, NULL, 0);
+  response_parser_reset(parser);
+}
+
+static void response_header_done(response_parser_t *parser){
+  parser->phase     = RESPONSE_PHASE_DATA;
+  parser->data_pos  = 0;
+  parser->data_size = response_data_size(&parser->header);
+  parser->callback(parser, RESPONSE_EVENT_HEADER, NULL, 0);
+  if (parser->data_size == 0){
+    response_finish(parser);
+  }
+}
+
+/*
+ *  Feed response bytes (modem status already removed) to the parser
+ *
+ *  \param parser: parser state
+ *  \param buffer: incomming bytes
+ *  \param size: number of bytes in buffer
+ *
+ *  \retval number of bytes consumed, always size
+ */
+uint32_t response_parser_feed(response_parser_t *parser, const uint8_t *buffer, uint32_t size){
+  uint32_t pos = 0;
+  uint32_t start = 0;
+  uint32_t cpy_size = 0;
+  uint8_t * header = (uint8_t *) &parser->header;
+
+  while (pos < size){
+    switch (parser->phase){
+      case (RESPONSE_PHASE_ID):
+        //Skip anything that can't start a response
+        start = pos;
+        while ((pos < size) && (buffer[pos] != ID_RESPONSE)){
+          pos++;
+        }
+        if (pos > start){
+          parser->desync_count += pos - start;
+          parser->callback(parser, RESPONSE_EVENT_DESYNC, &buffer[start], pos - start);
+        }
+        if (pos < size){
+          header[0] = buffer[pos++];
+          parser->header_pos = 1;
+          parser->phase = RESPONSE_PHASE_STATUS;
+        }
+        break;
+      case (RESPONSE_PHASE_STATUS):
+        parser->header_size = response_header_size(buffer[pos]);
+        if (parser->header_size == 0){
+          //Not a response, the ID byte was noise
+          parser->desync_count++;
+          parser->callback(parser, RESPONSE_EVENT_DESYNC, header, 1);
+          parser->phase = RESPONSE_PHASE_ID;
+          parser->header_pos = 0;
+          //The status byte may be the start of the real response
+          break;
+        }
+        header[1] = buffer[pos++];
+        parser->header_pos = 2;
+        parser->phase = RESPONSE_PHASE_HEADER;
+        if (parser->header_pos >= parser->header_size){
+          response_header_done(parser);
+        }
+        break;
+      case (RESPONSE_PHASE_HEADER):
+        cpy_size = parser->header_size - parser->header_pos;
+        if ((size - pos) < cpy_size){
+          cpy_size = size - pos;
+        }
+        memcpy(&header[parser->header_pos], &buffer[pos], cpy_size);
+        parser->header_pos += cpy_size;
+        pos += cpy_size;
+        if (parser->header_pos >= parser->header_size){
+          response_header_done(parser);
+        }
+        break;
+      case (RESPONSE_PHASE_DATA):
+        cpy_size = parser->data_size - parser->data_pos;
+        if ((size - pos) < cpy_size){
+          cpy_size = size - pos;
+        }
+        parser->callback(parser, RESPONSE_EVENT_DATA, &buffer[pos], cpy_size);
+        parser->data_pos += cpy_size;
+        pos += cpy_size;
+        if (parser->data_pos >= parser->data_size){
+          response_finish(parser);
+        }
+        break;
+    }
+  }
+  return size;
+}
+
+/*
+ *  Number of data bytes the parser still expects for the current response,
+ *  0 when it is not in the data phase
+ */
+uint32_t response_parser_data_left(response_parser_t *parser){
+  if (parser->phase != RESPONSE_PHASE_DATA){
+    return 0;
+  }
+  return parser->data_size - parser->data_pos;
+}
+
+/*
+ *  Account for data bytes that were delivered without going through the
+ *  parser (copied straight out of the transfer buffer)
+ */
+void response_parser_skip(response_parser_t *parser, uint32_t size){
+  if (size > response_parser_data_left(parser)){
+    size = response_parser_data_left(parser);
+  }
+  parser->data_pos += size;
+  if ((parser->phase == RESPONSE_PHASE_DATA) && (parser->data_pos >= parser->data_size)){
+    response_finish(parser);
+  }
+}
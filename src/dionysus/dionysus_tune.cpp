@@ -0,0 +1,121 @@
+#include "dionysus_local.hpp"
+#include <stdio.h>
+
+//Link tuning, switches the transfer setup between small register traffic and bulk memory traffic
+
+/*
+ *  Apply the transfer setup of a profile, the latency timer is changed
+ *  on the next transaction (set_comm_mode)
+ *
+ *  The low latency profile is the setup the application configured with
+ *  set_bulk_read(), set_write_chunks() and set_read_prefetch() (the
+ *  defaults until then), the throughput profile has a fixed setup
+ */
+void Dionysus::apply_link_profile(int profile){
+  state_t * state = this->state;
+  if (profile == LINK_PROFILE_THROUGHPUT){
+    state->link_latency         = THROUGHPUT_LATENCY_TIMER;
+    state->bulk_transfer_size   = BULK_BUFFER_SIZE;
+    state->bulk_transfer_count  = BULK_NUM_TRANSFERS;
+    state->bulk_threshold       = THROUGHPUT_BULK_READ_THRESHOLD;
+    state->write_chunk_size     = BULK_BUFFER_SIZE;
+    state->write_transfer_count = BULK_NUM_TRANSFERS;
+    state->read_prefetch        = THROUGHPUT_READ_PREFETCH;
+  }
+  else {
+    state->link_latency         = COMM_LATENCY_TIMER;
+    state->bulk_transfer_size   = state->link_config.bulk_transfer_size;
+    state->bulk_transfer_count  = state->link_config.bulk_transfer_count;
+    state->bulk_threshold       = state->link_config.bulk_threshold;
+    state->write_chunk_size     = state->link_config.write_chunk_size;
+    state->write_transfer_count = state->link_config.write_transfer_count;
+    state->read_prefetch        = state->link_config.read_prefetch;
+  }
+  if ((state->link_profile != profile) && this->debug){
+    printf ("%s(): Link profile: %s\n", __func__,
+            (profile == LINK_PROFILE_THROUGHPUT) ? "throughput" : "low latency");
+  }
+  state->link_profile = profile;
+  state->link_switches++;
+}
+
+/*
+ *  Feed the size of an operation to the tuner, called before the operation
+ *  goes on the link
+ *
+ *  The tuner keeps a running average of the bytes moved per operation, the
+ *  two thresholds keep a mix of traffic from flipping the profile back and
+ *  forth
+ */
+void Dionysus::tune_link(uint32_t size){
+  state_t * state = this->state;
+  state->link_average = state->link_average - (state->link_average >> TUNE_AVERAGE_SHIFT) + (size >> TUNE_AVERAGE_SHIFT);
+  if (state->link_pinned){
+    if (state->link_profile != state->link_wanted){
+      this->apply_link_profile(state->link_wanted);
+    }
+    return;
+  }
+  if ((state->link_profile != LINK_PROFILE_THROUGHPUT) &&
+      ((size >= TUNE_THROUGHPUT_SIZE) || (state->link_average >= TUNE_THROUGHPUT_SIZE))){
+    this->apply_link_profile(LINK_PROFILE_THROUGHPUT);
+  }
+  else if ((state->link_profile == LINK_PROFILE_THROUGHPUT) &&
+           (size < TUNE_THROUGHPUT_SIZE) &&
+           (state->link_average < TUNE_LATENCY_SIZE)){
+    this->apply_link_profile(LINK_PROFILE_LOW_LATENCY);
+  }
+}
+
+/*
+ *  Choose how the link is set up
+ *
+ *  \param profile:
+ *    LINK_PROFILE_AUTO: follow the traffic (Default)
+ *    LINK_PROFILE_LOW_LATENCY: pin short latency timer and the configured
+ *      transfer setup (set_bulk_read, set_write_chunks, set_read_prefetch)
+ *    LINK_PROFILE_THROUGHPUT: pin long latency timer and large transfers
+ *
+ *  A pinned profile is applied when the next operation goes on the link so
+ *  a transaction in flight keeps its transfer setup
+ *
+ *  \retval  0: all fine
+ *          -1: unknown profile
+ */
+int Dionysus::set_link_profile(int profile){
+  pthread_mutex_lock(&this->state->arbiter_lock);
+  switch (profile){
+    case (LINK_PROFILE_AUTO):
+      this->state->link_pinned = false;
+      break;
+    case (LINK_PROFILE_LOW_LATENCY):
+    case (LINK_PROFILE_THROUGHPUT):
+      this->state->link_pinned = true;
+      this->state->link_wanted = profile;
+      break;
+    default:
+      pthread_mutex_unlock(&this->state->arbiter_lock);
+      return -1;
+  }
+  pthread_mutex_unlock(&this->state->arbiter_lock);
+  return 0;
+}
+
+/*
+ *  Profile that is applied right now (LINK_PROFILE_LOW_LATENCY or
+ *  LINK_PROFILE_THROUGHPUT)
+ */
+int Dionysus::get_link_profile(){
+  return this->state->link_profile;
+}
+
+bool Dionysus::is_link_profile_pinned(){
+  return this->state->link_pinned;
+}
+
+/*
+ *  Number of times the tuner changed the profile
+ */
+uint32_t Dionysus::get_link_profile_switches(){
+  return this->state->link_switches;
+}
@@ -6,60 +6,224 @@
 #include <cstdlib>
 #include <libusb.h>
 #include <malloc.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
 
 static double TimevalDiff(const struct timeval *a, const struct timeval *b){
     return (a->tv_sec - b->tv_sec) + 1e-6 * (a->tv_usec - b->tv_usec);
 }
 
-static int check_response(state_t *state, response_header_t * response){
+/*
+ *  The transfer callbacks and the function that started the transaction
+ *  share the state, when the event thread is running they are on different
+ *  threads. Waiters are woken up when the transaction is finished
+ */
+static void state_lock(state_t *state){
+  pthread_mutex_lock(&state->lock);
+}
+
+static void state_unlock(state_t *state){
+  if (state->finished){
+    pthread_cond_broadcast(&state->finished_cond);
+  }
+  pthread_mutex_unlock(&state->lock);
+}
+
+/*
+ *  Block until the current transaction is finished, either by sleeping until
+ *  the event thread signals the end of the transaction or by handling the
+ *  USB events on this thread
+ */
+static void wait_for_finished(state_t *state){
+  if (state->event_thread_running){
+    pthread_mutex_lock(&state->lock);
+    while (!state->finished){
+      pthread_cond_wait(&state->finished_cond, &state->lock);
+    }
+    pthread_mutex_unlock(&state->lock);
+    return;
+  }
+  while (!state->finished){
+    //Sleeps until a transfer completes, returns as soon as finished is set
+    libusb_handle_events_completed(state->usb_ctx, &state->finished);
+  }
+}
+
+/*
+ *  Record how late the event thread woke up, lateness is bucketed by
+ *  powers of two (bucket 0: < 2us, bucket n: 2^n - 2^(n+1) us)
+ */
+static void record_wakeup_latency(state_t *state, uint32_t late_us){
+  uint32_t bucket = 0;
+  while (((late_us >> 1) >> bucket) && (bucket < (LATENCY_BUCKETS - 1))){
+    bucket++;
+  }
+  pthread_mutex_lock(&state->lock);
+  state->latency_histogram[bucket]++;
+  state->latency_samples++;
+  if (late_us > state->latency_max_us){
+    state->latency_max_us = late_us;
+  }
+  pthread_mutex_unlock(&state->lock);
+}
+
+static uint64_t timespec_us(const struct timespec *ts){
+  return ((uint64_t) ts->tv_sec * 1000000) + (ts->tv_nsec / 1000);
+}
+
+/*
+ *  Start a periodic timer on the monotonic clock
+ *
+ *  \param start_us: when the timer first expires
+ *
+ *  \retval timer file descriptor, < 0 when there is no timerfd
+ */
+static int start_latency_timer(uint64_t *start_us){
+  struct itimerspec period;
+  struct timespec now;
+  int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (timer < 0){
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  *start_us = timespec_us(&now) + LATENCY_SAMPLE_US;
+  period.it_value.tv_sec      = *start_us / 1000000;
+  period.it_value.tv_nsec     = (*start_us % 1000000) * 1000;
+  period.it_interval.tv_sec   = LATENCY_SAMPLE_US / 1000000;
+  period.it_interval.tv_nsec  = (LATENCY_SAMPLE_US % 1000000) * 1000;
+  if (timerfd_settime(timer, TFD_TIMER_ABSTIME, &period, NULL) != 0){
+    close(timer);
+    return -1;
+  }
+  return timer;
+}
+
+/*
+ *  Event thread
+ *    Polls the libusb file descriptors together with a periodic timer and
+ *    handles the USB events. The timer keeps expiring while transfers
+ *    complete, how late the thread gets to each expiration is the
+ *    scheduling latency it sees under load. Without a timerfd the thread
+ *    only handles events
+ */
+static void *dionysus_event_thread(void *data){
+  state_t * state = (state_t *) data;
+  struct pollfd fds[EVENT_THREAD_MAX_FDS + 1];
+  const struct libusb_pollfd ** usb_fds;
+  struct timeval tv;
+  struct timespec now;
+  uint64_t start_us = 0;
+  uint64_t fired = 0;
+  uint64_t expirations = 0;
+  uint64_t expected_us = 0;
+  int count = 0;
+  int timer = start_latency_timer(&start_us);
+
+  if (timer < 0){
+    while (!state->event_thread_stop){
+      tv.tv_sec = 0;
+      tv.tv_usec = EVENT_THREAD_POLL_US;
+      libusb_handle_events_timeout_completed(state->usb_ctx, &tv, &state->event_thread_stop);
+    }
+    return NULL;
+  }
+
+  while (!state->event_thread_stop){
+    //libusb may add or remove descriptors while transfers come and go
+    count = 0;
+    usb_fds = libusb_get_pollfds(state->usb_ctx);
+    for (int i = 0; (usb_fds != NULL) && (usb_fds[i] != NULL) && (count < EVENT_THREAD_MAX_FDS); i++){
+      fds[count].fd       = usb_fds[i]->fd;
+      fds[count].events   = usb_fds[i]->events;
+      fds[count].revents  = 0;
+      count++;
+    }
+    if (usb_fds != NULL){
+      libusb_free_pollfds(usb_fds);
+    }
+    fds[count].fd       = timer;
+    fds[count].events   = POLLIN;
+    fds[count].revents  = 0;
+    //The timer wakes the thread up at least every LATENCY_SAMPLE_US, that
+    //also takes care of the libusb timeouts and the stop flag
+    poll(&fds[0], count + 1, EVENT_THREAD_POLL_US / 1000);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    libusb_handle_events_timeout_completed(state->usb_ctx, &tv, NULL);
+
+    if ((fds[count].revents & POLLIN) &&
+        (read(timer, &expirations, sizeof(expirations)) == sizeof(expirations))){
+      //Measured against the oldest expiration the thread has not seen
+      expected_us = start_us + (fired * LATENCY_SAMPLE_US);
+      fired += expirations;
+      if (timespec_us(&now) >= expected_us){
+        record_wakeup_latency(state, (uint32_t) (timespec_us(&now) - expected_us));
+      }
+    }
+  }
+  close(timer);
+  return NULL;
+}
+
+static int check_response(state_t *state, request_t *request){
   int retval = 0;
+  response_header_t * response = &request->response_header;
+  uint8_t command = request->command_header.command;
   if (state->debug){
     printf ("Response\n");
     printf ("\tID: %02X\n", response->id);
     printf ("\tCommand Status: %02X\n", response->status);
   }
-  if (state->response_header.id != ID_RESPONSE){
+  if (response->id != ID_RESPONSE){
     //Fail, ID does not match
     if (state->debug){
-      printf ("ID Response != 0x%0X: %02X\n", ID_RESPONSE, state->response_header.id);
+      printf ("ID Response != 0x%0X: %02X\n", ID_RESPONSE, response->id);
     }
     retval = -1;
   }
   //XXX: how to check the command response
-  else if (state->response_header.status != ((~state->command_header.command) & 0xFF)){
+  else if (response->status != ((~command) & 0xFF)){
     if (state->debug){
       printf ("Status Read != ~Command\n");
     }
     retval = -2;
   }
-  if (state->command_header.command == PING){
+  request->error = retval;
+  if (command == PING){
     return retval;
   }
-  if (state->command_header.command == WRITE){
+  if (command == WRITE){
     return retval;
   }
-  state->read_data_count =  state->response_header.data_count[0] << 16;
-  state->read_data_count |= state->response_header.data_count[1] << 8;
-  state->read_data_count |= state->response_header.data_count[2];
+  state->read_data_count =  response->data_count[0] << 16;
+  state->read_data_count |= response->data_count[1] << 8;
+  state->read_data_count |= response->data_count[2];
   if (state->debug){
     printf ("Data Count (32-bit Data words): 0x%08X\n", state->read_data_count);
   }
 
-  if (state->mem_response){
-    state->read_mem_addr =  state->response_header.address.mem_addr[0] << 24;
-    state->read_mem_addr |= state->response_header.address.mem_addr[1] << 16;
-    state->read_mem_addr |= state->response_header.address.mem_addr[2] << 8;
-    state->read_mem_addr |= state->response_header.address.mem_addr[3];
+  if (command & MEM_FLAG){
+    state->read_mem_addr =  response->address.mem_addr[0] << 24;
+    state->read_mem_addr |= response->address.mem_addr[1] << 16;
+    state->read_mem_addr |= response->address.mem_addr[2] << 8;
+    state->read_mem_addr |= response->address.mem_addr[3];
     if (state->debug){
       printf ("Memory Access @ 0x%08X\n", state->read_mem_addr);
     }
     retval = -3;
   }
   else {
-    state->read_dev_addr = state->response_header.address.dev_addr;
-    state->read_reg_addr = state->response_header.address.reg_addr[0] << 16;
-    state->read_reg_addr |= state->response_header.address.reg_addr[1] << 8;
-    state->read_reg_addr |= state->response_header.address.reg_addr[2];
+    state->read_dev_addr = response->address.dev_addr;
+    state->read_reg_addr = response->address.reg_addr[0] << 16;
+    state->read_reg_addr |= response->address.reg_addr[1] << 8;
+    state->read_reg_addr |= response->address.reg_addr[2];
     if (state->debug){
       printf ("Peripheral Access: Device: 0x%02X Register: 0x%06X\n", state->read_dev_addr, state->read_reg_addr);
     }
@@ -97,6 +261,8 @@ static void print_transfer_status(struct libusb_transfer *transfer){
   }
 }
 
+static void dionysus_response_cb(response_parser_t *parser, int event, const uint8_t *data, uint32_t length);
+
 void Dionysus::usb_constructor(){
   //Initialize the read structure
   this->state                  = new state_t;
@@ -109,24 +275,117 @@ void Dionysus::usb_constructor(){
   this->state->finished        = true;
   this->state->error           = 0;
 
-  //User Data
-  this->state->buffer          = NULL;
-  this->state->buffer_pos      = 0;
-  this->state->buffer_size     = 0;
-
-  this->state->header_pos      = 0;
-  this->state->header_size     = 0;
+  //Requests waiting on a response
+  this->state->requests        = NULL;
+  this->state->request_count   = 0;
+  this->state->request_index   = 0;
 
   //USB Transfer position
   this->state->usb_total_size  = 0;
-  this->state->usb_size_left   = 0;
-  this->state->usb_pos         = 0;
   this->state->usb_actual_pos  = 0;
   this->state->timeout         = 1000;
 
-  //Transfer and Buffer Queue
-  this->state->transfer_queue  = &this->transfer_queue;
-  this->state->buffer_queue    = &this->buffer_queue;
+  this->state->transfers_in_flight = 0;
+  this->state->read_prefetch   = DEFAULT_READ_PREFETCH;
+  this->state->response_complete = false;
+
+  this->state->bulk_enable     = true;
+  this->state->bulk_mode       = false;
+  this->state->bulk_threshold  = DEFAULT_BULK_READ_THRESHOLD;
+  this->state->bulk_transfer_size = DEFAULT_BULK_TRANSFER_SIZE;
+  this->state->bulk_transfer_count = BULK_NUM_TRANSFERS;
+
+  this->state->write_segments  = NULL;
+  this->state->write_segment_count = 0;
+  this->state->write_segment_index = 0;
+  this->state->write_segment_pos = 0;
+  this->state->write_completed = 0;
+  this->state->write_chunk_size = DEFAULT_WRITE_CHUNK_SIZE;
+  this->state->write_transfer_count = DEFAULT_WRITE_TRANSFERS;
+  this->state->writes_in_flight = 0;
+
+  //Response stream
+  response_parser_init(&this->state->parser, dionysus_response_cb, this->state);
+  this->state->response_request = NULL;
+  this->state->response_interrupt = false;
+  this->state->interrupt_pending = false;
+  this->state->interrupts      = 0;
+
+  //Link tuning
+  this->state->link_profile    = LINK_PROFILE_LOW_LATENCY;
+  this->state->link_pinned     = false;
+  this->state->link_wanted     = LINK_PROFILE_LOW_LATENCY;
+  this->state->link_latency    = COMM_LATENCY_TIMER;
+  this->state->link_config.bulk_transfer_size   = this->state->bulk_transfer_size;
+  this->state->link_config.bulk_transfer_count  = this->state->bulk_transfer_count;
+  this->state->link_config.bulk_threshold       = this->state->bulk_threshold;
+  this->state->link_config.write_chunk_size     = this->state->write_chunk_size;
+  this->state->link_config.write_transfer_count = this->state->write_transfer_count;
+  this->state->link_config.read_prefetch        = this->state->read_prefetch;
+  this->state->link_average    = 0;
+  this->state->link_switches   = 0;
+
+  //FTDI configuration
+  this->state->ftdi_config.valid = false;
+  this->state->ftdi_config.bitmode = BITMODE_RESET;
+  this->state->ftdi_config.latency = 0;
+  this->state->ftdi_config.purge = false;
+
+  //Event handling
+  pthread_mutex_init(&this->state->lock, NULL);
+  pthread_cond_init(&this->state->finished_cond, NULL);
+  this->state->event_thread_running = false;
+  this->state->event_thread_stop = 0;
+  this->state->event_thread_cpu = -1;
+  this->state->event_thread_priority = 0;
+  memset(this->state->latency_histogram, 0, sizeof(this->state->latency_histogram));
+  this->state->latency_max_us = 0;
+  this->state->latency_samples = 0;
+
+  //Command pipeline
+  this->state->pipelining      = false;
+  this->state->pipeline.count  = 0;
+  this->state->pipeline.response_size = 0;
+  this->state->pipeline.copy_data = true;
+  this->state->batch.count     = 0;
+  this->state->batch.response_size = 0;
+  this->state->batch.copy_data = false;
+
+  //Posted writes
+  this->state->posting_writes  = false;
+  this->state->posted.count    = 0;
+  this->state->posted.response_size = 0;
+  this->state->posted.copy_data = false;
+  this->state->posted_error    = 0;
+
+  //Arbiter
+  pthread_mutex_init(&this->state->arbiter_lock, NULL);
+  pthread_cond_init(&this->state->arbiter_cond, NULL);
+  for (int i = 0; i < QOS_CLASSES; i++){
+    this->state->op_head[i]    = NULL;
+    this->state->op_tail[i]    = NULL;
+  }
+  this->state->arbiter_busy    = false;
+
+  //Link QoS
+  this->state->qos_slice_size  = DEFAULT_QOS_SLICE_SIZE;
+  this->state->qos_budget[QOS_CLASS_CONTROL] = DEFAULT_QOS_CONTROL_BUDGET;
+  this->state->qos_budget[QOS_CLASS_BULK]    = DEFAULT_QOS_BULK_BUDGET;
+  this->state->qos_credit[QOS_CLASS_CONTROL] = DEFAULT_QOS_CONTROL_BUDGET;
+  this->state->qos_credit[QOS_CLASS_BULK]    = DEFAULT_QOS_BULK_BUDGET;
+  this->state->qos_offset      = 0;
+  this->reset_qos_stats();
+
+  //Asynchronous operations
+  this->state->async_head      = 0;
+  this->state->async_count     = 0;
+  this->state->async_done_head = 0;
+  this->state->async_done_count = 0;
+  this->state->async_phase     = ASYNC_PHASE_IDLE;
+  this->state->async_drain_count = 0;
+
+  //Transfers and buffers are allocated when the device is opened
+  usb_arena_init(&this->state->arena);
 
   this->state->d               = this;
   this->state->debug           = debug;
@@ -134,22 +393,7 @@ void Dionysus::usb_constructor(){
   this->state->read_dev_addr   = 0;
   this->state->read_reg_addr   = 0;
   this->state->read_mem_addr   = 0;
-  this->state->mem_response    = false;
 
-  for (int i = 0; i < NUM_TRANSFERS; i++){
-    //uint8_t * buffer = new uint8_t[BUFFER_SIZE + 2]; //Add two for the modem status
-    uint8_t * buffer = new uint8_t[BUFFER_SIZE]; //Add two for the modem status
-    this->buffer_queue.push(buffer);
-    this->buffers.push(buffer);
-    struct libusb_transfer *transfer = NULL;
-    transfer = libusb_alloc_transfer(0);
-    this->transfer_queue.push(transfer);
-    this->transfers.push(transfer);
-
-    if (!transfer){
-      printf ("Dionysus: Error while creating index %d usb transfer\n", i);
-    }
-  }
 }
 
 int Dionysus::usb_open(int vendor, int product){
@@ -161,45 +405,247 @@ int Dionysus::usb_open(int vendor, int product){
   retval = ftdi_usb_open(this->ftdi, vendor, product);
     CHECK_ERROR("Failed to open FTDI");
   this->reset();
+  this->invalidate_comm_mode();
   this->usb_is_open = true;
   retval = Dionysus::set_comm_mode();
   this->state->usb_ctx           = this->ftdi->usb_ctx;
   this->state->usb_dev           = this->ftdi->usb_dev;
   this->state->in_ep             = this->ftdi->in_ep;
   this->state->out_ep            = this->ftdi->out_ep;
+  if (usb_arena_open(&this->state->arena, this->state->usb_dev) < 0){
+    printf ("Dionysus: Failed to allocate USB transfers\n");
+    return -1;
+  }
+  if (this->debug){
+    printf ("Dionysus: USB buffers: %s\n", this->state->arena.dev_mem ? "device memory" : "heap");
+  }
   return retval;
 }
 
+void Dionysus::usb_close(){
+  this->stop_event_thread();
+  //Acknowledgements that were never read are gone with the device
+  this->state->posted.count = 0;
+  this->state->posted_error = 0;
+  //The state was locked along with the arena, the arena only unlocks itself
+  this->lock_transfer_memory(false);
+  usb_arena_close(&this->state->arena, this->state->usb_dev);
+}
+
 void Dionysus::usb_destructor(){
-  struct libusb_transfer *transfer = NULL;
-  uint8_t * buffer = NULL;
-  //Empty the working queues
-  while (!this->transfer_queue.empty()){
-    this->transfer_queue.pop();
+  this->stop_event_thread();
+  this->lock_transfer_memory(false);
+  usb_arena_close(&this->state->arena, this->state->usb_dev);
+  pthread_cond_destroy(&this->state->finished_cond);
+  pthread_mutex_destroy(&this->state->lock);
+  pthread_cond_destroy(&this->state->arbiter_cond);
+  pthread_mutex_destroy(&this->state->arbiter_lock);
+}
+
+/*
+ *  Start a thread that handles all of the USB events
+ *    Reads and writes sleep until the event thread reports their
+ *    transaction is finished instead of handling the USB events themselves
+ *
+ *  \retval  0: all fine
+ *          -1: device is not open
+ *          -2: failed to create the thread
+ */
+int Dionysus::start_event_thread(){
+  pthread_attr_t attr;
+  struct sched_param param;
+  cpu_set_t cpus;
+  int retval = 0;
+  if (this->state->event_thread_running){
+    return 0;
+  }
+  if (!this->usb_is_open){
+    return -1;
+  }
+  this->state->event_thread_stop = 0;
+  if (pthread_attr_init(&attr) != 0){
+    return -2;
+  }
+  if (this->state->event_thread_priority > 0){
+    param.sched_priority = this->state->event_thread_priority;
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    pthread_attr_setschedparam(&attr, &param);
+  }
+  if (this->state->event_thread_cpu >= 0){
+    CPU_ZERO(&cpus);
+    CPU_SET(this->state->event_thread_cpu, &cpus);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+  }
+  retval = pthread_create(&this->state->event_thread, &attr, dionysus_event_thread, this->state);
+  pthread_attr_destroy(&attr);
+  if (retval == EPERM){
+    //Not allowed to use real time scheduling
+    return -3;
+  }
+  if (retval != 0){
+    return -2;
+  }
+  this->state->event_thread_running = true;
+  return 0;
+}
+
+/*
+ *  Scheduling of the event thread, takes effect the next time the thread is
+ *  started
+ *
+ *  \param cpu: CPU the thread is pinned to, -1 to let it run anywhere
+ *  \param priority: SCHED_FIFO priority (1 - 99), 0 for normal scheduling
+ *
+ *  \retval  0: all fine
+ *          -1: invalid CPU
+ *          -2: invalid priority
+ */
+int Dionysus::set_event_thread_scheduling(int cpu, int priority){
+  if ((cpu < -1) || (cpu >= CPU_SETSIZE)){
+    return -1;
+  }
+  if ((priority < 0) ||
+      ((priority > 0) && ((priority < sched_get_priority_min(SCHED_FIFO)) ||
+                          (priority > sched_get_priority_max(SCHED_FIFO))))){
+    return -2;
   }
-  //Empty the working queue
-  while (!buffer_queue.empty()){
-    this->buffer_queue.pop();
+  this->state->event_thread_cpu = cpu;
+  this->state->event_thread_priority = priority;
+  return 0;
+}
+
+/*
+ *  Keep the transfer buffers and the transfer state in RAM so the
+ *  completion path never takes a page fault
+ *
+ *  \retval  0: all fine
+ *          -1: device is not open (the buffers are allocated on open)
+ *          -2: failed to lock the memory (see RLIMIT_MEMLOCK)
+ */
+int Dionysus::lock_transfer_memory(bool enable){
+  usb_arena_t * arena = &this->state->arena;
+  if (arena->memory == NULL){
+    return -1;
+  }
+  if (!enable){
+    if (arena->locked){
+      munlock(arena->memory, arena->size);
+      munlock(this->state, sizeof(state_t));
+      arena->locked = false;
+    }
+    return 0;
+  }
+  if (arena->locked){
+    return 0;
+  }
+  if (mlock(arena->memory, arena->size) != 0){
+    return -2;
+  }
+  if (mlock(this->state, sizeof(state_t)) != 0){
+    munlock(arena->memory, arena->size);
+    return -2;
+  }
+  arena->locked = true;
+  return 0;
+}
+
+/*
+ *  Wake up latency of the event thread, how much later than its periodic
+ *  timer (every LATENCY_SAMPLE_US) the thread ran, sampled whether or not
+ *  transfers are completing
+ *
+ *  \param buckets: array of LATENCY_BUCKETS counters, bucket 0 counts wake
+ *    ups less than 2us late, bucket n counts 2^n us - 2^(n+1) us
+ *  \param count: size of buckets
+ *
+ *  \retval number of buckets filled in
+ */
+int Dionysus::get_event_latency_histogram(uint32_t *buckets, int count){
+  if (count > LATENCY_BUCKETS){
+    count = LATENCY_BUCKETS;
   }
-  //Remove all the transfer_queue
-  while (!this->transfers.empty()){
-    transfer = this->transfers.front();
-    this->transfers.pop();
-    libusb_free_transfer(transfer);
+  pthread_mutex_lock(&this->state->lock);
+  for (int i = 0; i < count; i++){
+    buckets[i] = this->state->latency_histogram[i];
   }
-  while (!buffers.empty()){
-    buffer = this->buffers.front();
-    this->buffers.pop();
-    delete(buffer);
+  pthread_mutex_unlock(&this->state->lock);
+  return count;
+}
+
+uint32_t Dionysus::get_event_latency_max(){
+  uint32_t max_us = 0;
+  pthread_mutex_lock(&this->state->lock);
+  max_us = this->state->latency_max_us;
+  pthread_mutex_unlock(&this->state->lock);
+  return max_us;
+}
+
+uint32_t Dionysus::get_event_latency_samples(){
+  uint32_t samples = 0;
+  pthread_mutex_lock(&this->state->lock);
+  samples = this->state->latency_samples;
+  pthread_mutex_unlock(&this->state->lock);
+  return samples;
+}
+
+void Dionysus::reset_event_latency(){
+  pthread_mutex_lock(&this->state->lock);
+  memset(this->state->latency_histogram, 0, sizeof(this->state->latency_histogram));
+  this->state->latency_max_us = 0;
+  this->state->latency_samples = 0;
+  pthread_mutex_unlock(&this->state->lock);
+}
+
+void Dionysus::stop_event_thread(){
+  if (!this->state->event_thread_running){
+    return;
   }
+  this->state->event_thread_stop = 1;
+  pthread_join(this->state->event_thread, NULL);
+  this->state->event_thread_running = false;
+}
+
+bool Dionysus::is_event_thread_running(){
+  return this->state->event_thread_running;
 }
 
+/*
+ *  Put interface A into synchronous FIFO mode
+ *    The chip configuration is tracked so the control transfers are only
+ *    sent when something changed it (open, reset, strobe_pin) or after an
+ *    error left stale data in the FTDI buffers
+ */
 int Dionysus::set_comm_mode(){
   int retval = 0;
+  ftdi_config_t * config = &this->state->ftdi_config;
+
+  if (this->comm_mode &&
+      config->valid &&
+      (config->bitmode == BITMODE_SYNCFF)){
+    if (config->latency != this->state->link_latency){
+      //The link tuner changed profiles
+      retval = ftdi_set_latency_timer(this->ftdi, this->state->link_latency);
+        CHECK_ERROR("Failed to set latency");
+      config->latency = this->state->link_latency;
+    }
+    if (config->purge){
+      retval = ftdi_usb_purge_buffers(this->ftdi);
+        CHECK_ERROR("Failed to purge buffers");
+      config->purge = false;
+    }
+    return 0;
+  }
+
   retval = ftdi_set_bitmode(this->ftdi, 0x00, BITMODE_RESET);
     CHECK_ERROR("Failed to reset bitmode");
-  retval = ftdi_set_latency_timer(this->ftdi, 2);
-    CHECK_ERROR("Failed to set latency");
+  config->valid = true;
+  config->bitmode = BITMODE_RESET;
+  if (config->latency != this->state->link_latency){
+    retval = ftdi_set_latency_timer(this->ftdi, this->state->link_latency);
+      CHECK_ERROR("Failed to set latency");
+    config->latency = this->state->link_latency;
+  }
   retval = ftdi_usb_purge_buffers(this->ftdi);
     CHECK_ERROR("Failed to purge buffers");
   /*
@@ -217,12 +663,24 @@ int Dionysus::set_comm_mode(){
   */
   retval = ftdi_set_bitmode(this->ftdi, 0x00, BITMODE_SYNCFF);
     CHECK_ERROR("Failed to reset bitmode");
+  config->bitmode = BITMODE_SYNCFF;
   retval = ftdi_usb_purge_buffers(this->ftdi);
     CHECK_ERROR("Failed to purge buffers");
+  config->purge = false;
   this->comm_mode = true;
   return 0;
 }
 
+/*
+ *  Forget the tracked chip configuration, the next transaction sets up the
+ *  chip from scratch
+ */
+void Dionysus::invalidate_comm_mode(){
+  this->comm_mode = false;
+  this->state->ftdi_config.valid = false;
+  this->state->ftdi_config.latency = 0;
+}
+
 int Dionysus::print_status(bool get_status, uint16_t in_status){
   //Get Control Status
   uint16_t status;
@@ -293,39 +751,209 @@ int Dionysus::print_status(bool get_status, uint16_t in_status){
   return retval;
 }
 /* I/O */
-static void dionysus_readstream_cb(struct libusb_transfer *transfer){
-  state_t * state = (state_t *) transfer->user_data;
-  uint32_t buf_size = 0;
-  uint8_t *buffer = transfer->buffer;
-  uint32_t cpy_size = 0;
-  uint16_t status = 0;
+static void dionysus_readstream_cb(struct libusb_transfer *transfer);
+
+static uint32_t request_response_size(request_t *request){
+  if (request->read){
+    return request->response_header_len + request->size;
+  }
+  return request->response_header_len;
+}
+
+static bool request_complete(request_t *request){
+  return (request->header_pos >= request->response_header_len) &&
+         (!request->read || (request->buffer_pos >= request->size));
+}
+
+/*
+ *  Step over every request that has all of its response
+ */
+static void advance_requests(state_t *state){
+  while ((state->request_index < state->request_count) &&
+         request_complete(&state->requests[state->request_index])){
+    state->request_index++;
+  }
+}
+
+/*
+ *  Parser callback, routes each response to the request it belongs to,
+ *  responses come back in the same order the commands were sent. Interrupt
+ *  packets that show up while another response is expected are kept for
+ *  the next wait_for_interrupts
+ */
+static void dionysus_response_cb(response_parser_t *parser, int event, const uint8_t *data, uint32_t length){
+  state_t * state = (state_t *) parser->user_data;
+  request_t * request = state->response_request;
+  uint32_t header_len = 0;
+
+  switch (event){
+    case (RESPONSE_EVENT_HEADER):
+      printds("Reading header data\n");
+      advance_requests(state);
+      request = NULL;
+      state->response_interrupt = false;
+      if (state->request_index < state->request_count){
+        request = &state->requests[state->request_index];
+      }
+      if ((parser->header.status == ((~INTERRUPT) & 0xFF)) &&
+          ((request == NULL) || (request->command_header.command != INTERRUPT))){
+        //Not the response we are waiting for
+        state->response_request = NULL;
+        state->response_interrupt = true;
+        break;
+      }
+      state->response_request = request;
+      if (request == NULL){
+        //Nothing is waiting on this response, its data (the size comes from
+        //the header) is dropped so the parser stays in step with the stream
+        break;
+      }
+      header_len = request->response_header_len;
+      if (header_len > sizeof(response_header_t)){
+        header_len = sizeof(response_header_t);
+      }
+      memcpy(&request->response_header, &parser->header, header_len);
+      request->header_pos = request->response_header_len;
+      state->usb_actual_pos += request->response_header_len;
+      //the response structure should be populated with header data
+      check_response(state, request);
+      break;
+    case (RESPONSE_EVENT_DATA):
+      if (state->response_interrupt){
+        memcpy(&state->interrupt_data[parser->data_pos], data, length);
+        break;
+      }
+      if ((request == NULL) || !request->read){
+        break;
+      }
+      printds("reading buffer data\n");
+      //Anything beyond what the request asked for is dropped
+      if (length > (request->size - request->buffer_pos)){
+        length = request->size - request->buffer_pos;
+      }
+      //Copy the data to the output buffer
+      if (request->buffer != NULL){
+        memcpy(&request->buffer[request->buffer_pos], data, length);
+      }
+      request->buffer_pos += length;
+      state->usb_actual_pos += length;
+      break;
+    case (RESPONSE_EVENT_DONE):
+      if (state->response_interrupt){
+        state->interrupts |= state->interrupt_data[0] << 24 |
+                             state->interrupt_data[1] << 16 |
+                             state->interrupt_data[2] << 8  |
+                             state->interrupt_data[3];
+        state->interrupt_pending = true;
+        state->response_interrupt = false;
+      }
+      state->response_request = NULL;
+      advance_requests(state);
+      break;
+    case (RESPONSE_EVENT_DESYNC):
+      if (state->debug){
+        printf ("%s(): Skipped %d bytes that are not part of a response\n", __func__, length);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+static uint32_t read_transfer_size(state_t *state){
+  if (state->bulk_mode){
+    return state->bulk_transfer_size;
+  }
+  return BUFFER_SIZE;
+}
+
+/*
+ *  Number of read transfers that should be in flight to finish the current
+ *  response: enough to cover the bytes that have not arrived yet plus the
+ *  prefetch window, never more than the transfer pool
+ */
+static uint32_t read_transfers_wanted(state_t *state){
+  uint32_t size_left = 0;
+  uint32_t payload = 0;
+  uint32_t count = 0;
+  uint32_t max_count = NUM_TRANSFERS;
+  if (state->usb_actual_pos >= state->usb_total_size){
+    return 0;
+  }
+  payload = (read_transfer_size(state) / FTDI_PACKET_SIZE) * FTDI_PACKET_PAYLOAD;
+  if (state->bulk_mode){
+    max_count = state->bulk_transfer_count;
+  }
+  size_left = state->usb_total_size - state->usb_actual_pos;
+  count = (size_left + payload - 1) / payload;
+  count += state->read_prefetch;
+  if (count > max_count){
+    count = max_count;
+  }
+  return count;
+}
+
+static void release_read_transfer(state_t *state, struct libusb_transfer *transfer){
+  if (state->bulk_mode){
+    buffer_pool_put(&state->arena.bulk_pool, transfer->buffer);
+  }
+  else {
+    buffer_pool_put(&state->arena.read_pool, transfer->buffer);
+  }
+  usb_arena_put_transfer(&state->arena, transfer);
+}
+
+static int submit_read_transfer(state_t *state, struct libusb_transfer *transfer, uint8_t *buffer){
+  int retval = 0;
+  /*  Instead of only asking for the size we want we submit full packets
+   *  this way if the FTDI chip only sends back modem status we can
+   *  resubmit without having to figure out how large a packet should be send
+   *  the FTDI chip will only send back the size that it has, so if we have a
+   *  packet smaller than the maximum in it, we wont be waiting indefinetly
+   * */
+  libusb_fill_bulk_transfer(transfer,
+                            state->usb_dev,
+                            state->out_ep,
+                            buffer,
+                            read_transfer_size(state),
+                            dionysus_readstream_cb,
+                            state,
+                            1000);
+  transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+  transfer->flags = 0;
+  retval = libusb_submit_transfer(transfer);
+  if (retval == 0){
+    state->transfers_in_flight++;
+  }
+  return retval;
+}
+
+static void handle_read_transfer(state_t *state, struct libusb_transfer *transfer){
   int retval = 0;
   bool timeout;
 
-  //printds("Entered\n");
-  buf_size = transfer->actual_length;
-  /*
-  if (state->debug){
-    printf("Requested Length: %d\n", transfer->length);
-    printf("Actual length: %d\n", buf_size);
-  }
-  */
+  state->transfers_in_flight--;
   gettimeofday(&state->timeout_now, NULL);
-  //uint32_t timeout_val = (TimevalDiff(&state->timeout_now, &state->timeout_start) * 1000);
-  //printf ("Timeout value: %d\n", timeout_val);
-    
   timeout = (TimevalDiff(&state->timeout_now, &state->timeout_start) * 1000) > state->timeout;
 
-  if ( timeout || 
+  //Prefetch transfers are cancelled as soon as the response is complete
+  if (state->response_complete){
+    release_read_transfer(state, transfer);
+    if (state->transfers_in_flight == 0){
+      state->finished = true;
+    }
+    return;
+  }
+
+  if ( timeout ||
       (transfer->status != LIBUSB_TRANSFER_COMPLETED) ||
       (state->error != 0)){
 
-    if (timeout) {
+    if (timeout && (state->error == 0)) {
       state->error = -10;
     }
 
     if (state->debug){
-
       //Error When reading from the transfer QUEUE
       //No more data to send, recover this transfer
       if (state->error == 0){
@@ -333,347 +961,557 @@ static void dionysus_readstream_cb(struct libusb_transfer *transfer){
         print_transfer_status(transfer);
       }
     }
-    state->transfer_queue->push(transfer);
-    if (state->transfer_queue->size() == NUM_TRANSFERS){
+    //Put the transfer and buffer back into the queue
+    release_read_transfer(state, transfer);
+    if (state->transfers_in_flight == 0){
       //We're done!
       state->finished = true;
     }
-    //Put the buffer back into the queue too
-    state->buffer_queue->push(transfer->buffer);
     return;
   }
 
   //USB Transfer is good!
+  consume_packets(state, transfer->buffer, transfer->actual_length);
 
-  //Waiting for the header
-  if (buf_size <= 2){
-    //printds("Small packet ( <= 2 )\n");
-    //we didn't get data back, we need to submit a new one
-    libusb_fill_bulk_transfer(transfer,
-                              state->usb_dev,
-                              state->out_ep,
-                              transfer->buffer,
-                              //BUFFER_SIZE + 2,
-                              BUFFER_SIZE,
-                              dionysus_readstream_cb,
-                              state,
-                              1000);
-    transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
-    transfer->flags = 0;
-    retval = libusb_submit_transfer(transfer);
-    return;
-  }
-  //Buffer has more than the modem status
-  //Go to the buffer position after the modem status
-  buffer = &buffer[2];
-  buf_size -= 2;
-
-  /*
-  printf ("Incomming buffer\n");
-  for (int i = 0; i < buf_size; i++){
-    printf ("%02X ", buffer[i]);
-  }
-  printf ("\n");
-  */
-
-  //Header Daata
-  if (!state->header_found){
-    printds("Reading header data\n");
-    if (buf_size >= state->header_size){
-      cpy_size = state->header_size;
-    }
-    else {
-      cpy_size = buf_size;
-    }
-    memcpy(((uint8_t *)&state->response_header) + state->header_pos, buffer, cpy_size);
-    state->header_pos += cpy_size;
-    state->usb_actual_pos += cpy_size;
-    if (state->header_pos >= state->header_size){
-      //the response structure should be populated with header data
-      //If this is a ping or a write then we are done, and we can exit immediately
-      retval = check_response(state, &state->response_header);
-      state->header_found = true;
-    }
-    buffer = &buffer[cpy_size];
-    buf_size -= cpy_size;
-  }
-
-  //Buffer Data
-  if ((buf_size > 0) && ((state->buffer_size - state->buffer_pos) > 0)){
-    if (state->debug){
-      printds("reading buffer data\n");
-    }
-    if (buf_size >= (state->buffer_size - state->buffer_pos)){
-      //there is a chance the buffer size might be bigger than the data
-      cpy_size = (state->buffer_size - state->buffer_pos);
-    }
-    else {
-      //the incomming data is smaller or equal to the size of the data
-      cpy_size = buf_size;
-    }
-    //Copy any remaining data to the output buffer
-    memcpy(&state->buffer[state->buffer_pos], buffer, cpy_size);
-    state->buffer_pos += cpy_size;
-    state->usb_actual_pos += cpy_size;
-    buf_size -= cpy_size;
-  }
-
-  //Calculate our USB position
-  //state->usb_actual_pos += transfer->actual_length - 2; //Calculated above
-  /*
-  if (state->debug){
-    printf ("Actual Position: (Dec) %d\n", state->usb_actual_pos);
-    printf ("Actual Position: (Hex) 0x%08X\n", state->usb_actual_pos);
-  }
-  */
-  if (state->usb_actual_pos < state->usb_total_size){
-    //Because everything was sent in increments of chunksizes we need to see if the USB returned
-    //something smaller, if so we might need to submit a new packet
-    state->usb_pos = state->usb_pos - (transfer->length - transfer->actual_length);
-    if (state->debug){
-      printf ("request pos: 0x%08X, actual: 0x%08X\n", state->usb_pos, state->usb_actual_pos);
-    }
-    state->usb_size_left = state->usb_total_size - state->usb_pos;
-    if (state->usb_size_left < 0){
-      state->usb_size_left = 0;
-    }
-    if (state->debug){
-      printf("%s(): Request %d more bytes from USB\n", __func__, state->usb_size_left);
+  if (state->usb_actual_pos >= state->usb_total_size){
+    //The whole response is here, don't wait for the prefetch transfers to
+    //time out, take them back now
+    printds("response complete\n");
+    state->response_complete = true;
+    release_read_transfer(state, transfer);
+    state->error = 0;
+    if (state->transfers_in_flight > 0){
+      state->d->cancel_all_transfers();
     }
   }
-  else {
-    state->usb_size_left = 0;
-  }
-
-  //Check if we need to request more data
-  if (state->usb_size_left > 0){
+  else if (state->transfers_in_flight < read_transfers_wanted(state)){
+    //Still waiting on data, put this transfer back on the bus
     printds("Submit a new transfer in read callback\n");
-    libusb_fill_bulk_transfer(transfer,
-                              state->usb_dev,
-                              state->out_ep,
-                              transfer->buffer,
-                              //BUFFER_SIZE + 2, //Add two for the modem status
-                              BUFFER_SIZE, //Add two for the modem status
-                              dionysus_readstream_cb,
-                              state,
-                              1000);
-    //Update the position and size left
-    transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
-    transfer->flags = 0;
-    retval = libusb_submit_transfer(transfer);
+    retval = submit_read_transfer(state, transfer, transfer->buffer);
     if (retval != 0){
       printf ("Failed to submit transfer: %d\n", retval);
       //Put the transfer back into the empty queue
-      state->transfer_queue->push(transfer);
-      state->buffer_queue->push(buffer);
+      release_read_transfer(state, transfer);
       state->d->cancel_all_transfers();
       state->error = retval;
     }
-    state->usb_pos += BUFFER_SIZE - 2;
-    state->usb_size_left = state->usb_total_size - BUFFER_SIZE - 2;
-    if (state->usb_size_left < 0){
-      state->usb_size_left = 0;
-    }
   }
   else {
-    //No need to submit a new USB Transfer
-    printds("no need to submit a new transfer\n");
-    if (state->debug){
-      print_transfer_status(transfer);
-    }
-    state->transfer_queue->push(transfer);
-    state->buffer_queue->push(transfer->buffer);
-    state->error = 0;
+    //Enough transfers are already in flight to cover the rest of the response
+    release_read_transfer(state, transfer);
   }
 
-  //Check to see if we are done
   if (state->debug){
-    printf ("Number of transfers: %d, transfers available: %d\n", ((int)NUM_TRANSFERS), (int)state->transfer_queue->size());
+    printf ("Transfers in flight: %d, transfers available: %d\n",
+            state->transfers_in_flight,
+            state->arena.free_transfer_count);
   }
-  if (state->transfer_queue->size() == NUM_TRANSFERS){
+  if (state->transfers_in_flight == 0){
     //All transfer queues are recovered!
     //We're done!
     state->finished = true;
   }
 }
 
-int Dionysus::read(uint32_t header_len, uint8_t *buffer, uint32_t size, uint32_t timeout){
+static void dionysus_readstream_cb(struct libusb_transfer *transfer){
+  state_t * state = (state_t *) transfer->user_data;
+  state_lock(state);
+  handle_read_transfer(state, transfer);
+  state_unlock(state);
+}
+
+/*
+ *  Set the number of read transfers submitted beyond what the expected
+ *  response needs, a small window hides the resubmit gap when the FTDI chip
+ *  returns packets that only contain the modem status
+ *
+ *  This is the low latency link profile setting, the throughput profile
+ *  uses its own
+ *
+ *  \param count: number of extra transfers (Default DEFAULT_READ_PREFETCH)
+ */
+void Dionysus::set_read_prefetch(uint32_t count){
+  if (count > NUM_TRANSFERS){
+    count = NUM_TRANSFERS;
+  }
+  this->state->link_config.read_prefetch = count;
+  if (this->state->link_profile == LINK_PROFILE_LOW_LATENCY){
+    this->state->read_prefetch = count;
+  }
+}
+
+uint32_t Dionysus::get_read_prefetch(){
+  return this->state->read_prefetch;
+}
+
+/*
+ *  Enable the bulk read mode
+ *    Responses larger than the bulk threshold are read with large transfers
+ *    (many FTDI packets each) instead of one packet per transfer
+ *
+ *  \param enable: Enable bulk reads (Default true)
+ */
+void Dionysus::enable_bulk_read(bool enable){
+  this->state->bulk_enable = enable;
+}
+
+/*
+ *  Configure the bulk read mode
+ *
+ *  \param transfer_size: size of each bulk transfer in bytes, must be a
+ *    multiple of FTDI_PACKET_SIZE and no larger than BULK_BUFFER_SIZE
+ *  \param transfer_count: number of bulk transfers in flight
+ *    (1 - BULK_NUM_TRANSFERS)
+ *  \param threshold: responses of at least this many bytes use bulk reads
+ *
+ *  This is the low latency link profile setup, the throughput profile uses
+ *  its own. Pin LINK_PROFILE_LOW_LATENCY to use it for all traffic
+ *
+ *  \retval  0: all fine
+ *          -1: invalid transfer size
+ *          -2: invalid transfer count
+ */
+int Dionysus::set_bulk_read(uint32_t transfer_size, uint32_t transfer_count, uint32_t threshold){
+  if ((transfer_size == 0) ||
+      (transfer_size > BULK_BUFFER_SIZE) ||
+      ((transfer_size % FTDI_PACKET_SIZE) != 0)){
+    return -1;
+  }
+  if ((transfer_count == 0) || (transfer_count > BULK_NUM_TRANSFERS)){
+    return -2;
+  }
+  this->state->link_config.bulk_transfer_size   = transfer_size;
+  this->state->link_config.bulk_transfer_count  = transfer_count;
+  this->state->link_config.bulk_threshold       = threshold;
+  if (this->state->link_profile == LINK_PROFILE_LOW_LATENCY){
+    this->state->bulk_transfer_size  = transfer_size;
+    this->state->bulk_transfer_count = transfer_count;
+    this->state->bulk_threshold      = threshold;
+  }
+  return 0;
+}
+
+/*
+ *  Read the responses for a list of requests
+ *    The responses are expected back to back in the same order as the
+ *    requests, each request is completed as its response arrives
+ *
+ *  \retval >= 0: number of response bytes read
+ *          < 0: error
+ */
+int Dionysus::read_requests(request_t *requests, uint32_t count, uint32_t timeout){
+  int retval = this->start_read_requests(requests, count, timeout);
+  if (retval < 0){
+    return retval;
+  }
+  wait_for_finished(this->state);
+  return this->finish_read_requests();
+}
+
+/*
+ *  Submit the read transfers for a list of requests without waiting for
+ *  them, the transaction is finished when is_transaction_finished() is true
+ */
+int Dionysus::start_read_requests(request_t *requests, uint32_t count, uint32_t timeout){
 
   struct libusb_transfer * transfer;
-  uint32_t buf_size = 0;
+  buffer_pool_t * pool = &this->state->arena.read_pool;
+  uint32_t transfer_count = 0;
   uint8_t * buf = NULL;
   int retval = 0;
 
   printd("Entered\n");
 
-  this->state->buffer           = buffer;
-  this->state->buffer_pos       = 0;
-  this->state->buffer_size      = size;
+  state_lock(this->state);
+  this->state->requests         = requests;
+  this->state->request_count    = count;
+  this->state->request_index    = 0;
+  this->state->response_request = NULL;
+  this->state->response_interrupt = false;
+  response_parser_reset(&this->state->parser);
 
   //Total size that will be read from the chip
-  this->state->usb_total_size   = size + header_len;
-  //size of the read that is left
-  this->state->usb_size_left    = 0;
-  //current position of the request
-  this->state->usb_pos          = 0;
+  this->state->usb_total_size   = 0;
+  for (uint32_t i = 0; i < count; i++){
+    requests[i].header_pos = 0;
+    requests[i].buffer_pos = 0;
+    requests[i].error = 0;
+    this->state->usb_total_size += request_response_size(&requests[i]);
+  }
   //current position of the data read back from the device
   this->state->usb_actual_pos   = 0;
 
-  this->state->header_pos       = 0;
-
   this->state->error            = 0;
-  this->state->header_found     = false;
   this->state->read_data_count  = 0;
   this->state->read_dev_addr    = 0;
   this->state->read_reg_addr    = 0;
   this->state->read_mem_addr    = 0;
-  this->state->mem_response     = ((this->state->command_header.command & MEM_FLAG) > 0);
+  this->state->response_complete = false;
+  this->state->transfers_in_flight = 0;
   this->state->finished         = false;
   this->state->timeout          = timeout;
+  gettimeofday(&this->state->timeout_start, NULL);
+
+  //Large responses are read with large, multi packet transfers
+  this->state->bulk_mode        = this->state->bulk_enable &&
+                                  (this->state->usb_total_size >= this->state->bulk_threshold);
+  if (this->state->bulk_mode){
+    pool = &this->state->arena.bulk_pool;
+  }
 
-  if (transfer_queue.empty()){
+  if (this->state->arena.free_transfer_count == 0){
     printf ("Transfer queue empty!\n");
+    this->state->finished = true;
+    state_unlock(this->state);
     return -5;
   }
-  //setup a list of transfer_queue
-  this->state->usb_size_left = this->state->usb_total_size;
-  if (this->state->usb_total_size > 0){
-    printd("Requesting data in the read\n");
-    while (!transfer_queue.empty()){
-      transfer = this->transfer_queue.front();
-      buf = this->buffer_queue.front();
-      if (this->debug){
-        printf ("Buffer: %p\n", buf);
-      }
-      this->transfer_queue.pop();
-      this->buffer_queue.pop();
-      libusb_fill_bulk_transfer(transfer,
-                                this->ftdi->usb_dev,
-                                this->ftdi->out_ep,
-                                buf,
-                                //BUFFER_SIZE + 2,
-                                BUFFER_SIZE,
-                                //max_packet_size + 2, //Add two for the modem status
-
-                                /*  Instead of only asking for the size we want we submit full packets
-                                 *  this way if the FTDI chip only sends back modem status we can
-                                 *  resubmit without having to figure out how large a packet should be send
-                                 *  the FTDI chip will only send back the size that it has, so if we have a
-                                 *  packet smaller than the maximum in it, we wont be waiting indefinetly
-                                 * */
-                                dionysus_readstream_cb,
-                                this->state,
-                                1000);
-
-      transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
-      transfer->flags = 0;
-      printd ("Submit transfer\n");
-      retval = libusb_submit_transfer(transfer);
-      printd ("transfer submitted\n");
-      if (retval != 0){
-        //Clean up the USB stack by telling everything to cancel!
-        //This will return everything back in the callback, so we still need to wait for it finish
-        this->cancel_all_transfers();
-        printf ("Error when submitting read transfer: %d\n", retval);
-        this->state->error = -2;
-        break;
-      }
-
-      this->state->usb_pos += BUFFER_SIZE - 2;
-      this->state->usb_size_left = this->state->usb_total_size - this->state->usb_pos;
-      if (this->state->usb_size_left < 0){
-        this->state->usb_size_left = 0;
-      }
-      //Check if there is more data to write
-      if (this->state->usb_size_left == 0){
-        break;
-      }
+  //Only submit the transfers this response needs (plus the prefetch window)
+  transfer_count = read_transfers_wanted(this->state);
+  if (this->debug){
+    printf ("%s(): Submitting %d transfers for %d bytes\n", __func__, transfer_count, this->state->usb_total_size);
+  }
+  for (uint32_t i = 0; (i < transfer_count) && (pool->free_count > 0); i++){
+    transfer = usb_arena_get_transfer(&this->state->arena);
+    if (transfer == NULL){
+      break;
+    }
+    buf = buffer_pool_get(pool);
+    printd ("Submit transfer\n");
+    retval = submit_read_transfer(this->state, transfer, buf);
+    if (retval != 0){
+      usb_arena_put_transfer(&this->state->arena, transfer);
+      buffer_pool_put(pool, buf);
+      //Clean up the USB stack by telling everything to cancel!
+      //This will return everything back in the callback, so we still need to wait for it finish
+      this->cancel_all_transfers();
+      printf ("Error when submitting read transfer: %d\n", retval);
+      this->state->error = -2;
+      break;
     }
   }
-  while (!this->state->finished){
-    retval = libusb_handle_events_completed(this->ftdi->usb_ctx, NULL);
-    //printf(".");
+  if (this->state->transfers_in_flight == 0){
+    this->state->finished = true;
   }
+  state_unlock(this->state);
+  return 0;
+}
+
+/*
+ *  True once the transfers of the current transaction are all back
+ */
+bool Dionysus::is_transaction_finished(){
+  bool finished = false;
+  pthread_mutex_lock(&this->state->lock);
+  finished = this->state->finished;
+  pthread_mutex_unlock(&this->state->lock);
+  return finished;
+}
+
+int Dionysus::finish_read_requests(){
   if (this->state->error == 0) {
-    return this->state->usb_total_size - this->state->usb_size_left;
+    return this->state->usb_actual_pos;
   }
   else {
+    //Whatever is left of a partial response is stale now, a timeout with
+    //nothing read (no interrupts) leaves nothing behind
+    if ((this->state->usb_actual_pos > 0) || (this->state->error != -10)){
+      this->state->ftdi_config.purge = true;
+    }
     return this->state->error;
   }
 }
 
-static void dionysus_writestream_cb(struct libusb_transfer *transfer){
-  state_t * state = (state_t *) transfer->user_data;
-  uint32_t buf_size = 0;
+int Dionysus::read(uint32_t header_len, uint8_t *buffer, uint32_t size, uint32_t timeout){
+  request_t * request = &this->state->request;
+  int retval = 0;
+
+  //The response belongs to the last command that was built in the state
+  memcpy(&request->command_header, &this->state->command_header, sizeof(command_header_t));
+  memset(&request->response_header, 0, sizeof(response_header_t));
+  request->header_len           = COMMAND_HEADER_LEN;
+  request->response_header_len  = header_len;
+  request->buffer               = buffer;
+  request->size                 = size;
+  request->read                 = (size > 0);
+  request->data_offset          = 0;
+
+  retval = this->read_requests(request, 1, timeout);
+  memcpy(&this->state->response_header, &request->response_header, sizeof(response_header_t));
+  return retval;
+}
+
+static void dionysus_writestream_cb(struct libusb_transfer *transfer);
+
+/*
+ *  Move the write position forward, stepping into the next segment when the
+ *  current one is used up
+ */
+static void advance_write_segment(state_t *state, uint32_t length){
+  state->write_segment_pos += length;
+  if (state->write_segment_pos >= state->write_segments[state->write_segment_index].size){
+    state->write_segment_index++;
+    state->write_segment_pos = 0;
+  }
+}
+
+static int submit_write_transfer(state_t *state, uint8_t *buffer, uint32_t length){
+  struct libusb_transfer * transfer;
+  int retval = 0;
+  transfer = usb_arena_get_transfer(&state->arena);
+  if (transfer == NULL){
+    return -5;
+  }
+  libusb_fill_bulk_transfer(transfer,
+                            state->usb_dev,
+                            state->in_ep,
+                            buffer,
+                            length,
+                            dionysus_writestream_cb,
+                            state,
+                            1000);
+  transfer->flags = 0;
+  transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+  retval = libusb_submit_transfer(transfer);
+  if (retval != 0){
+    usb_arena_put_transfer(&state->arena, transfer);
+    return retval;
+  }
+  state->writes_in_flight++;
+  return 0;
+}
+
+/*
+ *  Put as many write transfers on the bus as the in flight limit allows
+ *
+ *  Segments that are at least a chunk long (and the last segment) are sent
+ *  in place, one chunk per transfer. Small segments (command headers) are
+ *  gathered together with the start of whatever follows them into a staging
+ *  buffer so a header and its first chunk of payload go out in one transfer
+ */
+static int fill_write_transfers(state_t *state){
+  write_segment_t * segment;
+  uint32_t seg_left = 0;
+  uint32_t length = 0;
+  uint32_t cpy_size = 0;
+  uint8_t * staging = NULL;
+  int retval = 0;
+
+  while ((state->writes_in_flight < state->write_transfer_count) &&
+         (state->write_segment_index < state->write_segment_count)){
+    segment = &state->write_segments[state->write_segment_index];
+    seg_left = segment->size - state->write_segment_pos;
+    if (seg_left == 0){
+      state->write_segment_index++;
+      state->write_segment_pos = 0;
+      continue;
+    }
+    if ((seg_left >= state->write_chunk_size) ||
+        (state->write_segment_index == (state->write_segment_count - 1))){
+      //Send the data straight from the users buffer
+      length = (seg_left < state->write_chunk_size) ? seg_left : state->write_chunk_size;
+      retval = submit_write_transfer(state, &segment->data[state->write_segment_pos], length);
+      if (retval != 0){
+        return retval;
+      }
+      advance_write_segment(state, length);
+      continue;
+    }
+
+    //Coalesce the small segment with the data that follows it
+    staging = buffer_pool_get(&state->arena.bulk_pool);
+    if (staging == NULL){
+      //Wait for a staging buffer to come back
+      break;
+    }
+    length = 0;
+    while ((length < state->write_chunk_size) &&
+           (state->write_segment_index < state->write_segment_count)){
+      segment = &state->write_segments[state->write_segment_index];
+      seg_left = segment->size - state->write_segment_pos;
+      cpy_size = state->write_chunk_size - length;
+      if (seg_left < cpy_size){
+        cpy_size = seg_left;
+      }
+      memcpy(&staging[length], &segment->data[state->write_segment_pos], cpy_size);
+      length += cpy_size;
+      advance_write_segment(state, cpy_size);
+    }
+    retval = submit_write_transfer(state, staging, length);
+    if (retval != 0){
+      buffer_pool_put(&state->arena.bulk_pool, staging);
+      return retval;
+    }
+  }
+  return 0;
+}
+
+static void handle_write_transfer(state_t *state, struct libusb_transfer *transfer){
   int retval = 0;
   bool timeout;
+  bool failed;
+  int actual_length = transfer->actual_length;
   printds ("Entered\n");
+  state->writes_in_flight--;
   gettimeofday(&state->timeout_now, NULL);
   timeout = (TimevalDiff(&state->timeout_now, &state->timeout_start) * 1000) > state->timeout;
-  if (timeout||
-      ((transfer->status != LIBUSB_TRANSFER_COMPLETED) ||
-      (state->error != 0))){
+  failed = timeout ||
+           (transfer->status != LIBUSB_TRANSFER_COMPLETED) ||
+           (state->error != 0);
+  if (failed && (state->error == 0) && state->debug){
+    print_transfer_status(transfer);
+  }
+  //Give back the transfer and the staging buffer (if one was used), only
+  //the copies above are used after this
+  if (buffer_pool_owns(&state->arena.bulk_pool, transfer->buffer)){
+    buffer_pool_put(&state->arena.bulk_pool, transfer->buffer);
+  }
+  usb_arena_put_transfer(&state->arena, transfer);
 
+  if (failed){
     if (state->error == 0){
+      //Transfer Failed!
+      state->error = -1;
       if (timeout) {
         state->error = -10;
         printf ("Timeout while writing!\n");
       }
-      if (state->debug){
-        print_transfer_status(transfer);
-      }
       state->d->cancel_all_transfers();
     }
-    //Transfer Failed!
-    state->error = -1;
-    return;
   }
-  state->transfer_queue->push(transfer);
-  if (state->transfer_queue->size() == NUM_TRANSFERS){
+  else {
+    state->write_completed += actual_length;
+    //Keep the pipe full
+    retval = fill_write_transfers(state);
+    if (retval != 0){
+      printf ("Error when submitting write transfer: %d\n", retval);
+      state->error = -3;
+      state->d->cancel_all_transfers();
+    }
+  }
+  if (state->writes_in_flight == 0){
     //We're Done
     printds("Finished!\n");
     state->finished = true;
   }
 }
 
-int Dionysus::write(uint32_t header_len, uint8_t *buffer, int size, uint32_t timeout){
-  struct libusb_transfer * transfer;
-  uint32_t buf_size = 0;
-  uint8_t * buf = NULL;
-  int retval = 0;
-  uint32_t buffer_size_left = 0;
+static void dionysus_writestream_cb(struct libusb_transfer *transfer){
+  state_t * state = (state_t *) transfer->user_data;
+  state_lock(state);
+  handle_write_transfer(state, transfer);
+  state_unlock(state);
+}
 
-  printd ("Write transaction\n");
-  retval = this->set_comm_mode();
+/*
+ *  Set up how large writes are broken up
+ *
+ *  \param chunk_size: maximum size of a single write transfer
+ *    (1 - BULK_BUFFER_SIZE)
+ *  \param transfer_count: number of write transfers in flight
+ *    (1 - BULK_NUM_TRANSFERS)
+ *
+ *  This is the low latency link profile setup, the throughput profile uses
+ *  its own. Pin LINK_PROFILE_LOW_LATENCY to use it for all traffic
+ *
+ *  \retval  0: all fine
+ *          -1: invalid chunk size
+ *          -2: invalid transfer count
+ */
+int Dionysus::set_write_chunks(uint32_t chunk_size, uint32_t transfer_count){
+  if ((chunk_size == 0) || (chunk_size > BULK_BUFFER_SIZE)){
+    return -1;
+  }
+  if ((transfer_count == 0) || (transfer_count > BULK_NUM_TRANSFERS)){
+    return -2;
+  }
+  this->state->link_config.write_chunk_size     = chunk_size;
+  this->state->link_config.write_transfer_count = transfer_count;
+  if (this->state->link_profile == LINK_PROFILE_LOW_LATENCY){
+    this->state->write_chunk_size     = chunk_size;
+    this->state->write_transfer_count = transfer_count;
+  }
+  return 0;
+}
 
-  this->state->buffer           = buffer;
-  this->state->buffer_pos       = 0;
-  this->state->buffer_size      = size;
+/*
+ *  Number of bytes (headers included) that the last write put on the bus,
+ *  when a write fails this is how far it got
+ */
+uint32_t Dionysus::get_write_count(){
+  return this->state->write_completed;
+}
 
-  //Total size that will be read from the chip
-  this->state->usb_total_size   = size + header_len;
-  //size of the read that is left
-  this->state->usb_size_left    = 0;
-  //current position of the request
-  this->state->usb_pos          = 0;
-  //current position of the data read back from the device
-  this->state->usb_actual_pos   = 0;
+/*
+ *  Write a list of segments to the device as one stream
+ *
+ *  \retval >= 0: number of bytes written
+ *          < 0: error, get_write_count() reports the partial progress
+ */
+int Dionysus::write_segments(write_segment_t *segments, uint32_t count, uint32_t timeout){
+  int retval = this->start_write_segments(segments, count, timeout);
+  if (retval < 0){
+    return retval;
+  }
+  wait_for_finished(this->state);
+  return this->finish_write_segments();
+}
 
-  this->state->header_pos       = 0;
-  this->state->header_size      = header_len;
+/*
+ *  Submit the first write transfers without waiting for them, the rest are
+ *  submitted from the transfer callbacks
+ *
+ *  \retval 0: submitted, finish_write_segments() reports the result
+ *          < 0: the chip could not be set up, nothing was submitted
+ */
+int Dionysus::start_write_segments(write_segment_t *segments, uint32_t count, uint32_t timeout){
+  int retval = 0;
+
+  retval = this->set_comm_mode();
+  if (retval < 0){
+    //The writes would go out with the wrong latency or stale data
+    return retval;
+  }
+
+  state_lock(this->state);
+  this->state->write_segments       = segments;
+  this->state->write_segment_count  = count;
+  this->state->write_segment_index  = 0;
+  this->state->write_segment_pos    = 0;
+  this->state->write_completed      = 0;
+  this->state->writes_in_flight     = 0;
 
   this->state->error            = 0;
-  this->state->header_found     = false; // this isn't needed for a write
   this->state->finished         = false;
   this->state->timeout          = timeout;
   gettimeofday(&this->state->timeout_start, NULL);
 
-  //Setup a list of transfers
-  if (transfer_queue.empty()){
-    printf ("Transfer queue empty!\n");
-    return -5;
+  retval = fill_write_transfers(this->state);
+  if (retval != 0){
+    printf ("Error when submitting write transfer: %d\n", retval);
+    this->cancel_all_transfers();
+    this->state->error = -3;
+  }
+  if (this->state->writes_in_flight == 0){
+    this->state->finished = true;
+  }
+  state_unlock(this->state);
+  return 0;
+}
+
+int Dionysus::finish_write_segments(){
+  if (this->state->error != 0){
+    this->state->ftdi_config.purge = true;
+    return this->state->error;
   }
+  return this->state->write_completed;
+}
+
+int Dionysus::write(uint32_t header_len, uint8_t *buffer, int size, uint32_t timeout){
+  write_segment_t segments[2];
+  uint32_t count = 0;
+  int retval = 0;
 
+  printd ("Write transaction\n");
   //Send the header
   if (header_len > 0){
     if (this->debug){
@@ -683,61 +1521,27 @@ int Dionysus::write(uint32_t header_len, uint8_t *buffer, int size, uint32_t tim
       }
       printf ("\n");
     }
-    transfer = transfer_queue.front();
-    transfer_queue.pop();
-    //printf ("Transfer Length: %d\n", header_len);
-    libusb_fill_bulk_transfer(transfer,
-                            this->ftdi->usb_dev,
-                            this->ftdi->in_ep,
-                            (uint8_t *) &this->state->command_header,
-                            header_len,
-                            dionysus_writestream_cb,
-                            this->state,
-                            1000);
-    transfer->flags = 0;
-    transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
-    retval = libusb_submit_transfer(transfer);
-    printd("Submitted header transfer\n");
-    if (retval != 0){
-      //XXX: Need a way to clean up the USB stack
-      printf ("Error when submitting write transfer: %d\n", retval);
-      this->cancel_all_transfers();
-      this->state->error = -3;
-    }
-    this->state->usb_pos += header_len;
+    segments[count].data = (uint8_t *) &this->state->command_header;
+    segments[count].size = header_len;
+    count++;
   }
   if (size > 0){
-    transfer = transfer_queue.front();
-    transfer_queue.pop();
-    libusb_fill_bulk_transfer(transfer,
-                              this->ftdi->usb_dev,
-                              this->ftdi->in_ep,
-                              buffer,
-                              size,
-                              dionysus_writestream_cb,
-                              this->state,
-                              1000);
-    transfer->flags = 0;
-    transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
-    retval = libusb_submit_transfer(transfer);
-    printd("Submitted data transfer\n");
-    if (retval != 0){
-      printf ("Error when submitting write transfer: %d\n", retval);
-    }
-  }
-  while (!this->state->finished){
-    //XXX: How to wait for an interrupt and then finish this function?
-    retval = libusb_handle_events_completed(this->ftdi->usb_ctx, NULL);
-    if (this->debug){
-      //printf (".");
-    }
+    segments[count].data = buffer;
+    segments[count].size = size;
+    count++;
   }
-  //retval = ftdi_set_bitmode(this->ftdi, 0x00, BITMODE_RESET);
+  retval = this->write_segments(&segments[0], count, timeout);
   if (this->debug){
-    printf ("Finished %d left of %d\n", this->state->usb_size_left, size);
+    printf ("Finished %d of %d\n", this->state->write_completed, header_len + size);
   }
-  //this->print_status(true, 0);
-  return size - this->state->usb_size_left;
+  if (retval < 0){
+    return retval;
+  }
+  //Only report the payload
+  if ((uint32_t) retval < header_len){
+    return 0;
+  }
+  return retval - header_len;
 }
 
 int Dionysus::write_sync(uint8_t *buffer, uint16_t size){
@@ -769,16 +1573,42 @@ void Dionysus::cancel_all_transfers(){
   //Get the status of each transfer
   //If it is still in progress cancel it
   struct libusb_transfer * transfer;
-  uint32_t count = this->transfers.size();
   printd("Entered\n");
   //Go through each item in the transfer
-  for (int i = 0; i < count; i++){
-    transfer = this->transfers.front();
-    this->transfers.pop();
-    this->transfers.push(transfer);
+  for (int i = 0; i < NUM_TRANSFERS; i++){
+    transfer = this->state->arena.transfers[i];
+    if (transfer == NULL){
+      continue;
+    }
     //This will return an error if the transfer has already been
     //cancelled or finished but we can safely ignore it
     libusb_cancel_transfer(transfer);
   }
 }
 
+
+/*
+ *  Borrow a buffer from the USB arena, data written from an arena buffer
+ *  (write_memory) goes to the device without being copied by the kernel.
+ *  Buffers that don't fit in the arena come from the heap
+ *
+ *  All borrowed buffers must be given back before the device is closed
+ */
+uint8_t * Dionysus::alloc_buffer(uint32_t size){
+  uint8_t * buffer = NULL;
+  if (size <= this->state->arena.user_pool.buffer_size){
+    buffer = buffer_pool_get(&this->state->arena.user_pool);
+  }
+  if (buffer == NULL){
+    buffer = Nysa::alloc_buffer(size);
+  }
+  return buffer;
+}
+
+void Dionysus::free_buffer(uint8_t *buffer){
+  if (buffer_pool_owns(&this->state->arena.user_pool, buffer)){
+    buffer_pool_put(&this->state->arena.user_pool, buffer);
+    return;
+  }
+  Nysa::free_buffer(buffer);
+}
@@ -1,5 +1,6 @@
 #include "driver.hpp"
 #include <stdio.h>
+#include <string.h>
 
 enum _DMA_STATE {
   ST_UNKNOWN   = 0,
@@ -27,15 +28,122 @@ DMA::DMA (Nysa *nysa, Driver *driver, uint32_t dev_addr, bool debug){
   this->REG_SIZE[0]    = REG_UNINITIALIZED;
   this->REG_BASE[1]    = REG_UNINITIALIZED;
   this->REG_SIZE[1]    = REG_UNINITIALIZED;
+  this->REG_COUNT      = REG_UNINITIALIZED;
+  this->allocated      = false;
+  this->transfer_size  = 0;
+  this->block_size[0]  = 0;
+  this->block_size[1]  = 0;
   this->strategy       = CADENCE;
   this->blocking       = true;
   this->timeout        = 1000;
   this->block_state[0] = UNKNOWN;
   this->block_state[1] = UNKNOWN;
   this->read_state     = ST_UNKNOWN;
+  this->block_select   = 0;
+  this->shadow_status  = true;
+  this->inflight_count = 0;
+  this->status_reads   = 0;
+  this->status_reads_avoided = 0;
   this->test_bit       = 0;
+
+  this->writer_running = false;
+  this->writer_busy    = false;
+  this->queue_policy   = QUEUE_DROP_OLDEST;
+  this->frames_written = 0;
+  this->frames_dropped = 0;
+  this->writer_error   = 0;
+  pthread_mutex_init(&this->queue_lock, NULL);
+  pthread_cond_init(&this->queue_ready_cond, NULL);
+  pthread_cond_init(&this->queue_space_cond, NULL);
+
+  this->capture_running   = false;
+  this->capture_ring      = NULL;
+  this->capture_file      = NULL;
+  this->capture_scratch   = NULL;
+  this->capture_blocks    = 0;
+  this->capture_bytes     = 0;
+  this->capture_overruns  = 0;
+  this->capture_underruns = 0;
+  this->capture_error     = 0;
+
+  this->reset_transfer_stats();
 }
 DMA::~DMA(){
+  this->stop_capture();
+  this->stop_write_queue();
+  if (this->allocated){
+    this->nysa->free_memory(this->mem_alloc[0]);
+    this->nysa->free_memory(this->mem_alloc[1]);
+  }
+  pthread_cond_destroy(&this->queue_space_cond);
+  pthread_cond_destroy(&this->queue_ready_cond);
+  pthread_mutex_destroy(&this->queue_lock);
+}
+
+/*
+ *  Get both blocks from the FPGA memory allocator instead of fixed
+ *  addresses, they are given back when the DMA is destroyed
+ *
+ *  \param size: size of a block in bytes
+ *  \param mem_base0: address of block 0, pass it to 'setup_write/read'
+ *  \param mem_base1: address of block 1, pass it to 'setup_write/read'
+ *
+ *  \retval  0: all fine
+ *          -1: the image does not have enough free memory (or the DRT was
+ *              not read), mem_base0/1 are left alone
+*/
+int DMA::alloc_blocks(uint32_t size, uint32_t *mem_base0, uint32_t *mem_base1){
+  uint32_t base0 = 0;
+  uint32_t base1 = 0;
+  if (this->allocated){
+    this->nysa->free_memory(this->mem_alloc[0]);
+    this->nysa->free_memory(this->mem_alloc[1]);
+    this->allocated = false;
+  }
+  if (this->nysa->alloc_memory(size, &base0) < 0){
+    return -1;
+  }
+  if (this->nysa->alloc_memory(size, &base1) < 0){
+    this->nysa->free_memory(base0);
+    return -1;
+  }
+  this->mem_alloc[0] = base0;
+  this->mem_alloc[1] = base1;
+  this->allocated    = true;
+  *mem_base0         = base0;
+  *mem_base1         = base1;
+  return 0;
+}
+
+/*
+ *  Reserve two fixed blocks in the FPGA memory allocator, used when
+ *  'alloc_blocks' fails so no other driver is handed the same memory,
+ *  they are given back when the DMA is destroyed
+ *
+ *  \param size: size of a block in bytes
+ *  \param mem_base0: address of block 0
+ *  \param mem_base1: address of block 1
+ *
+ *  \retval  0: all fine
+ *          -1: a block overlaps memory that is allocated or reserved
+*/
+int DMA::reserve_blocks(uint32_t size, uint32_t mem_base0, uint32_t mem_base1){
+  if (this->allocated){
+    this->nysa->free_memory(this->mem_alloc[0]);
+    this->nysa->free_memory(this->mem_alloc[1]);
+    this->allocated = false;
+  }
+  if (this->nysa->reserve_memory(mem_base0, size) < 0){
+    return -1;
+  }
+  if (this->nysa->reserve_memory(mem_base1, size) < 0){
+    this->nysa->free_memory(mem_base0);
+    return -1;
+  }
+  this->mem_alloc[0] = mem_base0;
+  this->mem_alloc[1] = mem_base1;
+  this->allocated    = true;
+  return 0;
 }
 
 /*
@@ -89,6 +197,8 @@ int DMA::setup( uint32_t      mem_base0,
   this->REG_SIZE[1]     = reg_size1;
   this->blocking        = blocking;
   this->strategy        = strategy;
+  this->transfer_size   = size;
+  this->inflight_count  = 0;
 
   //Setup the core
   this->driver->write_register(this->REG_BASE[0], this->BASE[0]);
@@ -282,113 +392,308 @@ void DMA::enable_blocking(bool enable){
  *    strategy: the DMA transfer will behave differently. based on the
  *      enumerated value set either in 'setup' or in 'set_strategy'
  *
- *  \param buffer: a pointer to the buffer of data to send
+ *  \param buffer: a pointer to the buffer of data to send, 'SIZE' bytes
  *
 */
 int DMA::write(uint8_t *buffer){
+  return this->write(buffer, this->SIZE);
+}
+
+/*
+ *  Write 'size' bytes using the DMA, only 'size' bytes are uploaded and the
+ *  core is told to consume only that much of the block
+ *
+ *  \param buffer: a pointer to the buffer of data to send
+ *  \param size: number of bytes in buffer, a multiple of 4 no larger than
+ *    'SIZE'
+ *
+ *  \retval  0: all fine
+ *           1: no block was empty (non-blocking)
+ *          -2: unknown strategy
+ *          -3: bad size
+*/
+int DMA::write(uint8_t *buffer, uint32_t size){
   int retval = 0;
   bool finished = false;
-  uint32_t status;
-  uint32_t interrupts;
+  uint32_t block = 0;
 
+  if ((size == 0) || (size > this->SIZE) || ((size % 4) != 0)){
+    return -3;
+  }
   while (!finished){
-    printf ("%s(): Main loop\n", __func__);
-    //Get the current status
-    status = this->driver->read_register(this->REG_STATUS);
-    printf ("%s(): Status Register: 0x%08X\n", __func__, status);
-    //Check if anything is ready
-    if ((status & (this->status_bit_empty[0] | this->status_bit_empty[1])) == 0){
-      //neither block is ready
-      //wait for interrupts
-      while (this->blocking){
-        //printf ("%s(): Blocking...\n", __func__);
-        //If the user is okay with waiting just keep waiting for interrupts
-        this->nysa->wait_for_interrupts(1000, &interrupts);
-        if (this->driver->is_interrupt_for_device(interrupts)) {
-          printf ("%s(): Found an interrupt\n", __func__);
-          break;
-        }
-        else {
-          printf ("%s(): Didn't find interrupts\n", __func__);
-          status = this->driver->read_register(this->REG_STATUS);
-        }
+    if (this->debug) printf ("%s(): Main loop\n", __func__);
+    //Work from the shadowed block states, the core is only asked when the
+    //shadow can not tell whether a block is free
+    if (!this->write_ready()){
+      if (this->blocking && this->shadow_status && (this->inflight_count > 0)){
+        //Everything that was handed over is still in flight, wait for it
+        this->status_reads_avoided++;
+      }
+      else {
+        this->sync_status();
       }
-      status = this->driver->read_register(this->REG_STATUS);
-      if (status & (this->status_bit_empty[0] || this->status_bit_empty[1])){
+      while (this->blocking && !this->write_ready()){
+        this->wait_block();
+      }
+      if (!this->write_ready()){
         //empty status not found
-        printd ("Second status found no empty block available (this could be caused by a non-block return\n");
+        printd ("No empty block available (this could be caused by a non-block return)\n");
         retval = 1;
         finished = true;
         break;
       }
     }
-    this->process_status(status);
 
+    if (this->debug){
+      printf ("%s(): block state [0]: 0x%08X\n", __func__, this->block_state[0]);
+      printf ("%s(): block state [1]: 0x%08X\n", __func__, this->block_state[1]);
+    }
     //Test whether we can send data as fast as possible or whether we need
-    //both blocks empty efore we can send more data
+    //both blocks empty before we can send more data
     switch (this->strategy){
       case (IMMEDIATE):
       case (CADENCE):
-        printf ("%s(): In Cadence Switch...\n", __func__);
-        printf ("%s(): block state [0]: 0x%08X\n", __func__, this->block_state[0]);
-        printf ("%s(): block state [1]: 0x%08X\n", __func__, this->block_state[1]);
-        if ((this->block_state[0] == BLOCK_EMPTY) ||
-            (this->block_state[1] == BLOCK_EMPTY)){
-          //A FIFO is available, start sending data down NOW
-          if (this->block_state[0] == BLOCK_EMPTY){
-            printf ("%s(): Writing 0x%08X Bytes to block 0 (Loc: 0x%08X)\n",
-                __func__,
-                this->SIZE,
-                this->BASE[0]);
-            printf ("%s(): Writing 0x%08X 32 bit values to Reg size 0 (%d)\n",
-                __func__,
-                (this->SIZE / 4),
-                REG_SIZE[0]);
-
-            this->nysa->write_memory(this->BASE[0], buffer, this->SIZE);
-            this->driver->write_register(this->REG_SIZE[0], (this->SIZE / 4));
-
-
-            /*
-            printf ("%s(): Writing 0x%08X Bytes to block 1 (Loc: 0x%08X)\n",
-                __func__,
-                this->SIZE,
-                this->BASE[1]);
-            printf ("%s(): Writing 0x%08X 32 bit values to Reg size 1 (%d)\n",
-                __func__,
-                (this->SIZE / 4),
-                REG_SIZE[1]);
-            this->nysa->write_memory(this->BASE[1], buffer, this->SIZE);
-            this->driver->write_register(this->REG_SIZE[1], (this->SIZE / 4));
-            */
-
-          }
-          else {
-            printf ("%s(): Writing 0x%08X Bytes to block 1 (Loc: 0x%08X)\n", __func__, this->SIZE, this->BASE[1]);
-            printf ("%s(): Writing 0x%08X 32 bit values to Reg size 1 (%d)\n", __func__, (this->SIZE / 4), REG_SIZE[1]);
-            this->nysa->write_memory(this->BASE[1], buffer, this->SIZE);
-            this->driver->write_register(this->REG_SIZE[1], (this->SIZE / 4));
-          }
-          finished = true;
-          retval = 0;
+        //The core consumes the blocks in turn, keep the order if possible
+        block = this->block_select;
+        if (this->block_state[block] != BLOCK_EMPTY){
+          block ^= 1;
         }
+        this->upload_block(block, buffer, size);
+        finished = true;
+        retval = 0;
         break;
       case (SINGLE_BUFFER):
-        if ((this->block_state[0] == BLOCK_EMPTY) &&
-            (this->block_state[1] == BLOCK_EMPTY)){
-
-          this->nysa->write_memory(this->BASE[0], buffer, this->SIZE);
-          this->driver->write_register(this->REG_SIZE[0], (this->SIZE / 4));
-        }
+        //'write_ready' waited for both blocks
+        this->upload_block(0, buffer, size);
+        finished = true;
+        retval = 0;
         break;
       default:
         retval = -2;  //unknown strategy
+        finished = true;
         break;
     }//switch (strategy)
   } //while (!finished)
   return retval;
 }
 
+/*
+ *  Hand 'size' bytes in 'block' to the core
+*/
+void DMA::upload_block(uint32_t block, uint8_t *buffer, uint32_t size){
+  if (this->debug){
+    printf ("%s(): Writing 0x%08X Bytes to block %d (Loc: 0x%08X)\n", __func__, size, block, this->BASE[block]);
+    printf ("%s(): Writing 0x%08X 32 bit values to Reg size %d (%d)\n", __func__, (size / 4), block, REG_SIZE[block]);
+  }
+  this->nysa->write_memory(this->BASE[block], buffer, size);
+  this->driver->write_register(this->REG_SIZE[block], (size / 4));
+  this->count_handoff(block);
+  this->mark_busy(block);
+  this->block_select = block ^ 1;
+  this->count_transfer(size);
+}
+
+/*
+ *  Background Writer
+ *    Producers copy their buffers into a bounded queue and return, a
+ *    thread takes the buffers off the queue and writes them with 'write'.
+ *    While the core is consuming one block the thread is already uploading
+ *    the next buffer into the other block
+ */
+
+void * DMA::writer_thread_func(void *arg){
+  ((DMA *) arg)->run_writer();
+  return NULL;
+}
+
+void DMA::run_writer(){
+  uint8_t * frame;
+  int retval = 0;
+
+  pthread_mutex_lock(&this->queue_lock);
+  while (true){
+    while (this->writer_running && this->queue_ready.empty()){
+      pthread_cond_wait(&this->queue_ready_cond, &this->queue_lock);
+    }
+    if (!this->writer_running){
+      break;
+    }
+    frame = this->queue_ready.front();
+    this->queue_ready.pop_front();
+    this->writer_busy = true;
+    pthread_mutex_unlock(&this->queue_lock);
+
+    //Wait for a block to open up, 1 means no block was empty yet
+    do {
+      try {
+        retval = this->write(frame);
+      }
+      catch (int error){
+        retval = error;
+      }
+    } while ((retval == 1) && this->writer_running);
+
+    pthread_mutex_lock(&this->queue_lock);
+    if (retval < 0){
+      this->writer_error = retval;
+    }
+    else if (retval == 0){
+      this->frames_written++;
+    }
+    this->writer_busy = false;
+    this->queue_free.push_back(frame);
+    pthread_cond_broadcast(&this->queue_space_cond);
+  }
+  pthread_mutex_unlock(&this->queue_lock);
+}
+
+/*
+ *  Start the background writer
+ *
+ *  \param depth: number of buffers that can wait in the queue (one more is
+ *    allocated for the buffer that is being written)
+ *  \param policy: what a non blocking 'enqueue' does when the queue is full
+ *
+ *  \retval  0: all fine
+ *          -1: not set up for writing or already running
+ *          -2: failed to start the thread
+*/
+int DMA::start_write_queue(uint32_t depth, QUEUE_POLICY policy){
+  uint8_t * frame;
+  if (!this->writing || this->writer_running || (depth == 0) || (this->SIZE == 0)){
+    return -1;
+  }
+  //Buffers from Nysa so the transport can send them without a copy
+  for (uint32_t i = 0; i < depth + 1; i++){
+    frame = this->nysa->alloc_buffer(this->SIZE);
+    this->queue_frames.push_back(frame);
+    this->queue_free.push_back(frame);
+  }
+  this->queue_policy   = policy;
+  this->frames_written = 0;
+  this->frames_dropped = 0;
+  this->writer_error   = 0;
+  this->writer_running = true;
+  if (pthread_create(&this->writer_thread, NULL, DMA::writer_thread_func, this) != 0){
+    this->writer_running = false;
+    this->stop_write_queue();
+    return -2;
+  }
+  return 0;
+}
+
+/*
+ *  Stop the background writer, buffers that are still queued are dropped
+*/
+void DMA::stop_write_queue(){
+  pthread_mutex_lock(&this->queue_lock);
+  bool running = this->writer_running;
+  this->writer_running = false;
+  pthread_cond_broadcast(&this->queue_ready_cond);
+  pthread_cond_broadcast(&this->queue_space_cond);
+  pthread_mutex_unlock(&this->queue_lock);
+  if (running){
+    pthread_join(this->writer_thread, NULL);
+  }
+  for (uint32_t i = 0; i < this->queue_frames.size(); i++){
+    this->nysa->free_buffer(this->queue_frames[i]);
+  }
+  this->queue_frames.clear();
+  this->queue_free.clear();
+  this->queue_ready.clear();
+}
+
+/*
+ *  Queue a buffer of 'SIZE' bytes to be written, the buffer is copied so
+ *  it can be reused as soon as this returns
+ *
+ *  \param buffer: data to write
+ *  \param block:
+ *    true: wait for room in the queue
+ *    false: apply the queue policy when the queue is full
+ *
+ *  \retval  0: queued
+ *           1: dropped (queue full, QUEUE_DROP_NEWEST)
+ *          < 0: the writer is not running or a previous write failed
+*/
+int DMA::enqueue(uint8_t *buffer, bool block){
+  uint8_t * frame;
+  int retval = 0;
+  pthread_mutex_lock(&this->queue_lock);
+  while (this->writer_running && this->queue_free.empty()){
+    if (block){
+      pthread_cond_wait(&this->queue_space_cond, &this->queue_lock);
+    }
+    else if ((this->queue_policy == QUEUE_DROP_OLDEST) && !this->queue_ready.empty()){
+      this->queue_free.push_back(this->queue_ready.front());
+      this->queue_ready.pop_front();
+      this->frames_dropped++;
+    }
+    else {
+      this->frames_dropped++;
+      pthread_mutex_unlock(&this->queue_lock);
+      return 1;
+    }
+  }
+  if (!this->writer_running || (this->writer_error < 0)){
+    retval = this->writer_running ? this->writer_error : -1;
+    this->writer_error = 0;
+    pthread_mutex_unlock(&this->queue_lock);
+    return retval;
+  }
+  frame = this->queue_free.back();
+  this->queue_free.pop_back();
+  pthread_mutex_unlock(&this->queue_lock);
+
+  memcpy(frame, buffer, this->SIZE);
+
+  pthread_mutex_lock(&this->queue_lock);
+  this->queue_ready.push_back(frame);
+  pthread_cond_signal(&this->queue_ready_cond);
+  pthread_mutex_unlock(&this->queue_lock);
+  return 0;
+}
+
+/*
+ *  Wait until every queued buffer has been written
+ *
+ *  \retval  0: all fine
+ *          < 0: a write failed
+*/
+int DMA::flush_write_queue(){
+  int retval = 0;
+  pthread_mutex_lock(&this->queue_lock);
+  while (this->writer_running && (!this->queue_ready.empty() || this->writer_busy)){
+    pthread_cond_wait(&this->queue_space_cond, &this->queue_lock);
+  }
+  retval = this->writer_error;
+  this->writer_error = 0;
+  pthread_mutex_unlock(&this->queue_lock);
+  return retval;
+}
+
+void DMA::set_queue_policy(QUEUE_POLICY policy){
+  pthread_mutex_lock(&this->queue_lock);
+  this->queue_policy = policy;
+  pthread_mutex_unlock(&this->queue_lock);
+}
+
+uint32_t DMA::get_queue_count(){
+  uint32_t count = 0;
+  pthread_mutex_lock(&this->queue_lock);
+  count = this->queue_ready.size();
+  pthread_mutex_unlock(&this->queue_lock);
+  return count;
+}
+
+uint32_t DMA::get_frames_written(){
+  return this->frames_written;
+}
+
+uint32_t DMA::get_frames_dropped(){
+  return this->frames_dropped;
+}
+
 /*
  *  Process the incomming status
  *
@@ -444,6 +749,124 @@ void DMA::process_status(uint32_t status){
   }
 }
 
+/*
+ *  Status Shadow
+ *    Every status read is a round trip over the link so the block states
+ *    are tracked locally:
+ *      - A block the host hands to the core is busy
+ *      - The core raises an interrupt when it finishes a block and it works
+ *        on the blocks in the order they were handed over, with one block
+ *        in flight an interrupt retires it (empty for writes, full for
+ *        reads)
+ *      - Interrupts that arrive close together are merged into one, with
+ *        both blocks in flight an interrupt may stand for one or both of
+ *        them so the status register settles it
+ *      - A block that is empty stays empty until the host uses it
+ *    The status register is only read when the shadow can not decide
+ *    (nothing or both blocks in flight, a wait timed out or the shadow is
+ *    disabled)
+*/
+
+/*
+ *  Read the status register and rebuild the shadow from it
+*/
+void DMA::sync_status(){
+  uint32_t status = this->driver->read_register(this->REG_STATUS);
+  if (this->debug) printf ("%s(): Status Register: 0x%08X\n", __func__, status);
+  this->status_reads++;
+  this->process_status(status);
+  //The next block in turn is the older one
+  this->inflight_count = 0;
+  if (this->block_state[this->block_select] == BLOCK_BUSY){
+    this->inflight[this->inflight_count++] = this->block_select;
+  }
+  if (this->block_state[this->block_select ^ 1] == BLOCK_BUSY){
+    this->inflight[this->inflight_count++] = this->block_select ^ 1;
+  }
+}
+
+/*
+ *  A block was handed to the core
+*/
+void DMA::mark_busy(uint32_t block){
+  this->block_state[block] = BLOCK_BUSY;
+  for (uint32_t i = 0; i < this->inflight_count; i++){
+    if (this->inflight[i] == block){
+      return;
+    }
+  }
+  if (this->inflight_count < 2){
+    this->inflight[this->inflight_count++] = block;
+  }
+}
+
+/*
+ *  Apply an interrupt to the shadow
+ *
+ *  \param interrupts: interrupt vector from 'wait_for_interrupts'
+ *
+ *  \retval true: the interrupt was for this core and retired a block
+ *    false: the status register has to be read
+*/
+bool DMA::update_block_state(uint32_t interrupts){
+  uint32_t block;
+  if (!this->driver->is_interrupt_for_device(interrupts) || (this->inflight_count != 1)){
+    return false;
+  }
+  block = this->inflight[0];
+  this->inflight[0] = this->inflight[1];
+  this->inflight_count--;
+  this->block_state[block] = this->writing ? BLOCK_EMPTY : BLOCK_FULL;
+  return true;
+}
+
+/*
+ *  Wait for the core to finish a block, falls back to the status register
+ *  when the interrupt does not settle it
+*/
+void DMA::wait_block(){
+  uint32_t interrupts = 0;
+  int retval = this->nysa->wait_for_interrupts(this->timeout, &interrupts);
+  if (this->shadow_status && (retval == 0) && this->update_block_state(interrupts)){
+    if (this->debug) printf ("%s(): Found an interrupt\n", __func__);
+    this->status_reads_avoided++;
+    return;
+  }
+  this->sync_status();
+}
+
+/*
+ *  True when the shadow has room for the next write
+*/
+bool DMA::write_ready(){
+  if (this->strategy == SINGLE_BUFFER){
+    return (this->block_state[0] == BLOCK_EMPTY) && (this->block_state[1] == BLOCK_EMPTY);
+  }
+  return (this->block_state[0] == BLOCK_EMPTY) || (this->block_state[1] == BLOCK_EMPTY);
+}
+
+/*
+ *  Trust interrupts to track the block states (Default true), disable for
+ *  cores that raise interrupts for anything other than finished blocks
+*/
+void DMA::enable_status_shadow(bool enable){
+  this->shadow_status = enable;
+  if (!enable){
+    this->inflight_count = 0;
+  }
+}
+
+uint32_t DMA::get_status_reads(){
+  return this->status_reads;
+}
+
+/*
+ *  Number of times the shadow answered instead of the status register
+*/
+uint32_t DMA::get_status_reads_avoided(){
+  return this->status_reads_avoided;
+}
+
 /*
  *  Read a block of data from the Memory
  *    Populate the buffer pointed to by uint8_t buffer passed in the size is
@@ -459,38 +882,77 @@ void DMA::process_status(uint32_t status){
  *
  *  \retval  0: all fine
  *           1: non-blocking time out
+ *          -1: a streaming capture owns the DMA
  *
 */
 
 int DMA::read(uint8_t *buffer){
-  int retval;
-  uint32_t status;
-  uint32_t interrupts;
-  uint32_t read_size;
-  uint32_t pos = 0;
+  return this->read(buffer, this->SIZE, NULL);
+}
+
+/*
+ *  Read up to 'size' bytes, blocks are requested from the core with 'size'
+ *  bytes so a short transfer finishes early
+ *
+ *    If a count register was set with 'set_count_register' the core decides
+ *    how much of the block is valid, otherwise the requested size is. A
+ *    block that was already requested with a larger size (CADENCE and
+ *    IMMEDIATE request the next block ahead) is not cut, it stays full
+ *    until a read with a buffer that can hold it
+ *
+ *  \param buffer: buffer of at least 'size' bytes
+ *  \param size: number of bytes to request, a multiple of 4 no larger than
+ *    'SIZE'
+ *  \param actual: (optional) number of bytes that were put in buffer, with
+ *    -4 the number of bytes the next block holds
+ *
+ *  \retval  0: all fine
+ *           1: non-blocking time out
+ *          -1: a streaming capture owns the DMA
+ *          -3: bad size
+ *          -4: the next block holds more than 'size' bytes, nothing was
+ *              read
+*/
+int DMA::read(uint8_t *buffer, uint32_t size, uint32_t *actual){
+  int retval = 0;
+  uint32_t blk = 0;
   bool block = this->blocking;
   bool finished = false;
+  if (this->capture_running){
+    return -1;
+  }
+  if ((size == 0) || (size > this->SIZE) || ((size % 4) != 0)){
+    return -3;
+  }
+  this->transfer_size = size;
+  if (actual != NULL){
+    *actual = 0;
+  }
 //  //printf ("%s(): Entered\n", __func__);
 
   //get the current status
   while (!finished){
     switch (this->read_state){
       case(ST_IDLE):
-//        printf ("%s(): IDLE State, requesting data\n", __func__);
         //No transactions have started
         this->block_select = 0;
-        this->driver->write_register(this->REG_SIZE[0], (this->SIZE / 4));
+        this->arm_block(0);
         if (this->strategy == IMMEDIATE){
-          this->driver->write_register(this->REG_SIZE[1], (this->SIZE / 4));
+          this->arm_block(1);
         }
         this->read_state = ST_BUSY;
         break;
       case(ST_BUSY):
-        //retval = this->nysa->wait_for_interrupts(2, &interrupts);
-//        printf ("%s(): BUSY State\n", __func__);
-        status = this->driver->read_register(this->REG_STATUS);
-//        printf ("\tStatus Register: 0x%08X\n", status);
-        this->process_status(status);
+        if ((this->block_state[0] != BLOCK_FULL) &&
+            (this->block_state[1] != BLOCK_FULL)){
+          if (block && this->shadow_status && (this->inflight_count > 0)){
+            //The shadow knows what is in flight, wait for it to finish
+            this->status_reads_avoided++;
+          }
+          else {
+            this->sync_status();
+          }
+        }
         if ((this->block_state[0] == BLOCK_EMPTY) &&
             (this->block_state[1] == BLOCK_EMPTY)){
           this->read_state = ST_UNKNOWN;
@@ -499,18 +961,7 @@ int DMA::read(uint8_t *buffer){
         if ((this->block_state[0] != BLOCK_FULL) &&
             (this->block_state[1] != BLOCK_FULL)){
           do {
-            retval = this->nysa->wait_for_interrupts(1000, &interrupts);
-//            printf ("\tInterrupt Return: %d\n", retval);
-            if (retval == 0){
-              if (this->driver->is_interrupt_for_device(interrupts)){
-                  //we got some data
-//                  printf ("\tInterrupt for us!\n");
-                  //break;
-              }
-            }
-            status = this->driver->read_register(this->REG_STATUS);
-//            printf ("\tStatus Register: 0x%08X\n", status);
-            this->process_status(status);
+            this->wait_block();
             if ((this->block_state[0] == BLOCK_FULL) ||
                 (this->block_state[1] == BLOCK_FULL)){
               break;
@@ -520,21 +971,16 @@ int DMA::read(uint8_t *buffer){
 //        //printf ("\tBlock states: 0x%02X 0x%02X\n", this->block_state[0], this->block_state[1]);
         if ((this->block_state[0] == BLOCK_FULL) ||
             (this->block_state[1] == BLOCK_FULL) ){
-          /*
-          //there is some data to read
-          if ((this->strategy == IMMEDIATE) || (this->strategy == CADENCE)){
+          //there is some data to read, with IMMEDIATE the core gets an empty
+          //block to fill before the full one is read out
+          if (this->strategy == IMMEDIATE){
             if (this->block_state[0] == BLOCK_EMPTY){
-//              printf ("\tStart a read of block 0\n");
-              this->driver->write_register(this->REG_SIZE[0], (this->SIZE / 4));
-              this->block_state[0] = BLOCK_BUSY;
+              this->arm_block(0);
             }
             if (this->block_state[1] == BLOCK_EMPTY){
-//              printf ("\tStart a read of block 1\n");
-              this->driver->write_register(this->REG_SIZE[1], (this->SIZE / 4));
-              this->block_state[1] = BLOCK_BUSY;
+              this->arm_block(1);
             }
           }
-          */
           this->read_state = ST_FINISHED;
           continue;
         }
@@ -542,102 +988,46 @@ int DMA::read(uint8_t *buffer){
         finished = true;
         break;
       case(ST_FINISHED):
-
         //FPGA has some data to process
-//        printf ("%s(): ST_FINISHED, Reading data\n", __func__);
         if ((this->block_state[0] != BLOCK_FULL) &&
             (this->block_state[1] != BLOCK_FULL) ){
-//          printf ("\tBoth blocks are not full, get the state\n");
           this->read_state = ST_UNKNOWN;
           continue;
         }
-
-        //BOTH BLOCKS ARE READY
-        if ((this->block_state[0] == BLOCK_FULL) &&
-            (this->block_state[1] == BLOCK_FULL)){
-
-//          printf ("\tBOTH BLOCKS ARE FULL\n");
-          //both are finished, use the local variable as a tie breaker
-          if (this->block_select == 0){
-//            printf ("\t\t\t\t0\n");
-            this->nysa->read_memory(this->BASE[0], buffer, this->SIZE);
-            this->block_select = 1;
-//            if (this->test_bit) printf ("\t\t\t\t\t\t\t\t\t\tFAIL!: Test bit should be 0\n");
-            this->test_bit = 1;
-            //status = this->driver->read_register(this->REG_STATUS);
-            //if (this->strategy == IMMEDIATE) {
-              this->driver->write_register(this->REG_SIZE[0], (this->SIZE / 4));
-              this->block_state[0] = BLOCK_BUSY;
-            //}
-            //else {
-            //  this->block_state[0] = BLOCK_EMPTY;
-            //}
-          }
-          else {
-//            printf ("\t\t\t\t1\n");
-            this->nysa->read_memory(this->BASE[1], buffer, this->SIZE);
-            this->block_select = 0;
-//            if (!this->test_bit) printf ("\t\t\t\t\t\t\t\t\t\tFAIL!: Test bit should be 1\n");
-            this->test_bit = 0;
-            //status = this->driver->read_register(this->REG_STATUS);
-            //if (this->strategy == IMMEDIATE) {
-              this->driver->write_register(this->REG_SIZE[0], (this->SIZE / 4));
-              this->block_state[1] = BLOCK_BUSY;
-            //}
-            //else {
-            //  this->block_state[1] = BLOCK_EMPTY;
-            //}
-          }
-          this->read_state = ST_FINISHED;
+        //Blocks fill in turn, when both are full take the older one
+        blk = this->block_select;
+        if (this->block_state[blk] != BLOCK_FULL){
+          blk ^= 1;
+        }
+        if (this->read_block(blk, buffer, actual) < 0){
+          retval = -4;
+          finished = true;
+          break;
         }
+        this->block_state[blk] = BLOCK_EMPTY;
+        this->block_select = blk ^ 1;
 
-        //SINGLE BLOCK READY
-        else if (this->block_state[0] == BLOCK_FULL) {
-//          printf ("\t\tBLOCK 0 IS FULL ONLY\n");
-//          printf ("\t\t\t\t0\n");
-          this->block_select = 1;
-          this->nysa->read_memory(this->BASE[0], buffer, this->SIZE);
-//          if (this->test_bit) printf ("\t\t\t\t\t\t\t\t\t\tFAIL!: Test bit should be 0\n");
-          this->test_bit = 1;
-          this->block_state[0] = BLOCK_EMPTY;
-          //this->read_state = ST_IDLE;
-          //if ((this->strategy == IMMEDIATE) || (this->strategy == CADENCE)){
-            if (this->block_state[1] == BLOCK_EMPTY){
-//              printf ("\t\t\tStart reading from block 1\n");
-              this->driver->write_register(this->REG_SIZE[1], (this->SIZE / 4));
-              this->block_state[1] == BLOCK_BUSY;
+        switch (this->strategy){
+          case (IMMEDIATE):
+            //Keep both blocks in flight, the core fills one while the
+            //other is read
+            if (this->block_state[blk ^ 1] == BLOCK_EMPTY){
+              this->arm_block(blk ^ 1);
             }
-          //}
-          //if (this->strategy == IMMEDIATE){
-          //  this->driver->write_register(this->REG_SIZE[0], this->SIZE);
-          //  this->block_state[0] = BLOCK_BUSY;
-          //  this->read_state = ST_BUSY;
-          //}
-          this->read_state = ST_BUSY;
-        }
-        else if (this->block_state[1] == BLOCK_FULL) {
-//          printf ("\t\tBLOCK 1 IS FULL ONLY\n");
-//          printf ("\t\t\t\t1\n");
-          this->block_select = 0;
-          this->nysa->read_memory(this->BASE[1], buffer, this->SIZE);
-//          if (!this->test_bit) printf ("\t\t\t\t\t\t\t\t\t\tFAIL!: Test bit should be 1\n");
-          this->test_bit = 0;
-          this->block_state[1] = BLOCK_EMPTY;
-          this->read_state = ST_IDLE;
-          //if ((this->strategy == IMMEDIATE) || (this->strategy == CADENCE)){
-            if (this->block_state[0] == BLOCK_EMPTY){
-//              printf ("\t\t\tStart reading from block 0\n");
-              this->driver->write_register(this->REG_SIZE[0], (this->SIZE / 4));
-              this->block_state[0] == BLOCK_BUSY;
+            this->arm_block(blk);
+            this->read_state = ST_BUSY;
+            break;
+          case (CADENCE):
+            //One block ahead of the reader
+            if (this->block_state[blk ^ 1] == BLOCK_EMPTY){
+              this->arm_block(blk ^ 1);
             }
-          //  this->read_state = ST_BUSY;
-          //}
-          //if (this->strategy == IMMEDIATE){
-            this->driver->write_register(this->REG_SIZE[1], (this->SIZE / 4));
-            this->block_state[1] = BLOCK_BUSY;
-          //  this->read_state = ST_BUSY;
-          //}
-          this->read_state = ST_BUSY;
+            this->read_state = ST_BUSY;
+            break;
+          default:
+            //SINGLE_BUFFER: the next read starts over
+            this->read_state = ST_IDLE;
+            break;
         }
         retval = 0; //fine
         finished = true;
@@ -645,9 +1035,7 @@ int DMA::read(uint8_t *buffer){
       case(ST_UNKNOWN):
       default:
         //We need to get the status
-//        printf ("%s(): UNKNOWN Status\n", __func__);
-        status = this->driver->read_register(this->REG_STATUS);
-        this->process_status(status);
+        this->sync_status();
 //        //printf ("\tBlock states: 0x%02X 0x%02X\n", this->block_state[0], this->block_state[1]);
         if ((this->block_state[0] == BLOCK_FULL) ||
             (this->block_state[1] == BLOCK_FULL) ){
@@ -675,3 +1063,413 @@ int DMA::read(uint8_t *buffer){
   return retval;
 }
 
+/*
+ *  Ask the core for a block of 'transfer_size' bytes
+*/
+void DMA::request_block(uint32_t block){
+  this->block_size[block] = this->transfer_size;
+  this->driver->write_register(this->REG_SIZE[block], (this->transfer_size / 4));
+}
+
+/*
+ *  Copy the valid part of a finished block into buffer
+ *
+ *  \param block: block to read
+ *  \param buffer: destination, at least 'transfer_size' bytes
+ *  \param actual: (optional) number of bytes read, or the number of bytes
+ *    in the block when it does not fit
+ *
+ *  \retval  0: all fine
+ *          -1: the block holds more than 'transfer_size' bytes, it was not
+ *              read
+*/
+int DMA::read_block(uint32_t block, uint8_t *buffer, uint32_t *actual){
+  uint32_t size = this->block_size[block];
+  uint32_t count = 0;
+  if (this->REG_COUNT != REG_UNINITIALIZED){
+    count = this->get_transfer_count();
+    if (count < size){
+      size = count;
+    }
+  }
+  if (size > this->transfer_size){
+    //Requested with a larger size by an earlier read, don't drop the rest
+    if (actual != NULL){
+      *actual = size;
+    }
+    return -1;
+  }
+  if (size > 0){
+    this->nysa->read_memory(this->BASE[block], buffer, size);
+  }
+  this->count_transfer(size);
+  if (actual != NULL){
+    *actual = size;
+  }
+  return 0;
+}
+
+/*
+ *  Register the core uses to report how many 32-bit words of the last block
+ *  it actually transfered (e.g. a packet that ended before the block did)
+ *
+ *  \param reg_count: address of the count register
+*/
+void DMA::set_count_register(uint32_t reg_count){
+  this->REG_COUNT = reg_count;
+}
+
+/*
+ *  Number of bytes the core reports for the last block, 'SIZE' if the core
+ *  does not have a count register
+*/
+uint32_t DMA::get_transfer_count(){
+  if (this->REG_COUNT == REG_UNINITIALIZED){
+    return this->SIZE;
+  }
+  return this->driver->read_register(this->REG_COUNT) * 4;
+}
+
+/*
+ *  Transfer Statistics
+ *    Every block that is uploaded (write) or read back (read and capture)
+ *    is counted. A block is 'overlapped' when it was handed to the core
+ *    while the other block was still in flight, with both blocks kept busy
+ *    this approaches the number of blocks and the core never waits on the
+ *    host
+*/
+
+void DMA::count_handoff(uint32_t block){
+  if (this->transfer_handoffs == 0){
+    gettimeofday(&this->transfer_start, NULL);
+  }
+  this->transfer_handoffs++;
+  if (this->block_state[block ^ 1] == BLOCK_BUSY){
+    this->transfer_overlapped++;
+  }
+}
+
+void DMA::count_transfer(uint32_t size){
+  this->transfer_blocks++;
+  this->transfer_bytes += size;
+}
+
+void DMA::reset_transfer_stats(){
+  this->transfer_handoffs   = 0;
+  this->transfer_overlapped = 0;
+  this->transfer_blocks     = 0;
+  this->transfer_bytes      = 0;
+  this->status_reads        = 0;
+  this->status_reads_avoided = 0;
+  gettimeofday(&this->transfer_start, NULL);
+}
+
+uint32_t DMA::get_transfer_blocks(){
+  return this->transfer_blocks;
+}
+
+uint64_t DMA::get_transfer_bytes(){
+  return this->transfer_bytes;
+}
+
+uint32_t DMA::get_overlapped_blocks(){
+  return this->transfer_overlapped;
+}
+
+/*
+ *  Bytes per second since the first block was handed to the core
+*/
+double DMA::get_transfer_throughput(){
+  struct timeval now;
+  double seconds;
+  gettimeofday(&now, NULL);
+  seconds = (now.tv_sec - this->transfer_start.tv_sec) +
+            ((now.tv_usec - this->transfer_start.tv_usec) / 1000000.0);
+  if (seconds <= 0){
+    return 0;
+  }
+  return this->transfer_bytes / seconds;
+}
+
+/*
+ *  DMA Ring
+ *
+ *  \param memory: slot_size * slot_count bytes owned by the application
+ *  \param slot_size: size of a slot, must be the DMA 'SIZE'
+ *  \param slot_count: number of slots
+*/
+DMARing::DMARing(uint8_t *memory, uint32_t slot_size, uint32_t slot_count){
+  this->memory      = memory;
+  this->slot_size   = slot_size;
+  this->slot_count  = slot_count;
+  this->head        = 0;
+  this->tail        = 0;
+}
+DMARing::~DMARing(){
+}
+
+uint32_t DMARing::get_slot_size(){
+  return this->slot_size;
+}
+uint32_t DMARing::get_slot_count(){
+  return this->slot_count;
+}
+
+/*
+ *  Number of filled slots waiting for the consumer
+*/
+uint32_t DMARing::count(){
+  return this->head.load(std::memory_order_acquire) - this->tail.load(std::memory_order_acquire);
+}
+
+/*
+ *  Next slot to fill, NULL when the ring is full
+*/
+uint8_t * DMARing::write_slot(){
+  uint32_t head = this->head.load(std::memory_order_relaxed);
+  if ((head - this->tail.load(std::memory_order_acquire)) >= this->slot_count){
+    return NULL;
+  }
+  return &this->memory[(head % this->slot_count) * this->slot_size];
+}
+void DMARing::commit_write(){
+  this->head.store(this->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+/*
+ *  Oldest filled slot, NULL when the ring is empty
+*/
+uint8_t * DMARing::read_slot(){
+  uint32_t tail = this->tail.load(std::memory_order_relaxed);
+  if (this->head.load(std::memory_order_acquire) == tail){
+    return NULL;
+  }
+  return &this->memory[(tail % this->slot_count) * this->slot_size];
+}
+void DMARing::commit_read(){
+  this->tail.store(this->tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+/*
+ *  Streaming Capture
+ *    A thread keeps both blocks of a read DMA armed. When a block is full
+ *    it is read into the next free slot of the ring and armed again right
+ *    away, the core fills the other block in the mean time so nothing is
+ *    lost as long as a block can be read faster than it is filled
+ *
+ *    Overrun: the ring was full (or a file could not be started), the
+ *      block was read and thrown away
+ *    Underrun: both blocks were found full (or idle), the core had
+ *      nowhere to put data and samples were lost. Interrupts that may
+ *      stand for both blocks are settled with a status read so a full
+ *      block is never taken for a busy one
+*/
+
+void * DMA::capture_thread_func(void *arg){
+  ((DMA *) arg)->run_capture();
+  return NULL;
+}
+
+void DMA::arm_block(uint32_t block){
+  this->count_handoff(block);
+  this->request_block(block);
+  this->mark_busy(block);
+}
+
+void DMA::run_capture(){
+  uint32_t next = 0;
+  uint32_t block = 0;
+  uint8_t * slot;
+
+  this->transfer_size = this->SIZE;
+  this->inflight_count = 0;
+  try {
+    this->arm_block(0);
+    this->arm_block(1);
+    while (this->capture_running){
+      if ((this->block_state[0] != BLOCK_FULL) && (this->block_state[1] != BLOCK_FULL)){
+        if (this->inflight_count == 0){
+          this->sync_status();
+          if ((this->block_state[0] == BLOCK_EMPTY) && (this->block_state[1] == BLOCK_EMPTY)){
+            //Nothing armed, the core dropped data
+            this->capture_underruns++;
+            this->arm_block(next);
+            this->arm_block(next ^ 1);
+            continue;
+          }
+          if ((this->block_state[0] == BLOCK_FULL) || (this->block_state[1] == BLOCK_FULL)){
+            continue;
+          }
+        }
+        else if (this->shadow_status){
+          this->status_reads_avoided++;
+        }
+        this->wait_block();
+        continue;
+      }
+      if ((this->block_state[0] == BLOCK_FULL) && (this->block_state[1] == BLOCK_FULL)){
+        //The core filled both blocks before one was read, it stalled
+        this->capture_underruns++;
+      }
+      //Blocks fill in order, when only the other one is full follow it
+      block = (this->block_state[next] == BLOCK_FULL) ? next : (next ^ 1);
+      if (this->capture_file != NULL){
+        slot = this->capture_file->get_slot();
+      }
+      else {
+        slot = this->capture_ring->write_slot();
+      }
+      if (slot == NULL){
+        this->capture_overruns++;
+        slot = this->capture_scratch;
+      }
+      this->nysa->read_memory(this->BASE[block], slot, this->SIZE);
+      this->arm_block(block);
+      next = block ^ 1;
+      if (slot == this->capture_scratch){
+        continue;
+      }
+      if (this->capture_file != NULL){
+        //The other block is filling while the file catches up
+        if (this->capture_file->commit() < 0){
+          this->capture_error = -1;
+          this->capture_running = false;
+          break;
+        }
+      }
+      else {
+        this->capture_ring->commit_write();
+      }
+      this->capture_blocks++;
+      this->capture_bytes += this->SIZE;
+      this->count_transfer(this->SIZE);
+    }
+  }
+  catch (int error){
+    this->capture_error = error;
+    this->capture_running = false;
+  }
+}
+
+/*
+ *  Start streaming into 'ring'
+ *
+ *  \param ring: ring with slots of 'SIZE' bytes, the caller drains it
+ *
+ *  \retval  0: all fine
+ *          -1: not set up for reading, already capturing or the slot size
+ *              does not match
+ *          -2: failed to start the thread
+*/
+int DMA::start_capture(DMARing *ring){
+  if (this->writing || this->capture_running || (ring == NULL) ||
+      (ring->get_slot_size() != this->SIZE) || (ring->get_slot_count() == 0)){
+    return -1;
+  }
+  this->capture_ring      = ring;
+  this->capture_file      = NULL;
+  return this->begin_capture();
+}
+
+/*
+ *  Start streaming into files on disk
+ *
+ *  \param sink: file sink, it is opened for blocks of 'SIZE' bytes here and
+ *    closed by 'stop_capture'
+ *
+ *  \retval  0: all fine
+ *          -1: not set up for reading or already capturing
+ *          -2: failed to start the thread
+ *          -3: failed to open the first file
+*/
+int DMA::start_capture(DMAFileSink *sink){
+  if (this->writing || this->capture_running || (sink == NULL)){
+    return -1;
+  }
+  if (sink->open(this->SIZE) < 0){
+    return -3;
+  }
+  this->capture_ring      = NULL;
+  this->capture_file      = sink;
+  return this->begin_capture();
+}
+
+int DMA::begin_capture(){
+  this->capture_scratch   = this->nysa->alloc_buffer(this->SIZE);
+  this->capture_blocks    = 0;
+  this->capture_bytes     = 0;
+  this->capture_overruns  = 0;
+  this->capture_underruns = 0;
+  this->capture_error     = 0;
+  gettimeofday(&this->capture_start, NULL);
+  this->capture_running   = true;
+  if (pthread_create(&this->capture_thread, NULL, DMA::capture_thread_func, this) != 0){
+    this->capture_running = false;
+    this->nysa->free_buffer(this->capture_scratch);
+    this->capture_scratch = NULL;
+    if (this->capture_file != NULL){
+      this->capture_file->close();
+      this->capture_file = NULL;
+    }
+    return -2;
+  }
+  return 0;
+}
+
+void DMA::stop_capture(){
+  if (this->capture_scratch == NULL){
+    return;
+  }
+  this->capture_running = false;
+  pthread_join(this->capture_thread, NULL);
+  this->nysa->free_buffer(this->capture_scratch);
+  this->capture_scratch = NULL;
+  if (this->capture_file != NULL){
+    this->capture_file->close();
+    this->capture_file = NULL;
+  }
+  //The blocks are in an unknown state, 'read' starts by checking
+  this->read_state = ST_UNKNOWN;
+}
+
+bool DMA::is_capturing(){
+  return this->capture_running.load();
+}
+
+uint32_t DMA::get_capture_blocks(){
+  return this->capture_blocks.load();
+}
+
+uint64_t DMA::get_capture_bytes(){
+  return this->capture_bytes.load();
+}
+
+uint32_t DMA::get_capture_overruns(){
+  return this->capture_overruns.load();
+}
+
+uint32_t DMA::get_capture_underruns(){
+  return this->capture_underruns.load();
+}
+
+/*
+ *  Bytes per second delivered to the ring since the capture started
+*/
+double DMA::get_capture_throughput(){
+  struct timeval now;
+  double seconds;
+  gettimeofday(&now, NULL);
+  seconds = (now.tv_sec - this->capture_start.tv_sec) +
+            ((now.tv_usec - this->capture_start.tv_usec) / 1000000.0);
+  if (seconds <= 0){
+    return 0;
+  }
+  return this->capture_bytes.load() / seconds;
+}
+
+/*
+ *  Error that stopped the capture thread, 0 if none
+*/
+int DMA::get_capture_error(){
+  return this->capture_error.load();
+}
@@ -27,13 +27,18 @@ enum STATUS_REG {
 };
 
 DMA_DEMO_READER::DMA_DEMO_READER(Nysa *nysa, uint32_t dev_addr, bool debug) : Driver(nysa, debug){
+  uint32_t mem_base0 = DMA_BASE0;
+  uint32_t mem_base1 = DMA_BASE1;
   this->debug = debug;
   this->set_device_id(DMA_DEMO_READER_DEVICE_ID);
   this->set_device_sub_id(DMA_DEMO_READER_DEVICE_SUB_ID);
   this->find_device();
   this->dma = new DMA(nysa, this, dev_addr, debug);
-  this->dma->setup_read ( DMA_BASE0,
-                          DMA_BASE1,
+  //The fixed addresses are only used (and reserved) when the image has no
+  //memory to spare
+  this->alloc_dma_blocks(this->dma, DMA_SIZE, &mem_base0, &mem_base1);
+  this->dma->setup_read ( mem_base0,
+                          mem_base1,
                           DMA_SIZE,
                           REG_STATUS,
                           REG_MEM_0_BASE,
@@ -83,5 +88,25 @@ void DMA_DEMO_READER::dma_read(uint8_t *buffer){
   //printf ("%s(): Finished Reading\n", __func__);
 
 }
+//Request only 'size' bytes, 'actual' is how much was read (-4: the next
+//block was requested larger than 'size', 'actual' is its size)
+int DMA_DEMO_READER::dma_read(uint8_t *buffer, uint32_t size, uint32_t *actual){
+  return this->dma->read(buffer, size, actual);
+}
 
-
+/*
+ * Stream blocks into 'ring' from a background thread, the counters are
+ * available through get_dma()
+ */
+int DMA_DEMO_READER::start_capture(DMARing *ring){
+  return this->dma->start_capture(ring);
+}
+int DMA_DEMO_READER::start_capture(DMAFileSink *sink){
+  return this->dma->start_capture(sink);
+}
+void DMA_DEMO_READER::stop_capture(){
+  this->dma->stop_capture();
+}
+DMA * DMA_DEMO_READER::get_dma(){
+  return this->dma;
+}
@@ -29,13 +29,18 @@ enum STATUS_REG {
 };
 
 DMA_DEMO_WRITER::DMA_DEMO_WRITER(Nysa *nysa, uint32_t dev_addr, bool debug) : Driver(nysa, debug){
+  uint32_t mem_base0 = DMA_BASE0;
+  uint32_t mem_base1 = DMA_BASE1;
   this->debug = debug;
   this->set_device_id(DMA_DEMO_WRITER_DEVICE_ID);
   this->set_device_sub_id(DMA_DEMO_WRITER_DEVICE_SUB_ID);
   this->find_device();
   this->dma = new DMA(nysa, this, dev_addr, debug);
-  this->dma->setup_write( DMA_BASE0,
-                          DMA_BASE1,
+  //The fixed addresses are only used (and reserved) when the image has no
+  //memory to spare
+  this->alloc_dma_blocks(this->dma, DMA_SIZE, &mem_base0, &mem_base1);
+  this->dma->setup_write( mem_base0,
+                          mem_base1,
                           DMA_SIZE,
                           REG_STATUS,
                           REG_MEM_0_BASE,
@@ -49,6 +54,7 @@ DMA_DEMO_WRITER::DMA_DEMO_WRITER(Nysa *nysa, uint32_t dev_addr, bool debug) : Dr
                               STATUS_1_FINISHED,
                               STATUS_0_EMPTY,
                               STATUS_1_EMPTY);
+  this->dma->set_count_register(REG_WRITTEN_SIZE);
 }
 DMA_DEMO_WRITER::~DMA_DEMO_WRITER(){
   delete(this->dma);
@@ -100,4 +106,8 @@ void DMA_DEMO_WRITER::dma_write(uint8_t *buffer){
   this->dma->write(buffer);
   printf ("%s(): Finished Writing\n", __func__);
 }
+//Only send 'size' bytes of the block, returns what 'DMA::write' returns
+int DMA_DEMO_WRITER::dma_write(uint8_t *buffer, uint32_t size){
+  return this->dma->write(buffer, size);
+}
 
@@ -0,0 +1,175 @@
+#include "driver.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define FILE_SINK_ALIGNMENT 4096
+
+DMAFileSink::DMAFileSink(const char *path_format, uint64_t file_size, FILE_SINK_MODE mode){
+  this->path_format     = path_format;
+  this->file_size       = file_size;
+  this->mode            = mode;
+  this->block_size      = 0;
+  this->blocks_per_file = 0;
+  this->fd              = -1;
+  this->map             = NULL;
+  this->buffer          = NULL;
+  this->block_index     = 0;
+  this->file_index      = 0;
+  this->bytes_written   = 0;
+}
+DMAFileSink::~DMAFileSink(){
+  this->close();
+}
+
+/*
+ *  Start the next file, it is sized for a whole number of blocks up front
+ *  so the capture never waits on the file system to grow it
+ *
+ *  \retval  0: all fine
+ *          -1: failed to create, size or map the file
+*/
+int DMAFileSink::open_file(){
+  char path[1024];
+  int flags = O_RDWR | O_CREAT | O_TRUNC;
+  uint64_t length = (uint64_t) this->blocks_per_file * this->block_size;
+
+  snprintf(path, sizeof(path), this->path_format.c_str(), this->file_index);
+  if (this->mode == FILE_SINK_DIRECT){
+    flags |= O_DIRECT;
+  }
+  this->fd = ::open(path, flags, 0644);
+  if (this->fd < 0){
+    return -1;
+  }
+  if (posix_fallocate(this->fd, 0, length) != 0){
+    //Not every file system can preallocate, fall back to a sparse file
+    if (ftruncate(this->fd, length) != 0){
+      this->close_file();
+      return -1;
+    }
+  }
+  if (this->mode == FILE_SINK_MMAP){
+    this->map = (uint8_t *) mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+    if (this->map == MAP_FAILED){
+      this->map = NULL;
+      this->close_file();
+      return -1;
+    }
+    madvise(this->map, length, MADV_SEQUENTIAL);
+  }
+  this->block_index = 0;
+  this->file_index++;
+  return 0;
+}
+
+/*
+ *  Finish the current file, a file that was not filled is cut down to the
+ *  blocks that were written
+*/
+void DMAFileSink::close_file(){
+  uint64_t length = (uint64_t) this->block_index * this->block_size;
+  if (this->map != NULL){
+    munmap(this->map, (uint64_t) this->blocks_per_file * this->block_size);
+    this->map = NULL;
+  }
+  if (this->fd >= 0){
+    if (ftruncate(this->fd, length) != 0){
+      //The data is there, the tail of the file is just not trimmed
+    }
+    ::close(this->fd);
+    this->fd = -1;
+  }
+}
+
+/*
+ *  Get ready to take blocks of 'block_size' bytes
+ *
+ *  \retval  0: all fine
+ *          -1: bad block size (O_DIRECT needs page multiples) or the first
+ *              file could not be created
+*/
+int DMAFileSink::open(uint32_t block_size){
+  this->close();
+  if ((block_size == 0) ||
+      ((this->mode == FILE_SINK_DIRECT) && ((block_size % FILE_SINK_ALIGNMENT) != 0))){
+    return -1;
+  }
+  this->block_size      = block_size;
+  this->blocks_per_file = this->file_size / block_size;
+  if (this->blocks_per_file == 0){
+    this->blocks_per_file = 1;
+  }
+  this->file_index      = 0;
+  this->bytes_written   = 0;
+  if (this->mode == FILE_SINK_DIRECT){
+    if (posix_memalign((void **) &this->buffer, FILE_SINK_ALIGNMENT, block_size) != 0){
+      this->buffer = NULL;
+      return -1;
+    }
+  }
+  if (this->open_file() < 0){
+    this->close();
+    return -1;
+  }
+  return 0;
+}
+
+void DMAFileSink::close(){
+  this->close_file();
+  if (this->buffer != NULL){
+    free(this->buffer);
+    this->buffer = NULL;
+  }
+}
+
+/*
+ *  Memory the next block should be read into, NULL when there is no file
+ *  to put it in
+*/
+uint8_t * DMAFileSink::get_slot(){
+  if (this->fd < 0){
+    //A new file could not be started, try again for this block
+    if (this->open_file() < 0){
+      return NULL;
+    }
+  }
+  if (this->mode == FILE_SINK_MMAP){
+    return &this->map[(uint64_t) this->block_index * this->block_size];
+  }
+  return this->buffer;
+}
+
+/*
+ *  The block returned by 'get_slot' is filled in, move on to the next one
+ *
+ *  \retval  0: all fine
+ *          -1: failed to write the block
+*/
+int DMAFileSink::commit(){
+  off_t offset = (off_t) this->block_index * this->block_size;
+  if (this->mode == FILE_SINK_DIRECT){
+    if (pwrite(this->fd, this->buffer, this->block_size, offset) != (ssize_t) this->block_size){
+      return -1;
+    }
+  }
+  this->block_index++;
+  this->bytes_written += this->block_size;
+  if (this->block_index >= this->blocks_per_file){
+    this->close_file();
+  }
+  return 0;
+}
+
+/*
+ *  Number of files that were started
+*/
+uint32_t DMAFileSink::get_file_count(){
+  return this->file_index;
+}
+
+uint64_t DMAFileSink::get_bytes_written(){
+  return this->bytes_written;
+}
@@ -1,11 +1,13 @@
 #include "driver.hpp"
 #include <stdio.h>
 #include <string.h>
+#include <map>
 
 /*
  * Help users Identify return values
  */
 enum MESSAGE {
+  DMA_MEMORY_IN_USE       = -5,
   DEVICE_ID_NOT_SET       = -4,
   FAILED_TO_READ_DRT      = -3,
   NYSA_NOT_FOUND          = -2,
@@ -28,6 +30,7 @@ struct _message_struct_t {
 typedef struct _message_struct_t message_struct_t;
 static message_struct_t driver_messages[] = {
 
+  {DMA_MEMORY_IN_USE      , "DMA memory is in use by another device"             },
   {DEVICE_ID_NOT_SET      , "Device ID is not set"                               },
   {FAILED_TO_READ_DRT     , "Failed to read DRT"                                 },
   {NYSA_NOT_FOUND         , "Nysa Not Found"                                     },
@@ -109,6 +112,31 @@ void Driver::set_device_sub_id(uint16_t sub_id){
   this->sub_id = sub_id;
 }
 
+/*
+ *  Get the DMA blocks from the memory allocator, when the image has no
+ *  memory to spare the fixed blocks in 'mem_base0/1' are reserved instead
+ *  so the allocator never hands them to another driver
+ *
+ *  \param dma: DMA of the driver
+ *  \param size: size of a block in bytes
+ *  \param mem_base0: fixed address of block 0, set to the allocated one
+ *  \param mem_base1: fixed address of block 1, set to the allocated one
+ *
+ *  Throws DMA_MEMORY_IN_USE if the fixed blocks overlap memory that is
+ *  allocated or reserved
+*/
+void Driver::alloc_dma_blocks(DMA *dma, uint32_t size, uint32_t *mem_base0, uint32_t *mem_base1){
+  if (dma->alloc_blocks(size, mem_base0, mem_base1) == 0){
+    return;
+  }
+  printf ("%s(): No free memory for the DMA blocks, using fixed blocks at 0x%08X and 0x%08X\n", __func__, *mem_base0, *mem_base1);
+  if (dma->reserve_blocks(size, *mem_base0, *mem_base1) < 0){
+    printf ("%s(): Fixed DMA blocks overlap memory that is in use\n", __func__);
+    this->error = DMA_MEMORY_IN_USE;
+    throw DMA_MEMORY_IN_USE;
+  }
+}
+
 /*
  * Initialize your device after finding it on the bus
  */
@@ -127,6 +155,15 @@ void Driver::write_periph_data(uint32_t addr, uint8_t *buffer, uint32_t size){
     throw DEVICE_ID_NOT_SET;
   }
   this->error = this->n->write_periph_data(this->dev_index, addr, buffer, size);
+  //Keep the shadows of the registers that were covered by the write
+  for (uint32_t i = 0; (i + 4) <= size; i += 4){
+    if (this->error != SUCCESS){
+      this->invalidate_shadow(addr + (i / 4));
+    }
+    else {
+      this->update_shadow(addr + (i / 4), buffer[i] << 24 | buffer[i + 1] << 16 | buffer[i + 2] << 8 | buffer[i + 3]);
+    }
+  }
   if (this->error != SUCCESS){
     throw this->error;
   }
@@ -153,24 +190,19 @@ void Driver::write_register(uint32_t reg_addr, uint32_t data){
   }
   this->error = this->n->write_register(this->dev_index, reg_addr, data);
   if (this->error != SUCCESS){
+    this->invalidate_shadow(reg_addr);
     throw this->error;
   }
+  this->update_shadow(reg_addr, data);
 
 }
 uint32_t Driver::read_register(uint32_t reg_addr){
-  uint32_t data;
+  shadow_register_t * shadow = this->get_shadow(reg_addr);
 //  printd("Entered\n");
-  if (this->dev_index == 0){
-    printd("dev index = 0\n");
-    this->error = DEVICE_ID_NOT_SET;
-    throw DEVICE_ID_NOT_SET;
+  if ((shadow != NULL) && shadow->valid){
+    return shadow->value;
   }
-  this->error = this->n->read_register(this->dev_index, reg_addr, &data);
-  if (this->error != SUCCESS){
-    throw this->error;
-  }
-
-  return data;
+  return this->refresh_register(reg_addr);
 }
 
 void Driver::set_register_bit(uint32_t reg_addr, uint8_t bit){
@@ -182,6 +214,11 @@ void Driver::set_register_bit(uint32_t reg_addr, uint8_t bit){
     throw DEVICE_ID_NOT_SET;
     return;
   }
+  if (this->get_shadow(reg_addr) != NULL){
+    //Only the host changes this register, skip reading it back
+    this->write_register(reg_addr, this->read_register(reg_addr) | (1 << bit));
+    return;
+  }
   this->error = this->n->set_register_bit(this->dev_index, reg_addr, bit);
 }
 void Driver::clear_register_bit(uint32_t reg_addr, uint8_t bit){
@@ -192,6 +229,10 @@ void Driver::clear_register_bit(uint32_t reg_addr, uint8_t bit){
     throw DEVICE_ID_NOT_SET;
     return;
   }
+  if (this->get_shadow(reg_addr) != NULL){
+    this->write_register(reg_addr, this->read_register(reg_addr) & (~(1 << bit)));
+    return;
+  }
   this->error = this->n->clear_register_bit(this->dev_index, reg_addr, bit);
   if (this->error != SUCCESS){
     throw this->error;
@@ -206,6 +247,9 @@ bool Driver::read_register_bit(uint32_t reg_addr, uint8_t bit){
     this->error = DEVICE_ID_NOT_SET;
     throw DEVICE_ID_NOT_SET;
   }
+  if (this->get_shadow(reg_addr) != NULL){
+    return ((this->read_register(reg_addr) & (1 << bit)) > 0);
+  }
 
   this->error = this->n->read_register_bit(this->dev_index, reg_addr, bit, &value);
   if (this->error != SUCCESS){
@@ -215,3 +259,272 @@ bool Driver::read_register_bit(uint32_t reg_addr, uint8_t bit){
   return value;
 }
 
+/*
+ * Register Cache
+ *
+ * Registers only the host changes (control, configuration) can be declared
+ * cacheable, reads of a cacheable register return the last value written
+ * or read and bit operations on it are a single write. Everything else
+ * (status, interrupts) is volatile and always goes to the device
+ */
+shadow_register_t * Driver::get_shadow(uint32_t reg_addr){
+  std::map<uint32_t, shadow_register_t>::iterator it = this->shadow.find(reg_addr);
+  if (it == this->shadow.end()){
+    return NULL;
+  }
+  return &it->second;
+}
+
+void Driver::update_shadow(uint32_t reg_addr, uint32_t value){
+  shadow_register_t * shadow = this->get_shadow(reg_addr);
+  if (shadow != NULL){
+    shadow->value = value;
+    shadow->valid = true;
+  }
+}
+
+void Driver::invalidate_shadow(uint32_t reg_addr){
+  shadow_register_t * shadow = this->get_shadow(reg_addr);
+  if (shadow != NULL){
+    shadow->valid = false;
+  }
+}
+
+void Driver::set_register_cacheable(uint32_t reg_addr, bool cacheable){
+  shadow_register_t shadow;
+  if (!cacheable){
+    this->shadow.erase(reg_addr);
+    return;
+  }
+  if (this->get_shadow(reg_addr) == NULL){
+    shadow.valid = false;
+    shadow.value = 0;
+    this->shadow[reg_addr] = shadow;
+  }
+}
+
+bool Driver::is_register_cacheable(uint32_t reg_addr){
+  return (this->get_shadow(reg_addr) != NULL);
+}
+
+/*
+ * Read a register from the device even when it is cached, the shadow is
+ * updated with the value
+ */
+uint32_t Driver::refresh_register(uint32_t reg_addr){
+  uint32_t data;
+  if (this->dev_index == 0){
+    printd("dev index = 0\n");
+    this->error = DEVICE_ID_NOT_SET;
+    throw DEVICE_ID_NOT_SET;
+  }
+  this->error = this->n->read_register(this->dev_index, reg_addr, &data);
+  if (this->error != SUCCESS){
+    throw this->error;
+  }
+  this->update_shadow(reg_addr, data);
+  return data;
+}
+
+void Driver::resync_registers(){
+  RegisterBatch batch(this);
+  std::vector<uint32_t> values(this->shadow.size());
+  std::map<uint32_t, shadow_register_t>::iterator it;
+  uint32_t i = 0;
+
+  this->invalidate_registers();
+  for (it = this->shadow.begin(); it != this->shadow.end(); it++){
+    batch.read_register(it->first, &values[i++]);
+  }
+  //Reads in the batch update the shadows
+  batch.commit();
+}
+
+void Driver::invalidate_registers(){
+  std::map<uint32_t, shadow_register_t>::iterator it;
+  for (it = this->shadow.begin(); it != this->shadow.end(); it++){
+    it->second.valid = false;
+  }
+}
+
+//Register Batch
+RegisterBatch::RegisterBatch(Driver *driver){
+  this->driver = driver;
+}
+RegisterBatch::~RegisterBatch(){
+}
+
+static uint32_t batch_buffer_to_register(uint8_t *buffer){
+  return (buffer[0] << 24 | buffer[1] << 16 | buffer[2] << 8 | buffer[3]);
+}
+
+static void batch_register_to_buffer(uint32_t data, uint8_t *buffer){
+  buffer[0] = ((data >> 24) & 0xFF);
+  buffer[1] = ((data >> 16) & 0xFF);
+  buffer[2] = ((data >> 8)  & 0xFF);
+  buffer[3] = ( data        & 0xFF);
+}
+
+void RegisterBatch::add(int type, uint32_t reg_addr, uint32_t data, uint8_t bit){
+  register_op_t op;
+  op.type       = type;
+  op.reg_addr   = reg_addr;
+  op.data       = data;
+  op.bit        = bit;
+  op.result     = NULL;
+  op.bit_result = NULL;
+  this->ops.push_back(op);
+}
+
+//Record Operations
+void RegisterBatch::write_register(uint32_t reg_addr, uint32_t data){
+  this->add(REG_OP_WRITE, reg_addr, data, 0);
+}
+void RegisterBatch::read_register(uint32_t reg_addr, uint32_t *data){
+  this->add(REG_OP_READ, reg_addr, 0, 0);
+  this->ops.back().result = data;
+}
+void RegisterBatch::set_register_bit(uint32_t reg_addr, uint8_t bit){
+  this->add(REG_OP_SET_BIT, reg_addr, 0, bit);
+}
+void RegisterBatch::clear_register_bit(uint32_t reg_addr, uint8_t bit){
+  this->add(REG_OP_CLEAR_BIT, reg_addr, 0, bit);
+}
+void RegisterBatch::read_register_bit(uint32_t reg_addr, uint8_t bit, bool *value){
+  this->add(REG_OP_READ_BIT, reg_addr, 0, bit);
+  this->ops.back().bit_result = value;
+}
+
+uint32_t RegisterBatch::size(){
+  return this->ops.size();
+}
+void RegisterBatch::clear(){
+  this->ops.clear();
+}
+
+/*
+ * Send the recorded operations in order
+ *  1. Read the registers the bit operations need (one burst)
+ *  2. Everything else, bit operations become plain writes of the value
+ *     the batch knows the register has (one burst)
+ *
+ *  retval: 0 on success, < 0 the first error from Nysa
+ */
+int RegisterBatch::run(){
+  std::vector<register_op_t> prefetch;
+  Nysa * n = this->driver->n;
+  uint32_t dev_index = this->driver->dev_index;
+  std::map<uint32_t, uint32_t> values;
+  int retval = 0;
+  int error = 0;
+  uint32_t i = 0;
+  uint8_t d[4];
+
+  //Pass 1: registers that bit operations modify before anything in the
+  //batch writes them
+  for (i = 0; i < this->ops.size(); i++){
+    if ((this->ops[i].type == REG_OP_WRITE) ||
+        (this->ops[i].type == REG_OP_SET_BIT) ||
+        (this->ops[i].type == REG_OP_CLEAR_BIT)){
+      if ((this->ops[i].type != REG_OP_WRITE) &&
+          (values.find(this->ops[i].reg_addr) == values.end())){
+        prefetch.push_back(this->ops[i]);
+      }
+      values[this->ops[i].reg_addr] = 0;
+    }
+  }
+  values.clear();
+  //Cached registers don't need to be read
+  for (i = prefetch.size(); i > 0; i--){
+    shadow_register_t * shadow = this->driver->get_shadow(prefetch[i - 1].reg_addr);
+    if ((shadow != NULL) && shadow->valid){
+      values[prefetch[i - 1].reg_addr] = shadow->value;
+      prefetch.erase(prefetch.begin() + (i - 1));
+    }
+  }
+  if (prefetch.size() > 0){
+    n->begin_pipeline();
+    for (i = 0; (i < prefetch.size()) && (error >= 0); i++){
+      error = n->queue_read_periph_data(dev_index, prefetch[i].reg_addr, &prefetch[i].buffer[0], 4);
+    }
+    retval = n->end_pipeline();
+    if (error < 0){
+      return error;
+    }
+    if (retval < 0){
+      return retval;
+    }
+    for (i = 0; i < prefetch.size(); i++){
+      values[prefetch[i].reg_addr] = batch_buffer_to_register(&prefetch[i].buffer[0]);
+      this->driver->update_shadow(prefetch[i].reg_addr, values[prefetch[i].reg_addr]);
+    }
+  }
+
+  //Pass 2: the batch itself
+  n->begin_pipeline();
+  for (i = 0; (i < this->ops.size()) && (error >= 0); i++){
+    register_op_t * op = &this->ops[i];
+    switch (op->type){
+      case (REG_OP_WRITE):
+        values[op->reg_addr] = op->data;
+        break;
+      case (REG_OP_SET_BIT):
+        values[op->reg_addr] |= 1 << op->bit;
+        break;
+      case (REG_OP_CLEAR_BIT):
+        values[op->reg_addr] &= (~(1 << op->bit));
+        break;
+      default:
+        //Read back after the flush
+        error = n->queue_read_periph_data(dev_index, op->reg_addr, &op->buffer[0], 4);
+        continue;
+    }
+    //Write data is copied when it is queued
+    batch_register_to_buffer(values[op->reg_addr], &d[0]);
+    error = n->write_periph_data(dev_index, op->reg_addr, &d[0], 4);
+  }
+  retval = n->end_pipeline();
+  if ((error < 0) || (retval < 0)){
+    //Nothing is known about what the batch wrote
+    for (i = 0; i < this->ops.size(); i++){
+      this->driver->invalidate_shadow(this->ops[i].reg_addr);
+    }
+    return (error < 0) ? error : retval;
+  }
+
+  for (i = 0; i < this->ops.size(); i++){
+    register_op_t * op = &this->ops[i];
+    if ((op->type == REG_OP_READ) || (op->type == REG_OP_READ_BIT)){
+      this->driver->update_shadow(op->reg_addr, batch_buffer_to_register(&op->buffer[0]));
+    }
+    else {
+      this->driver->update_shadow(op->reg_addr, values[op->reg_addr]);
+    }
+    if ((op->type == REG_OP_READ) && (op->result != NULL)){
+      *op->result = batch_buffer_to_register(&op->buffer[0]);
+    }
+    else if ((op->type == REG_OP_READ_BIT) && (op->bit_result != NULL)){
+      *op->bit_result = ((batch_buffer_to_register(&op->buffer[0]) & (1 << op->bit)) > 0);
+    }
+  }
+  return 0;
+}
+
+/*
+ * Send the recorded operations to the device, the batch is empty
+ * afterwards. Throws the Nysa error like the other register functions
+ */
+void RegisterBatch::commit(){
+  if (this->driver->dev_index == 0){
+    this->driver->error = DEVICE_ID_NOT_SET;
+    throw DEVICE_ID_NOT_SET;
+  }
+  if (this->ops.size() == 0){
+    return;
+  }
+  this->driver->error = this->run();
+  this->ops.clear();
+  if (this->driver->error < 0){
+    throw this->driver->error;
+  }
+}
@@ -15,6 +15,12 @@ GPIO::GPIO(Nysa *nysa, uint32_t dev_addr, bool debug) : Driver(nysa, debug){
   this->set_device_id(GPIO_DEVICE_ID);
   this->set_device_sub_id(GPIO_DEVICE_SUB_ID);
   this->find_device();
+  //Only the host writes these, the port is read back from the device
+  //whenever the pins are read
+  this->set_register_cacheable(GPIO_PORT);
+  this->set_register_cacheable(GPIO_OUTPUT_ENABLE);
+  this->set_register_cacheable(INTERRUPTS_ENABLE);
+  this->set_register_cacheable(INTERRUPTS_EDGE);
 }
 
 GPIO::~GPIO(){
@@ -31,16 +37,12 @@ void GPIO::pinMode(uint32_t pin, uint32_t direction){
 }
 void GPIO::digitalWrite(uint32_t bit, uint32_t value){
 
-  uint32_t gpios;
-  gpios = this->get_gpios();
   if (value > 0){
     this->set_register_bit(GPIO_PORT, bit);
   }
   else {
     this->clear_register_bit(GPIO_PORT, bit);
-    gpios &= (~(1 << bit));
   }
-  this->set_gpios(gpios);
 }
 bool GPIO::digitalRead(uint32_t bit){
   uint32_t gpios;
@@ -66,7 +68,8 @@ void GPIO::set_gpios(uint32_t gpios){
 }
 uint32_t GPIO::get_gpios(){
 
-  return this->read_register(GPIO_PORT);
+  //Inputs change on their own
+  return this->refresh_register(GPIO_PORT);
 }
 
 //Setting bits to inputs or outputs
@@ -105,16 +108,10 @@ uint32_t GPIO::get_interrupts_enable(){
   return this->read_register(INTERRUPTS_ENABLE);
 }
 void GPIO::set_interrupts_enable_bit(uint32_t bit){
-  uint32_t enable;
-  enable = this->get_interrupts_enable();
-  enable |= (1 << bit);
-  this->set_interrupts_enable(enable);
+  this->set_register_bit(INTERRUPTS_ENABLE, bit);
 }
 void GPIO::clear_interrupts_enable_bit(uint32_t bit){
-  uint32_t enable;
-  enable = this->get_interrupts_enable();
-  enable &= (~(1 << bit));
-  this->set_interrupts_enable(enable);
+  this->clear_register_bit(INTERRUPTS_ENABLE, bit);
 }
 bool GPIO::get_interrupts_enable_bit(uint32_t bit){
   uint32_t enable;
@@ -132,16 +129,10 @@ uint32_t GPIO::get_interrupts_edge_mask(){
   return this->read_register(INTERRUPTS_EDGE);
 }
 void GPIO::set_interrupts_edge_mask_bit(uint32_t bit){
-  uint32_t edge;
-  edge = this->get_interrupts_edge_mask();
-  edge |= (1 << bit);
-  this->set_interrupts_edge_mask(edge);
+  this->set_register_bit(INTERRUPTS_EDGE, bit);
 }
 void GPIO::clear_interrupts_edge_mask_bit(uint32_t bit){
-  uint32_t edge;
-  edge = this->get_interrupts_edge_mask();
-  edge &= (~(1 << bit));
-  this->set_interrupts_edge_mask(edge);
+  this->clear_register_bit(INTERRUPTS_EDGE, bit);
 }
 bool GPIO::get_interrupts_edge_mask_bit(uint32_t bit){
   uint32_t edge;
@@ -40,14 +40,23 @@ enum STATUS_REG {
 };
 
 NH_LCD_480_272::NH_LCD_480_272(Nysa *nysa, uint32_t dev_addr, bool debug) : Driver(nysa, debug){
+  uint32_t mem_base0 = DMA_BASE0;
+  uint32_t mem_base1 = DMA_BASE1;
   this->set_device_id(LCD_DEVICE_ID);
   this->find_device();
   this->set_device_sub_id(NH_LCD_480_272_DEVICE_SUB_ID);
   this->debug = debug;
+  //Only the host writes the control register (the command strobes clear
+  //themselves and are never kept in the shadow)
+  this->set_register_cacheable(REG_CONTROL);
+  this->dma                   = new DMA(nysa, this, dev_addr, debug);
+  //The fixed addresses are only used (and reserved) when the image has no
+  //memory to spare
+  this->alloc_dma_blocks(this->dma, DMA_SIZE, &mem_base0, &mem_base1);
   if (this->debug){
     printf ("Setting up DMA Write\n");
-    printf ("\tDMA Base 0:      0x%08X\n", DMA_BASE0);
-    printf ("\tDMA Base 1:      0x%08X\n", DMA_BASE1);
+    printf ("\tDMA Base 0:      0x%08X\n", mem_base0);
+    printf ("\tDMA Base 1:      0x%08X\n", mem_base1);
     printf ("\tDMA Size:        0x%08X\n", DMA_SIZE);
     printf ("\tDMA Size:        %d\n", DMA_SIZE);
     printf ("\tReg Status:      0x%08X\n", REG_STATUS);
@@ -59,9 +68,8 @@ NH_LCD_480_272::NH_LCD_480_272(Nysa *nysa, uint32_t dev_addr, bool debug) : Driv
     printf ("\tStrategy:        %d\n", CADENCE);
   }
 
-  this->dma                   = new DMA(nysa, this, dev_addr, debug);
-  this->dma->setup_write(     DMA_BASE0,
-                              DMA_BASE1,
+  this->dma->setup_write(     mem_base0,
+                              mem_base1,
                               DMA_SIZE,
                               REG_STATUS,
                               REG_MEM_0_BASE,
@@ -86,50 +94,33 @@ NH_LCD_480_272::~NH_LCD_480_272(){
   delete(this->dma);
 }
 
-void NH_LCD_480_272::setup(){
+/*
+ * Bring up the panel
+ *
+ * warm_start: (Default false) when is_configured() finds the controller
+ *  still holds the configuration below (the display service restarted but
+ *  the panel kept power) the controller is not reset, only the column and
+ *  page window (the controller can't report them) are sent again and the
+ *  core is enabled
+ */
+void NH_LCD_480_272::setup(bool warm_start){
   uint8_t buffer[256];
-  uint8_t lcd_width_hb = (((NH_LCD_480_272_WIDTH - 1) >> 8) & 0xFF);
-  uint8_t lcd_width_lb = ( (NH_LCD_480_272_WIDTH - 1)       & 0xFF);
-
-  uint8_t lcd_height_hb = (((NH_LCD_480_272_HEIGHT - 1) >> 8) & 0xFF);
-  uint8_t lcd_height_lb = ((NH_LCD_480_272_HEIGHT - 1) & 0xFF);
-
-  //Horizontal
-  uint8_t hsync_hb = (((HSYNC_TOTAL) >> 8) & 0xFF);
-  uint8_t hsync_lb = ((HSYNC_TOTAL) & 0xFF);
-
-  uint8_t hblank_hb = (((HBLANK) >> 8) & 0xFF);
-  uint8_t hblank_lb = ((HBLANK) & 0xFF);
-
-  uint8_t hsync_pulse_start_hb = (((HSYNC_PULSE_START) >> 8) & 0xFF);
-  uint8_t hsync_pulse_start_lb = ((HSYNC_PULSE_START) & 0xFF);
-
-  //Vertical
-  uint8_t vsync_hb = (((VSYNC_TOTAL) >> 8) & 0xFF);
-  uint8_t vsync_lb = ((VSYNC_TOTAL) & 0xFF);
-
-  uint8_t vblank_hb = (((VBLANK) >> 8) & 0xFF);
-  uint8_t vblank_lb = ((VBLANK) & 0xFF);
-
-  uint8_t vsync_pulse_start_hb = (((VSYNC_PULSE_START) >> 8) & 0xFF);
-  uint8_t vsync_pulse_start_lb = ((VSYNC_PULSE_START) & 0xFF);
-
-  uint8_t column_start_hb = (((COLUMN_START) >> 8) & 0xFF);
-  uint8_t column_start_lb = ((COLUMN_START) & 0xFF);
-
-  uint8_t column_end_hb = (((COLUMN_END - 1) >> 8) & 0xFF);
-  uint8_t column_end_lb = ((COLUMN_END - 1) & 0xFF);
-
-  uint8_t page_start_hb = (((PAGE_START) >> 8) & 0xFF);
-  uint8_t page_start_lb = ((PAGE_START) & 0xFF);
-
-  uint8_t page_end_hb = (((PAGE_END - 1) >> 8) & 0xFF);
-  uint8_t page_end_lb = ((PAGE_END - 1) & 0xFF);
+  RegisterBatch batch(this);
 
   //Reset the LCD
   this->enable_chip_select(true); printd("Enable Chip Select\n");
   this->start();                  printd("Enable the interrupts and core\n");
   this->enable_backlight(true);   printd("Enable Backlight\n");
+  if (warm_start && this->is_configured()){
+    printd("Panel is already configured\n");
+    this->column_window_params(buffer);
+    this->queue_lcd_command(&batch, MEM_ADR_SET_COLUMN_ADR, 4, buffer);
+    this->page_window_params(buffer);
+    this->queue_lcd_command(&batch, MEM_ADR_SET_PAGE_ADR, 4, buffer);
+    batch.commit();
+    this->enable_tearing(true);
+    return;
+  }
   this->override_write_enable(true);  printd("Assert Write enable\n");
   this->reset();                  printd("Reset the LCD Core\n");
   this->override_write_enable(false);  printd("Deassert Write Enable\n");
@@ -141,18 +132,22 @@ void NH_LCD_480_272::setup(){
     print_debug("MEM_ADR_PWR_MODE", false, &pwr_mode, 1);
   }
   */
-  //Soft Reset the MCU
+  //Soft Reset the MCU, it ignores commands for 5mS after a reset
   this->write_lcd_command(MEM_ADR_RESET); printd("Reset LCD Core\n");
   print_debug("MEM_ADR_RESET", true, NULL, 0);
-  usleep(500000);                           printd("Sleep for 500mS\n");
+  usleep(SOFT_RESET_TIME);                  printd("Wait for the reset\n");
   this->write_lcd_command(MEM_ADR_RESET);
   print_debug("MEM_ADR_RESET", true, NULL, 0); printd("Reset LCD Core\n");
-  usleep(200000);                           printd("Sleep for 200mS\n");
+  usleep(SOFT_RESET_TIME);                  printd("Wait for the reset\n");
   //Start the PLL
   buffer[0] = 0x01;
   this->write_lcd_command(MEM_ADR_SET_PLL, 1, buffer);  printd("Start the PLL\n");
   print_debug("MEM_ADR_SET_PLL", true, buffer, 1);
-  usleep(100000);                           printd("Sleep for 100mS\n");
+  if (!this->poll_lcd_command(MEM_ADR_GET_PLL_STATUS, PLL_STATUS_LOCKED, PLL_STATUS_LOCKED, PLL_LOCK_TIMEOUT)){
+    if (this->debug){
+      printf ("%s(): PLL did not report a lock, using it anyway\n", __func__);
+    }
+  }
   //Lock the PLL
   buffer[0] = 0x03;
   this->write_lcd_command(MEM_ADR_SET_PLL, 1, buffer);  printd("Lock the PLL\n");
@@ -165,15 +160,10 @@ void NH_LCD_480_272::setup(){
   }
   */
 
+  //Configure the panel, everything from here on goes out in one burst
   //Setup the LCD
-  buffer[0] = 0x00;         //Set TFT Mode: 0x0C ??
-  buffer[1] = 0x00;         //Set TFT Mode & Hsync + Vsync + DEN Mode
-  buffer[2] = lcd_width_hb; //Set Horizontal Size High Byte
-  buffer[3] = lcd_width_lb; //Set Horizontal Size Low Byte
-  buffer[4] = lcd_height_hb;//Set Vertical Size High Byte
-  buffer[5] = lcd_height_lb;//Set Vertical Size Low Byte
-  buffer[6] = 0x00;         //Set even/odd line RGB sequency = RGB
-  this->write_lcd_command(MEM_ADR_SET_LCD_MODE, 7, buffer); printd("Setup the LCD Mode\n");
+  this->lcd_mode_params(buffer);
+  this->queue_lcd_command(&batch, MEM_ADR_SET_LCD_MODE, 7, buffer); printd("Setup the LCD Mode\n");
   print_debug("MEM_ADR_SET_LCD_MODE", true, buffer, 7);
 
   /*
@@ -184,77 +174,57 @@ void NH_LCD_480_272::setup(){
   */
 
   //Set Pixel data I/F format = 8 bit
-  buffer[0] = 0x00;
-  this->write_lcd_command(MEM_ADR_SET_PIX_DAT_INT, 1, buffer); printd("Set the pixel buffer : 8bits\n");
+  buffer[0] = PIXEL_DATA_INTERFACE;
+  this->queue_lcd_command(&batch, MEM_ADR_SET_PIX_DAT_INT, 1, buffer); printd("Set the pixel buffer : 8bits\n");
   print_debug("MEM_ADR_SET_PIX_DAT_INT", true, buffer, 1);
 
   //Set RGB Format: 6 6 6
-  buffer[0] = 0x60;
-  this->write_lcd_command(MEM_ADR_SET_PIXEL_FORMAT, 1, buffer); printd("pixel format: 6:6:6\n");
+  buffer[0] = PIXEL_FORMAT;
+  this->queue_lcd_command(&batch, MEM_ADR_SET_PIXEL_FORMAT, 1, buffer); printd("pixel format: 6:6:6\n");
   print_debug("MEM_ADR_SET_PIXEL_FORMAT", true, buffer, 1);
 
   //Setup PLL Frequency
-  buffer[0] = 0x01;
-  buffer[1] = 0x45;
-  buffer[2] = 0x47;
-  this->write_lcd_command(MEM_ADR_SET_LSHIFT_FREQ, 3, buffer); printd("set PLL Frequency\n");
+  this->lshift_freq_params(buffer);
+  this->queue_lcd_command(&batch, MEM_ADR_SET_LSHIFT_FREQ, 3, buffer); printd("set PLL Frequency\n");
   print_debug("MEM_ADR_SET_LSHIFT_FREQ", true, buffer, 3);
 
   //Setup Horizontal Behavior
-  buffer[0] = hsync_hb;               //(high byte Set HSYNC Total Lines: 525
-  buffer[1] = hsync_lb;               //(low byte Set HSYNC Total Lines: 525
-  buffer[2] = hblank_hb;              //(high byte Set Horizonatal Blanking Period: 68
-  buffer[3] = hblank_lb;              //(low byte Set Horizontal Blanking Period: 68
-  buffer[4] = HSYNC_PULSE;            //Set horizontal balnking period 16 = 15 + 1
-  buffer[5] = hsync_pulse_start_hb;   //(high byte Set Hsync pulse start position
-  buffer[6] = hsync_pulse_start_lb;   //(low byte Set Hsync pulse start position
-  this->write_lcd_command(MEM_ADR_SET_HORIZ_PERIOD, 7, buffer); printd("Set Horizontal Behavior\n");
+  this->horiz_period_params(buffer);
+  this->queue_lcd_command(&batch, MEM_ADR_SET_HORIZ_PERIOD, 7, buffer); printd("Set Horizontal Behavior\n");
   print_debug("MEM_ADR_SET_HORIZ_PERIOD", true, buffer, 7);
 
 
   //Setup Vertical Blanking Period
-  buffer[0] = vsync_hb;               //(high byte Set Vsync total: 360
-  buffer[1] = vsync_lb;               //(low byte Set vsync total: 360
-  buffer[2] = vblank_hb;              //(high byte Set Vertical Blanking Period: 19
-  buffer[3] = vblank_lb;              //(low byte Set Vertical Blanking Period: 19
-  buffer[4] = VSYNC_PULSE;            //Vsync pulse: 8 = 7 + 1
-  buffer[5] = vsync_pulse_start_hb;   //(high byte Set Vsync pusle start position
-  buffer[6] = vsync_pulse_start_lb;   //(low byte Set Vsync pusle start position
-  this->write_lcd_command(MEM_ADR_SET_VERT_PERIOD, 7, buffer); printd("Set vertical blanking period\n");
+  this->vert_period_params(buffer);
+  this->queue_lcd_command(&batch, MEM_ADR_SET_VERT_PERIOD, 7, buffer); printd("Set vertical blanking period\n");
   print_debug("MEM_ADR_SET_VERT_PERIOD", true, buffer, 7);
 
   //Setup column address
-  buffer[0] = column_start_hb; //(high byte) Set start column address: 0
-  buffer[1] = column_start_lb; //(low byte) Set start column address: 0
-  buffer[2] = column_end_hb;   //(high byte) Set end column address: 479
-  buffer[3] = column_end_lb;   //(low byte) Set end column address: 479
-  this->write_lcd_command(MEM_ADR_SET_COLUMN_ADR, 4, buffer);
+  this->column_window_params(buffer);
+  this->queue_lcd_command(&batch, MEM_ADR_SET_COLUMN_ADR, 4, buffer);
 
   print_debug("MEM_ADR_SET_COLUMN_ADR", true, buffer, 4);
 
 
   //Setup Page Address
-  buffer[0] = page_start_hb;   //(high byte Start page address: 0
-  buffer[1] = page_start_lb;   //(low byte Start page address: 0
-  buffer[2] = page_end_hb;     //(high byte end page address: 271
-  buffer[3] = page_end_lb;     //(low byte end page address: 271
-  this->write_lcd_command(MEM_ADR_SET_PAGE_ADR, 4, buffer); printd("Set Column Address\n");
+  this->page_window_params(buffer);
+  this->queue_lcd_command(&batch, MEM_ADR_SET_PAGE_ADR, 4, buffer); printd("Set Column Address\n");
   print_debug("MEM_ADR_SET_PAGE_ADR", true, buffer, 4);
 
-  buffer[0] = 0x00;
-  this->write_lcd_command(MEM_ADR_SET_ADR_MODE, 1, buffer); printd("Set Image Configuration\n");
+  buffer[0] = ADDRESS_MODE;
+  this->queue_lcd_command(&batch, MEM_ADR_SET_ADR_MODE, 1, buffer); printd("Set Image Configuration\n");
   print_debug("MEM_ADR_SET_ADR_MODE", true, buffer, 1);
 
   //Setup Image Configuration
-  this->write_lcd_command(MEM_ADR_EXIT_PARTIAL_MODE); printd("Disable partial Mode\n");
+  this->queue_lcd_command(&batch, MEM_ADR_EXIT_PARTIAL_MODE); printd("Disable partial Mode\n");
   print_debug("MEM_ADR_EXIT_PARTIAL_MODE", true, buffer, 0);
-  this->write_lcd_command(MEM_ADR_EXIT_IDLE_MODE);  printd("Exit IDLE\n");
+  this->queue_lcd_command(&batch, MEM_ADR_EXIT_IDLE_MODE);  printd("Exit IDLE\n");
   print_debug("MEM_ADR_EXIT_IDLE_MODE", true, buffer, 0);
-  this->write_lcd_command(MEM_ADR_SET_DISPLAY_ON);  printd("Display On\n");
+  this->queue_lcd_command(&batch, MEM_ADR_SET_DISPLAY_ON);  printd("Display On\n");
   print_debug("MEM_ADR_SET_DISPLAY_ON", true, buffer, 0);
 
   //Setup the correct pixel count
-  this->write_register(REG_PIXEL_COUNT,
+  batch.write_register(REG_PIXEL_COUNT,
                        (uint32_t)(NH_LCD_480_272_HEIGHT * NH_LCD_480_272_WIDTH));
   if (this->debug){
     printf ("%s(): Set Pixel Count to: 0x%08X\n",
@@ -263,13 +233,160 @@ void NH_LCD_480_272::setup(){
   }
 
   //Enable Tearing
-  buffer[0] = 0x00;
-  this->write_lcd_command(MEM_ADR_SET_TEAR_ON, 1, buffer); printd("Enable tearing control\n");
+  buffer[0] = TEAR_MODE;
+  this->queue_lcd_command(&batch, MEM_ADR_SET_TEAR_ON, 1, buffer); printd("Enable tearing control\n");
   print_debug("MEM_ADR_SET_TEAR_ON", true, buffer, 1);
+  batch.commit();                               printd("Send the configuration\n");
   this->enable_tearing(true);                   printd("Enable tearing in core\n");
 
 }
 
+/*
+ * Parameters of the mode, period, frequency and window commands, shared by
+ * setup() and is_configured()
+ */
+void NH_LCD_480_272::lcd_mode_params(uint8_t *buffer){
+  buffer[0] = 0x00;                                         //Set TFT Mode: 0x0C ??
+  buffer[1] = 0x00;                                         //Set TFT Mode & Hsync + Vsync + DEN Mode
+  buffer[2] = (((NH_LCD_480_272_WIDTH - 1) >> 8) & 0xFF);   //Set Horizontal Size High Byte
+  buffer[3] = ( (NH_LCD_480_272_WIDTH - 1)       & 0xFF);   //Set Horizontal Size Low Byte
+  buffer[4] = (((NH_LCD_480_272_HEIGHT - 1) >> 8) & 0xFF);  //Set Vertical Size High Byte
+  buffer[5] = ( (NH_LCD_480_272_HEIGHT - 1)       & 0xFF);  //Set Vertical Size Low Byte
+  buffer[6] = 0x00;                                         //Set even/odd line RGB sequency = RGB
+}
+
+void NH_LCD_480_272::horiz_period_params(uint8_t *buffer){
+  buffer[0] = (((HSYNC_TOTAL) >> 8) & 0xFF);        //(high byte Set HSYNC Total Lines: 525
+  buffer[1] = ((HSYNC_TOTAL) & 0xFF);               //(low byte Set HSYNC Total Lines: 525
+  buffer[2] = (((HBLANK) >> 8) & 0xFF);             //(high byte Set Horizonatal Blanking Period: 68
+  buffer[3] = ((HBLANK) & 0xFF);                    //(low byte Set Horizontal Blanking Period: 68
+  buffer[4] = HSYNC_PULSE;                          //Set horizontal balnking period 16 = 15 + 1
+  buffer[5] = (((HSYNC_PULSE_START) >> 8) & 0xFF);  //(high byte Set Hsync pulse start position
+  buffer[6] = ((HSYNC_PULSE_START) & 0xFF);         //(low byte Set Hsync pulse start position
+}
+
+void NH_LCD_480_272::vert_period_params(uint8_t *buffer){
+  buffer[0] = (((VSYNC_TOTAL) >> 8) & 0xFF);        //(high byte Set Vsync total: 360
+  buffer[1] = ((VSYNC_TOTAL) & 0xFF);               //(low byte Set vsync total: 360
+  buffer[2] = (((VBLANK) >> 8) & 0xFF);             //(high byte Set Vertical Blanking Period: 19
+  buffer[3] = ((VBLANK) & 0xFF);                    //(low byte Set Vertical Blanking Period: 19
+  buffer[4] = VSYNC_PULSE;                          //Vsync pulse: 8 = 7 + 1
+  buffer[5] = (((VSYNC_PULSE_START) >> 8) & 0xFF);  //(high byte Set Vsync pusle start position
+  buffer[6] = ((VSYNC_PULSE_START) & 0xFF);         //(low byte Set Vsync pusle start position
+}
+
+void NH_LCD_480_272::lshift_freq_params(uint8_t *buffer){
+  buffer[0] = 0x01;
+  buffer[1] = 0x45;
+  buffer[2] = 0x47;
+}
+
+void NH_LCD_480_272::column_window_params(uint8_t *buffer){
+  buffer[0] = (((COLUMN_START) >> 8) & 0xFF);       //(high byte) Set start column address: 0
+  buffer[1] = ((COLUMN_START) & 0xFF);              //(low byte) Set start column address: 0
+  buffer[2] = (((COLUMN_END - 1) >> 8) & 0xFF);     //(high byte) Set end column address: 479
+  buffer[3] = ((COLUMN_END - 1) & 0xFF);            //(low byte) Set end column address: 479
+}
+
+void NH_LCD_480_272::page_window_params(uint8_t *buffer){
+  buffer[0] = (((PAGE_START) >> 8) & 0xFF);         //(high byte Start page address: 0
+  buffer[1] = ((PAGE_START) & 0xFF);                //(low byte Start page address: 0
+  buffer[2] = (((PAGE_END - 1) >> 8) & 0xFF);       //(high byte end page address: 271
+  buffer[3] = ((PAGE_END - 1) & 0xFF);              //(low byte end page address: 271
+}
+
+/*
+ * Read back the controller state in one burst and compare it with the
+ * configuration setup() writes, everything the controller can report is
+ * checked. The column and page window can't be read back, a warm start
+ * sends them again
+ *
+ * retval: true when the PLL is locked, the display is on (not partial or
+ *  idle), tearing is on and the mode, periods, pixel interface, pixel
+ *  format, LSHIFT frequency, address mode and core pixel count match
+ */
+bool NH_LCD_480_272::is_configured(){
+  RegisterBatch batch(this);
+  uint32_t pll_status;
+  uint32_t pwr_mode;
+  uint32_t tear_status;
+  uint32_t pixel_interface;
+  uint32_t pixel_format;
+  uint32_t address_mode;
+  uint32_t pixel_count;
+  uint32_t lcd_mode[7];
+  uint32_t horiz[7];
+  uint32_t vert[7];
+  uint32_t lshift[3];
+  uint8_t expected[4][7];
+
+  this->queue_lcd_command(&batch, MEM_ADR_GET_PLL_STATUS, 1, NULL, &pll_status);
+  this->queue_lcd_command(&batch, MEM_ADR_PWR_MODE, 1, NULL, &pwr_mode);
+  this->queue_lcd_command(&batch, MEM_ADR_GET_TEAR_EF, 1, NULL, &tear_status);
+  this->queue_lcd_command(&batch, MEM_ADR_GET_PIX_DAT_INT, 1, NULL, &pixel_interface);
+  this->queue_lcd_command(&batch, MEM_ADR_GET_PIXEL_FORMAT, 1, NULL, &pixel_format);
+  this->queue_lcd_command(&batch, MEM_ADR_ADR_MODE, 1, NULL, &address_mode);
+  this->queue_lcd_command(&batch, MEM_ADR_GET_LCD_MODE, 7, NULL, &lcd_mode[0]);
+  this->queue_lcd_command(&batch, MEM_ADR_GET_HORIZ_PERIOD, 7, NULL, &horiz[0]);
+  this->queue_lcd_command(&batch, MEM_ADR_GET_VERT_PERIOD, 7, NULL, &vert[0]);
+  this->queue_lcd_command(&batch, MEM_ADR_GET_LSHIFT_FREQ, 3, NULL, &lshift[0]);
+  batch.read_register(REG_PIXEL_COUNT, &pixel_count);
+  batch.commit();
+
+  if (((pll_status & PLL_STATUS_LOCKED) == 0) ||
+      ((pwr_mode & PWR_MODE_DISPLAY_ON) == 0) ||
+      ((pwr_mode & (PWR_MODE_PARTIAL | PWR_MODE_IDLE)) != 0) ||
+      ((tear_status & TEAR_EF_ON) == 0) ||
+      (((tear_status & TEAR_EF_MODE) != 0) != (TEAR_MODE != 0)) ||
+      ((pixel_interface & 0x07) != PIXEL_DATA_INTERFACE) ||
+      ((uint8_t) pixel_format != PIXEL_FORMAT) ||
+      ((uint8_t) address_mode != ADDRESS_MODE) ||
+      (pixel_count != (uint32_t)(NH_LCD_480_272_HEIGHT * NH_LCD_480_272_WIDTH))){
+    return false;
+  }
+  this->lcd_mode_params(expected[0]);
+  this->horiz_period_params(expected[1]);
+  this->vert_period_params(expected[2]);
+  this->lshift_freq_params(expected[3]);
+  for (int i = 0; i < 7; i++){
+    if (((uint8_t) lcd_mode[i] != expected[0][i]) ||
+        ((uint8_t) horiz[i]    != expected[1][i]) ||
+        ((uint8_t) vert[i]     != expected[2][i])){
+      return false;
+    }
+  }
+  //The frequency is 20 bits, the top nibble of the first byte is unused
+  if (((lshift[0] & 0x0F) != expected[3][0]) ||
+      ((uint8_t) lshift[1] != expected[3][1]) ||
+      ((uint8_t) lshift[2] != expected[3][2])){
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Read a single byte status command until (status & mask) == value
+ *
+ * timeout: give up after this many microseconds
+ * retval: true when the status matched in time
+ */
+bool NH_LCD_480_272::poll_lcd_command(uint8_t command, uint8_t mask, uint8_t value, uint32_t timeout){
+  struct timeval start;
+  struct timeval now;
+  uint8_t status = 0;
+  gettimeofday(&start, NULL);
+  while (true){
+    this->read_lcd_command(command, 1, &status);
+    if ((status & mask) == value){
+      return true;
+    }
+    gettimeofday(&now, NULL);
+    if ((uint32_t)(((now.tv_sec - start.tv_sec) * 1000000) + (now.tv_usec - start.tv_usec)) > timeout){
+      return false;
+    }
+  }
+}
+
 void NH_LCD_480_272::enable_tearing(bool enable){
   if (enable){
     this->set_register_bit(REG_CONTROL, CONTROL_ENABLE_TEARING);
@@ -311,41 +428,62 @@ void NH_LCD_480_272::enable_backlight(bool enable){
   }
 }
 
-void NH_LCD_480_272::write_lcd_command(uint8_t address, uint32_t data_count, uint8_t *data){
-  //Go into control mode
-  this->set_register_bit(REG_CONTROL, CONTROL_COMMAND_MODE);
-  //Tell the LCD command controller we are SENDING a command
-  this->clear_register_bit(REG_CONTROL, CONTROL_COMMAND_PARAMETER);
-  //Put the data in the register
-  this->write_register(REG_COMMAND_DATA, address);
-  //Writing!
-  this->set_register_bit(REG_CONTROL, CONTROL_COMMAND_WRITE);
-  //If the data_count > 0:
-  for (int i = 0; i < data_count; i++){
-    this->set_register_bit(REG_CONTROL, CONTROL_COMMAND_PARAMETER);
-    this->write_register(REG_COMMAND_DATA, data[i]);
-    this->set_register_bit(REG_CONTROL, CONTROL_COMMAND_WRITE);
+/*
+ * Compile an LCD command into writes of the control and command data
+ * registers, the control values are worked out here instead of being read
+ * back for every bit that changes
+ *
+ * command: MCU command
+ * data_count: number of parameter bytes
+ * data: parameters to write (NULL when reading)
+ * read_data: slots for the parameters that are read back (NULL when
+ *  writing), filled in when the batch is committed
+ */
+void NH_LCD_480_272::queue_lcd_command(RegisterBatch *batch, uint8_t command, uint32_t data_count, uint8_t *data, uint32_t *read_data){
+  //The strobes clear themselves once the core has used them
+  uint32_t control = this->read_register(REG_CONTROL) &
+                     (~((1 << CONTROL_COMMAND_WRITE) | (1 << CONTROL_COMMAND_READ)));
+
+  //Go into command mode, we are SENDING a command
+  control |= (1 << CONTROL_COMMAND_MODE);
+  control &= (~(1 << CONTROL_COMMAND_PARAMETER));
+  batch->write_register(REG_CONTROL, control);
+  //Put the command in the register and strobe it out
+  batch->write_register(REG_COMMAND_DATA, command);
+  batch->write_register(REG_CONTROL, control | (1 << CONTROL_COMMAND_WRITE));
+  //Parameters
+  if (data_count > 0){
+    control |= (1 << CONTROL_COMMAND_PARAMETER);
+    batch->write_register(REG_CONTROL, control);
+  }
+  for (uint32_t i = 0; i < data_count; i++){
+    if (read_data != NULL){
+      batch->write_register(REG_CONTROL, control | (1 << CONTROL_COMMAND_READ));
+      batch->read_register(REG_COMMAND_DATA, &read_data[i]);
+    }
+    else {
+      batch->write_register(REG_COMMAND_DATA, data[i]);
+      batch->write_register(REG_CONTROL, control | (1 << CONTROL_COMMAND_WRITE));
+    }
   }
   //Go back into data mode
-  this->clear_register_bit(REG_CONTROL, CONTROL_COMMAND_MODE);
+  control &= (~(1 << CONTROL_COMMAND_MODE));
+  batch->write_register(REG_CONTROL, control);
+}
+
+void NH_LCD_480_272::write_lcd_command(uint8_t address, uint32_t data_count, uint8_t *data){
+  RegisterBatch batch(this);
+  this->queue_lcd_command(&batch, address, data_count, data);
+  batch.commit();
 }
 void NH_LCD_480_272::read_lcd_command(uint8_t address, uint32_t data_count, uint8_t *data){
-  //Go into command mode
-  this->set_register_bit(REG_CONTROL, CONTROL_COMMAND_MODE);
-  //Tell the LCD command controller we are sending the command
-  this->clear_register_bit(REG_CONTROL, CONTROL_COMMAND_PARAMETER);
-  //Put the daa in the register
-  this->write_register(REG_COMMAND_DATA, address);
-  //Writing
-  this->set_register_bit(REG_CONTROL, CONTROL_COMMAND_WRITE);
-  //go through each of the incomming peices of data and put it in the data buffer
-  for (int i = 0; i < data_count; i++){
-    this->set_register_bit(REG_CONTROL, CONTROL_COMMAND_PARAMETER);
-    this->set_register_bit(REG_CONTROL, CONTROL_COMMAND_READ);
-    data[i] = (uint8_t) this->read_register(REG_COMMAND_DATA);
+  RegisterBatch batch(this);
+  std::vector<uint32_t> read_data(data_count);
+  this->queue_lcd_command(&batch, address, data_count, NULL, read_data.data());
+  batch.commit();
+  for (uint32_t i = 0; i < data_count; i++){
+    data[i] = (uint8_t) read_data[i];
   }
-  //go back to data mode
-  this->clear_register_bit(REG_CONTROL, CONTROL_COMMAND_MODE);
 }
 
 //Control
@@ -362,7 +500,7 @@ void NH_LCD_480_272::stop(){
 void NH_LCD_480_272::reset(){
   //printf ("%s(): Reset...\n", __func__);
   this->set_register_bit(REG_CONTROL, CONTROL_RESET_DISPLAY);
-  usleep(30000);
+  usleep(RESET_PULSE_TIME);
   //printf ("%s(): Reset finished...\n", __func__);
   this->clear_register_bit(REG_CONTROL, CONTROL_RESET_DISPLAY);
 }
@@ -377,6 +515,20 @@ void NH_LCD_480_272::dma_write(uint8_t *buffer){
   this->dma->write(buffer);
 }
 
+int NH_LCD_480_272::start_frame_queue(uint32_t depth, QUEUE_POLICY policy){
+  return this->dma->start_write_queue(depth, policy);
+}
+void NH_LCD_480_272::stop_frame_queue(){
+  this->dma->stop_write_queue();
+}
+/*
+ * Queue a frame without waiting for USB, returns 1 if the frame was
+ * dropped because the queue was full
+ */
+int NH_LCD_480_272::queue_frame(uint8_t *buffer, bool block){
+  return this->dma->enqueue(buffer, block);
+}
+
 void print_debug(const char* name, bool writing, uint8_t* mode, uint32_t length){
 
   if (writing){
@@ -0,0 +1,309 @@
+#include "memory_allocator.hpp"
+#include <stdio.h>
+#include <vector>
+
+MemoryAllocator::MemoryAllocator(bool debug){
+  this->debug = debug;
+}
+
+MemoryAllocator::~MemoryAllocator(){
+}
+
+/*
+ *  Round down/up to a multiple of a block of the given order
+*/
+static uint64_t block_floor(uint64_t address, uint32_t order){
+  return address & ~(((uint64_t) 1 << order) - 1);
+}
+
+static uint64_t block_ceil(uint64_t address, uint32_t order){
+  return block_floor(address + (((uint64_t) 1 << order) - 1), order);
+}
+
+/*
+ *  Smallest order that holds 'size' bytes
+*/
+uint32_t MemoryAllocator::order_for_size(uint32_t size){
+  uint32_t order = MIN_ORDER;
+  while ((order < MAX_ORDER) && (((uint64_t) 1 << order) < size)){
+    order++;
+  }
+  return order;
+}
+
+/*
+ *  Order of the chunk that holds 'address', 0 if it is not managed
+*/
+uint32_t MemoryAllocator::chunk_order(uint32_t address){
+  std::map<uint32_t, uint32_t>::iterator it = this->chunks.upper_bound(address);
+  if (it == this->chunks.begin()){
+    return 0;
+  }
+  it--;
+  if ((uint64_t) address >= ((uint64_t) it->first + ((uint64_t) 1 << it->second))){
+    return 0;
+  }
+  return it->second;
+}
+
+/*
+ *  True if a reservation overlaps the range from 'start' to 'end'
+*/
+bool MemoryAllocator::is_reserved(uint64_t start, uint64_t end){
+  std::map<uint32_t, uint32_t>::iterator it;
+  for (it = this->reserved.begin(); it != this->reserved.end(); it++){
+    if ((it->first < end) && (((uint64_t) it->first + it->second) > start)){
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ *  Put a block back on the free lists, merged with its buddy as long as
+ *  the buddy is free and the merged block stays inside the chunk
+*/
+void MemoryAllocator::release_block(uint32_t address, uint32_t order){
+  uint32_t limit = this->chunk_order(address);
+  uint64_t buddy;
+  while (order < limit){
+    buddy = (uint64_t) address ^ ((uint64_t) 1 << order);
+    if (this->free_blocks[order].erase((uint32_t) buddy) == 0){
+      break;
+    }
+    address &= ~((uint32_t) 1 << order);
+    order++;
+  }
+  this->free_blocks[order].insert(address);
+}
+
+/*
+ *  Take the free memory between 'start' and 'end' (both aligned to the
+ *  minimum block size) off the free lists
+ *
+ *  A free block that is partly inside the range is split, the halves are
+ *  looked at again with the next smaller order
+*/
+void MemoryAllocator::remove_free(uint64_t start, uint64_t end){
+  std::vector<uint32_t> blocks;
+  std::set<uint32_t>::iterator it;
+  uint64_t size;
+  for (uint32_t order = MAX_ORDER; order >= MIN_ORDER; order--){
+    size = (uint64_t) 1 << order;
+    blocks.clear();
+    it = this->free_blocks[order].lower_bound((start >= size) ? (uint32_t) (start - size + 1) : 0);
+    while ((it != this->free_blocks[order].end()) && (*it < end)){
+      blocks.push_back(*it);
+      it++;
+    }
+    for (uint32_t i = 0; i < blocks.size(); i++){
+      this->free_blocks[order].erase(blocks[i]);
+      if ((blocks[i] >= start) && ((blocks[i] + size) <= end)){
+        //Completely inside, gone
+        continue;
+      }
+      if (order > MIN_ORDER){
+        this->free_blocks[order - 1].insert(blocks[i]);
+        this->free_blocks[order - 1].insert(blocks[i] + (uint32_t) (size >> 1));
+      }
+    }
+  }
+}
+
+/*
+ *  Add memory the allocator can hand out
+ *
+ *  \param address: start of the memory on the memory bus
+ *  \param size: number of bytes, anything below the minimum block size
+ *    (4 KB) at either end is left unused
+ *
+ *  \retval  0: all fine
+ *          -1: the region is too small or overlaps memory that was added
+ *              before
+*/
+int MemoryAllocator::add_region(uint32_t address, uint32_t size){
+  uint64_t start = ((uint64_t) address + ((1 << MIN_ORDER) - 1)) & ~((uint64_t) (1 << MIN_ORDER) - 1);
+  uint64_t end = (uint64_t) address + size;
+  uint32_t order;
+  std::map<uint32_t, uint32_t>::iterator it;
+  if ((end < start) || ((end - start) < ((uint64_t) 1 << MIN_ORDER))){
+    return -1;
+  }
+  //The last chunk that starts below the end is the only one to check
+  it = (end > 0xFFFFFFFF) ? this->chunks.end() : this->chunks.lower_bound((uint32_t) end);
+  if (it != this->chunks.begin()){
+    it--;
+    if (((uint64_t) it->first + ((uint64_t) 1 << it->second)) > start){
+      return -1;
+    }
+  }
+  while ((end - start) >= ((uint64_t) 1 << MIN_ORDER)){
+    //Largest block that is aligned at 'start' and still fits
+    order = MIN_ORDER;
+    while ((order < MAX_ORDER) &&
+           ((start & (((uint64_t) 1 << (order + 1)) - 1)) == 0) &&
+           ((start + ((uint64_t) 1 << (order + 1))) <= end)){
+      order++;
+    }
+    this->chunks[start] = order;
+    this->free_blocks[order].insert(start);
+    if (this->debug) printf ("%s(): Chunk 0x%08X: 0x%08llX bytes\n", __func__, (uint32_t) start, (unsigned long long) 1 << order);
+    start += (uint64_t) 1 << order;
+  }
+  //Memory that was reserved before it was added
+  for (it = this->reserved.begin(); it != this->reserved.end(); it++){
+    this->remove_free(block_floor(it->first, MIN_ORDER),
+                      block_ceil((uint64_t) it->first + it->second, MIN_ORDER));
+  }
+  return 0;
+}
+
+/*
+ *  Forget all memory and allocations
+*/
+void MemoryAllocator::reset(){
+  for (uint32_t i = 0; i <= MAX_ORDER; i++){
+    this->free_blocks[i].clear();
+  }
+  this->allocated.clear();
+  this->chunks.clear();
+  this->reserved.clear();
+}
+
+/*
+ *  Allocate a region
+ *
+ *  \param size: number of bytes, rounded up to a power of two
+ *  \param address: start of the region, aligned to its rounded size
+ *
+ *  \retval  0: all fine
+ *          -1: no free region is large enough
+*/
+int MemoryAllocator::alloc(uint32_t size, uint32_t *address){
+  uint32_t order = this->order_for_size(size);
+  uint32_t found = order;
+  uint32_t block;
+  while ((found <= MAX_ORDER) && this->free_blocks[found].empty()){
+    found++;
+  }
+  if ((found > MAX_ORDER) || (((uint64_t) 1 << order) < size)){
+    return -1;
+  }
+  //Lowest address first keeps the top of memory in large blocks
+  block = *this->free_blocks[found].begin();
+  this->free_blocks[found].erase(this->free_blocks[found].begin());
+  while (found > order){
+    //Split, the upper half is the buddy
+    found--;
+    this->free_blocks[found].insert(block + ((uint32_t) 1 << found));
+  }
+  this->allocated[block] = order;
+  *address = block;
+  return 0;
+}
+
+/*
+ *  Keep a fixed range from being handed out by 'alloc'
+ *
+ *  \param address: start of the range on the memory bus, it does not have
+ *    to be aligned or inside memory that was added
+ *  \param size: number of bytes, the range is widened to the minimum block
+ *    size (4 KB) at both ends
+ *
+ *  \retval  0: all fine
+ *          -1: the size is 0 or the range overlaps an allocated region or
+ *              another reservation
+*/
+int MemoryAllocator::reserve(uint32_t address, uint32_t size){
+  uint64_t start = block_floor(address, MIN_ORDER);
+  uint64_t end = block_ceil((uint64_t) address + size, MIN_ORDER);
+  std::map<uint32_t, uint32_t>::iterator it;
+  if (size == 0){
+    return -1;
+  }
+  for (it = this->allocated.begin(); it != this->allocated.end(); it++){
+    if ((it->first < end) && (((uint64_t) it->first + ((uint64_t) 1 << it->second)) > start)){
+      return -1;
+    }
+  }
+  //Reservations may share a block, only the bytes must not overlap
+  if (this->is_reserved(address, (uint64_t) address + size)){
+    return -1;
+  }
+  this->reserved[address] = size;
+  this->remove_free(start, end);
+  if (this->debug) printf ("%s(): Reserved 0x%08X: 0x%08X bytes\n", __func__, address, size);
+  return 0;
+}
+
+/*
+ *  Give a region or a reservation back
+ *
+ *  \param address: start of the region from 'alloc' or the range from
+ *    'reserve'
+ *
+ *  \retval  0: all fine
+ *          -1: the address was not allocated or reserved
+*/
+int MemoryAllocator::free(uint32_t address){
+  std::map<uint32_t, uint32_t>::iterator it = this->allocated.find(address);
+  uint64_t start;
+  uint64_t end;
+  if (it != this->allocated.end()){
+    this->release_block(address, it->second);
+    this->allocated.erase(it);
+    return 0;
+  }
+  it = this->reserved.find(address);
+  if (it == this->reserved.end()){
+    return -1;
+  }
+  start = block_floor(it->first, MIN_ORDER);
+  end = block_ceil((uint64_t) it->first + it->second, MIN_ORDER);
+  this->reserved.erase(it);
+  //Only the blocks inside the managed memory that no other reservation
+  //touches go back on the free lists
+  for (; start < end; start += (uint64_t) 1 << MIN_ORDER){
+    if ((this->chunk_order((uint32_t) start) > 0) &&
+        !this->is_reserved(start, start + ((uint64_t) 1 << MIN_ORDER))){
+      this->release_block((uint32_t) start, MIN_ORDER);
+    }
+  }
+  return 0;
+}
+
+/*
+ *  Number of bytes that are not allocated
+*/
+uint32_t MemoryAllocator::get_free_size(){
+  uint64_t size = 0;
+  for (uint32_t i = MIN_ORDER; i <= MAX_ORDER; i++){
+    size += (uint64_t) this->free_blocks[i].size() << i;
+  }
+  return (size > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t) size;
+}
+
+/*
+ *  Largest region 'alloc' can hand out right now
+*/
+uint32_t MemoryAllocator::get_largest_free(){
+  for (uint32_t i = MAX_ORDER; i >= MIN_ORDER; i--){
+    if (!this->free_blocks[i].empty()){
+      return (uint32_t) 1 << i;
+    }
+  }
+  return 0;
+}
+
+/*
+ *  Size of an allocated region (the rounded size) or of a reservation, 0 if
+ *  neither
+*/
+uint32_t MemoryAllocator::get_allocated_size(uint32_t address){
+  std::map<uint32_t, uint32_t>::iterator it = this->allocated.find(address);
+  if (it == this->allocated.end()){
+    it = this->reserved.find(address);
+    return (it == this->reserved.end()) ? 0 : it->second;
+  }
+  return (uint32_t) 1 << it->second;
+}
@@ -8,12 +8,16 @@ Nysa::Nysa(bool debug) {
   //DRT Settings
   this->num_devices = 0;
   this->version = 0;
+
+  this->memory = new MemoryAllocator(debug);
+  this->memory_seeded = false;
 }
 
 Nysa::~Nysa(){
   if (this->drt != NULL){
     delete(this->drt);
   }
+  delete(this->memory);
 }
 
 int Nysa::open(){
@@ -26,6 +30,7 @@ int Nysa::close(){
 int Nysa::parse_drt(){
   //read the DRT Json File
   this->version = this->drt[0] << 8 | this->drt[1];
+  return 0;
 }
 
 //Low Level interface (These must be overridden by a subclass
@@ -64,6 +69,30 @@ int Nysa::crash_report(uint32_t *buffer){
   return -1;
 }
 
+uint8_t * Nysa::alloc_buffer(uint32_t size){
+  return new uint8_t[size];
+}
+
+void Nysa::free_buffer(uint8_t *buffer){
+  delete[] buffer;
+}
+
+int Nysa::flush(){
+  return 0;
+}
+
+int Nysa::begin_pipeline(){
+  return 0;
+}
+
+int Nysa::end_pipeline(){
+  return 0;
+}
+
+int Nysa::queue_read_periph_data(uint32_t dev_addr, uint32_t addr, uint8_t *buffer, uint32_t size){
+  return this->read_periph_data(dev_addr, addr, buffer, size);
+}
+
 //Helper Functions
 int Nysa::write_register(uint32_t dev_addr, uint32_t reg_addr, uint32_t data){
   //write to only one address in the peripheral address space
@@ -307,8 +336,7 @@ int Nysa::get_drt_device_flags(uint32_t index, uint16_t *nysa_flags, uint16_t *d
   //Go to the start of the type
   *nysa_flags = (this->drt[pos] << 8)      | (this->drt[pos + 1]);
   *dev_flags  = (this->drt[pos + 2] << 8)  | (this->drt[pos + 3]);
-
-
+  return 0;
 }
 bool Nysa::is_memory_device(uint32_t index){
   int retval = 0;
@@ -321,6 +349,75 @@ bool Nysa::is_memory_device(uint32_t index){
   return false;
 }
 
+/*
+ *  Hand every memory device in the DRT to the allocator, done once the
+ *  DRT has been read
+ *
+ *  \retval  0: all fine
+ *          -1: the DRT has not been read yet
+*/
+int Nysa::seed_memory(){
+  if (this->memory_seeded){
+    return 0;
+  }
+  if (this->drt == NULL){
+    return -1;
+  }
+  for (int i = 1; i < this->get_drt_device_count() + 1; i++){
+    if (this->is_memory_device(i)){
+      if (this->debug) printf ("%s(): Memory device %d: 0x%08X (0x%08X bytes)\n", __func__, i, this->get_drt_device_addr(i), this->get_drt_device_size(i));
+      this->memory->add_region(this->get_drt_device_addr(i), this->get_drt_device_size(i));
+    }
+  }
+  this->memory_seeded = true;
+  return 0;
+}
+
+/*
+ *  Allocate a region of FPGA memory
+ *
+ *  \param size: number of bytes
+ *  \param address: memory bus address of the region, aligned to the size
+ *    rounded up to a power of two
+ *
+ *  \retval  0: all fine
+ *          -1: DRT not read or not enough free memory
+*/
+int Nysa::alloc_memory(uint32_t size, uint32_t *address){
+  if (this->seed_memory() < 0){
+    return -1;
+  }
+  return this->memory->alloc(size, address);
+}
+
+/*
+ *  Keep a fixed range of FPGA memory from being allocated, for devices
+ *  that can not use memory from 'alloc_memory'
+ *
+ *  \param address: memory bus address of the range
+ *  \param size: number of bytes
+ *
+ *  \retval  0: all fine, give it back with 'free_memory'
+ *          -1: the range overlaps memory that is allocated or reserved
+*/
+int Nysa::reserve_memory(uint32_t address, uint32_t size){
+  //Without the DRT the memory is added later, the range is still kept
+  this->seed_memory();
+  return this->memory->reserve(address, size);
+}
+
+int Nysa::free_memory(uint32_t address){
+  return this->memory->free(address);
+}
+
+/*
+ *  Allocator behind 'alloc_memory', memory that is not in the DRT can be
+ *  added with 'add_region'
+*/
+MemoryAllocator * Nysa::get_memory_allocator(){
+  return this->memory;
+}
+
 int Nysa::pretty_print_crash_report(){
   return -1;
 }
@@ -0,0 +1,302 @@
+/*
+ *  DMA block state checks
+ *
+ *  A simulated Nysa answers the DRT, the status register and the
+ *  interrupt waits of one DMA core. The core finishes blocks in the order
+ *  they were handed to it and raises a single interrupt for everything it
+ *  finished during a wait, the way interrupt vectors are merged on the
+ *  link. The DMA has to keep both blocks busy no matter how the
+ *  interrupts were merged
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <deque>
+#include <vector>
+#include "driver.hpp"
+
+static int failures = 0;
+
+#define CHECK(x) do{                                                    \
+                    if (!(x)){                                          \
+                      printf ("%s:%d: check failed: %s\n",              \
+                              __func__, __LINE__, #x);                  \
+                      failures++;                                       \
+                    }                                                   \
+                 }while(0)
+
+#define TEST_DEVICE_ID      0x0042
+#define TEST_DEVICE_INDEX   1
+
+#define BLOCK_SIZE          0x1000
+
+enum TEST_REGISTERS {
+  REG_STATUS          = 1,
+  REG_MEM_0_BASE      = 2,
+  REG_MEM_0_SIZE      = 3,
+  REG_MEM_1_BASE      = 4,
+  REG_MEM_1_SIZE      = 5
+};
+
+enum TEST_STATUS_BITS {
+  STATUS_0_FINISHED   = 0,
+  STATUS_1_FINISHED   = 1,
+  STATUS_0_EMPTY      = 2,
+  STATUS_1_EMPTY      = 3
+};
+
+/*
+ *  Simulated image with one DMA core
+ *    'script' is the number of blocks the core finishes while the host
+ *    waits, one entry per wait, 'finish_default' is used when the script
+ *    runs out
+ */
+class SimNysa : public Nysa {
+  public:
+    bool writing;
+    bool armed[2];
+    bool full[2];
+    std::deque<uint32_t> order;
+    std::deque<uint32_t> script;
+    uint32_t finish_default;
+    uint32_t wait_calls;
+    uint32_t wait_timeouts;
+    uint32_t status_reads;
+
+    SimNysa(bool writing) : Nysa(false){
+      this->writing         = writing;
+      this->armed[0]        = false;
+      this->armed[1]        = false;
+      this->full[0]         = false;
+      this->full[1]         = false;
+      this->finish_default  = 0;
+      this->wait_calls      = 0;
+      this->wait_timeouts   = 0;
+      this->status_reads    = 0;
+    }
+
+    uint32_t status(){
+      uint32_t status = 0;
+      for (uint32_t i = 0; i < 2; i++){
+        if (this->full[i]){
+          status |= 1 << (STATUS_0_FINISHED + i);
+        }
+        else if (!this->armed[i]){
+          status |= 1 << (STATUS_0_EMPTY + i);
+        }
+      }
+      return status;
+    }
+
+    void arm(uint32_t block){
+      this->armed[block] = true;
+      this->full[block] = false;
+      this->order.push_back(block);
+    }
+
+    int write_periph_data(uint32_t dev_addr, uint32_t addr, uint8_t *buffer, uint32_t size){
+      if (dev_addr != TEST_DEVICE_INDEX){
+        return -1;
+      }
+      if (addr == REG_MEM_0_SIZE){
+        this->arm(0);
+      }
+      else if (addr == REG_MEM_1_SIZE){
+        this->arm(1);
+      }
+      return 0;
+    }
+
+    int read_periph_data(uint32_t dev_addr, uint32_t addr, uint8_t *buffer, uint32_t size){
+      uint32_t value = 0;
+      memset(buffer, 0, size);
+      if (dev_addr == 0){
+        //DRT: one device after the header
+        if (size >= 8){
+          buffer[7] = 1;
+        }
+        if (size >= 64){
+          buffer[32 + 2] = (TEST_DEVICE_ID >> 8) & 0xFF;
+          buffer[32 + 3] = TEST_DEVICE_ID & 0xFF;
+        }
+        return 0;
+      }
+      if (addr == REG_STATUS){
+        this->status_reads++;
+        value = this->status();
+      }
+      buffer[0] = (value >> 24) & 0xFF;
+      buffer[1] = (value >> 16) & 0xFF;
+      buffer[2] = (value >> 8) & 0xFF;
+      buffer[3] = value & 0xFF;
+      return 0;
+    }
+
+    int write_memory(uint32_t address, uint8_t *buffer, uint32_t size){
+      return 0;
+    }
+
+    int read_memory(uint32_t address, uint8_t *buffer, uint32_t size){
+      memset(buffer, 0xA5, size);
+      return 0;
+    }
+
+    int wait_for_interrupts(uint32_t timeout, uint32_t *interrupts){
+      uint32_t count = this->finish_default;
+      uint32_t finished = 0;
+      uint32_t block = 0;
+      this->wait_calls++;
+      if (!this->script.empty()){
+        count = this->script.front();
+        this->script.pop_front();
+      }
+      while ((finished < count) && !this->order.empty()){
+        block = this->order.front();
+        this->order.pop_front();
+        this->armed[block] = false;
+        this->full[block] = !this->writing;
+        finished++;
+      }
+      if (finished == 0){
+        this->wait_timeouts++;
+        *interrupts = 0;
+        usleep(100);
+        return -1;
+      }
+      //Everything that finished during the wait shows up as one interrupt
+      *interrupts = 1 << TEST_DEVICE_INDEX;
+      return 0;
+    }
+};
+
+class TestDriver : public Driver {
+  public:
+    TestDriver(Nysa *nysa) : Driver(nysa){
+      nysa->read_drt();
+      this->set_device_id(TEST_DEVICE_ID);
+      this->find_device();
+    }
+};
+
+static void setup_dma(DMA *dma, bool writing, RXTX_STRATEGY strategy){
+  if (writing){
+    dma->setup_write( 0, BLOCK_SIZE, BLOCK_SIZE,
+                      REG_STATUS,
+                      REG_MEM_0_BASE, REG_MEM_0_SIZE,
+                      REG_MEM_1_BASE, REG_MEM_1_SIZE,
+                      true, strategy);
+  }
+  else {
+    dma->setup_read(  0, BLOCK_SIZE, BLOCK_SIZE,
+                      REG_STATUS,
+                      REG_MEM_0_BASE, REG_MEM_0_SIZE,
+                      REG_MEM_1_BASE, REG_MEM_1_SIZE,
+                      true, strategy);
+  }
+  dma->set_status_bits( STATUS_0_FINISHED,
+                        STATUS_1_FINISHED,
+                        STATUS_0_EMPTY,
+                        STATUS_1_EMPTY);
+}
+
+/*
+ *  Both blocks finish during one wait and the core reports them with one
+ *  interrupt, the next two writes have to go out without waiting again
+ */
+static void test_merged_write_interrupt(void){
+  SimNysa nysa(true);
+  TestDriver driver(&nysa);
+  DMA dma(&nysa, &driver, TEST_DEVICE_INDEX);
+  std::vector<uint8_t> buffer(BLOCK_SIZE, 0x5A);
+
+  setup_dma(&dma, true, CADENCE);
+  CHECK(dma.write(buffer.data()) == 0);
+  CHECK(dma.write(buffer.data()) == 0);
+  CHECK(nysa.armed[0] && nysa.armed[1]);
+  CHECK(nysa.wait_calls == 0);
+
+  nysa.script.push_back(2);
+  CHECK(dma.write(buffer.data()) == 0);
+  CHECK(nysa.wait_calls == 1);
+  CHECK(dma.write(buffer.data()) == 0);
+  //Both blocks went out on the one interrupt
+  CHECK(nysa.wait_calls == 1);
+  CHECK(nysa.wait_timeouts == 0);
+  CHECK(nysa.armed[0] && nysa.armed[1]);
+
+  //One block per interrupt keeps both blocks busy as well
+  for (uint32_t i = 0; i < 8; i++){
+    nysa.script.push_back(1);
+    CHECK(dma.write(buffer.data()) == 0);
+    CHECK(nysa.armed[0] && nysa.armed[1]);
+  }
+  CHECK(nysa.wait_calls == 9);
+  CHECK(nysa.wait_timeouts == 0);
+}
+
+/*
+ *  With one block in flight an interrupt settles it without a status read
+ */
+static void test_single_write_interrupt(void){
+  SimNysa nysa(true);
+  TestDriver driver(&nysa);
+  DMA dma(&nysa, &driver, TEST_DEVICE_INDEX);
+  std::vector<uint8_t> buffer(BLOCK_SIZE, 0x5A);
+  uint32_t status_reads = 0;
+
+  setup_dma(&dma, true, SINGLE_BUFFER);
+  CHECK(dma.write(buffer.data()) == 0);
+  status_reads = nysa.status_reads;
+  for (uint32_t i = 0; i < 4; i++){
+    nysa.script.push_back(1);
+    CHECK(dma.write(buffer.data()) == 0);
+  }
+  CHECK(nysa.wait_calls == 4);
+  CHECK(nysa.wait_timeouts == 0);
+  CHECK(nysa.status_reads == status_reads);
+}
+
+/*
+ *  The core fills both blocks while the capture waits and reports it with
+ *  one interrupt, that is a stall and has to show up as an underrun. After
+ *  that the capture keeps up and nothing else is lost
+ */
+static void test_capture_underrun(void){
+  SimNysa nysa(false);
+  TestDriver driver(&nysa);
+  DMA dma(&nysa, &driver, TEST_DEVICE_INDEX);
+  std::vector<uint8_t> memory(BLOCK_SIZE * 64);
+  DMARing ring(memory.data(), BLOCK_SIZE, 64);
+
+  setup_dma(&dma, false, IMMEDIATE);
+  //16 blocks, then the core goes quiet
+  nysa.script.push_back(2);
+  for (uint32_t i = 0; i < 14; i++){
+    nysa.script.push_back(1);
+  }
+  CHECK(dma.start_capture(&ring) == 0);
+  for (uint32_t i = 0; (i < 2000) && (dma.get_capture_blocks() < 16); i++){
+    usleep(1000);
+  }
+  dma.stop_capture();
+  CHECK(dma.get_capture_error() == 0);
+  CHECK(dma.get_capture_blocks() == 16);
+  CHECK(ring.count() == 16);
+  CHECK(dma.get_capture_underruns() == 1);
+  CHECK(dma.get_capture_overruns() == 0);
+}
+
+int main(void){
+  test_merged_write_interrupt();
+  test_single_write_interrupt();
+  test_capture_underrun();
+
+  printf ("dma: ");
+  if (failures > 0){
+    printf ("%d checks failed\n", failures);
+    return 1;
+  }
+  printf ("passed\n");
+  return 0;
+}
@@ -0,0 +1,320 @@
+/*
+ *  Bulk read mode checks
+ *
+ *  A scripted endpoint turns a byte stream into FTDI packet streams the way
+ *  the chip sends them: every 512 byte packet starts with two modem status
+ *  bytes and a transfer ends with a short packet when the data runs out.
+ *  The streams are run through ftdi_strip_modem_status and consume_packets
+ *  and the output is compared byte for byte with the original stream.
+ *
+ *  Build it with and without DIONYSUS_NO_SIMD to cover both copy paths
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "dionysus_local.hpp"
+
+static int failures = 0;
+
+#define CHECK(x) do{                                                    \
+                    if (!(x)){                                          \
+                      printf ("%s:%d: check failed: %s\n",              \
+                              __func__, __LINE__, #x);                  \
+                      failures++;                                       \
+                    }                                                   \
+                 }while(0)
+
+/*
+ *  Scripted FTDI endpoint
+ *    Cuts 'stream' into transfers of at most 'transfer_size' bytes, a
+ *    transfer is a run of full packets closed by a short packet when the
+ *    stream ends or 'short_every' packets have been sent
+ */
+struct scripted_endpoint_t {
+  const uint8_t * stream;
+  uint32_t size;
+  uint32_t pos;
+  uint32_t transfer_size;
+  uint32_t short_every;
+  uint32_t short_payload;
+};
+
+static void endpoint_init(scripted_endpoint_t *ep,
+                          const uint8_t *stream,
+                          uint32_t size,
+                          uint32_t transfer_size,
+                          uint32_t short_every,
+                          uint32_t short_payload){
+  ep->stream        = stream;
+  ep->size          = size;
+  ep->pos           = 0;
+  ep->transfer_size = transfer_size;
+  ep->short_every   = short_every;
+  ep->short_payload = short_payload;
+}
+
+/*
+ *  Fill 'transfer' with the next transfer
+ *
+ *  \retval number of bytes in the transfer (0 when the stream is done)
+ */
+static uint32_t endpoint_next(scripted_endpoint_t *ep, uint8_t *transfer){
+  uint32_t length = 0;
+  uint32_t packets = 0;
+  uint32_t payload = 0;
+
+  while ((ep->pos < ep->size) &&
+         ((length + FTDI_PACKET_SIZE) <= ep->transfer_size)){
+    payload = ep->size - ep->pos;
+    if (payload > FTDI_PACKET_PAYLOAD){
+      payload = FTDI_PACKET_PAYLOAD;
+    }
+    packets++;
+    if ((ep->short_every > 0) && (packets == ep->short_every) &&
+        (payload > ep->short_payload)){
+      payload = ep->short_payload;
+    }
+    //Modem status, the chip sends 0x01 0x60 when idle
+    transfer[length++] = 0x01;
+    transfer[length++] = 0x60;
+    memcpy(&transfer[length], &ep->stream[ep->pos], payload);
+    length  += payload;
+    ep->pos += payload;
+    if (payload < FTDI_PACKET_PAYLOAD){
+      //A short packet ends the transfer
+      break;
+    }
+  }
+  return length;
+}
+
+static void fill_pattern(uint8_t *buffer, uint32_t size, uint32_t seed){
+  for (uint32_t i = 0; i < size; i++){
+    seed = seed * 1103515245 + 12345;
+    buffer[i] = (uint8_t) (seed >> 16);
+  }
+}
+
+/*
+ *  Strip whole transfers, every size from nothing to a few packets and
+ *  transfer sizes that are not a multiple of the packet size
+ */
+static void test_strip_sizes(void){
+  const uint32_t transfer_sizes[] = {512, 1000, 1024, 4096, 16384, 65536};
+  const uint32_t stream_sizes[] = {0, 1, 31, 32, 33, 509, 510, 511, 1020,
+                                   1021, 4000, 16320, 16321, 100000};
+  std::vector<uint8_t> stream;
+  std::vector<uint8_t> output;
+  std::vector<uint8_t> transfer(65536);
+  scripted_endpoint_t ep;
+  uint32_t length = 0;
+  uint32_t written = 0;
+
+  for (uint32_t t = 0; t < sizeof(transfer_sizes) / sizeof(transfer_sizes[0]); t++){
+    for (uint32_t s = 0; s < sizeof(stream_sizes) / sizeof(stream_sizes[0]); s++){
+      stream.resize(stream_sizes[s]);
+      output.assign(stream_sizes[s] + 64, 0xEE);
+      fill_pattern(stream.data(), stream_sizes[s], s);
+      endpoint_init(&ep, stream.data(), stream_sizes[s], transfer_sizes[t], 0, 0);
+      written = 0;
+      while ((length = endpoint_next(&ep, transfer.data())) > 0){
+        written += ftdi_strip_modem_status( &output[written],
+                                            stream_sizes[s] - written,
+                                            transfer.data(),
+                                            length,
+                                            FTDI_PACKET_SIZE);
+      }
+      CHECK(written == stream_sizes[s]);
+      CHECK(memcmp(output.data(), stream.data(), stream_sizes[s]) == 0);
+      //Nothing is written past the end
+      CHECK(output[stream_sizes[s]] == 0xEE);
+    }
+  }
+}
+
+/*
+ *  Short packets in the middle of a stream, including packets that only
+ *  carry the modem status
+ */
+static void test_strip_short_packets(void){
+  const uint32_t short_payloads[] = {0, 1, 17, 32, 200, 509};
+  std::vector<uint8_t> stream(50000);
+  std::vector<uint8_t> output(50000);
+  std::vector<uint8_t> transfer(16384);
+  scripted_endpoint_t ep;
+  uint32_t length = 0;
+  uint32_t written = 0;
+
+  fill_pattern(stream.data(), stream.size(), 7);
+  for (uint32_t i = 0; i < sizeof(short_payloads) / sizeof(short_payloads[0]); i++){
+    endpoint_init(&ep, stream.data(), stream.size(), 16384, 3, short_payloads[i]);
+    written = 0;
+    memset(output.data(), 0, output.size());
+    while ((length = endpoint_next(&ep, transfer.data())) > 0){
+      written += ftdi_strip_modem_status( &output[written],
+                                          output.size() - written,
+                                          transfer.data(),
+                                          length,
+                                          FTDI_PACKET_SIZE);
+    }
+    CHECK(written == stream.size());
+    CHECK(memcmp(output.data(), stream.data(), stream.size()) == 0);
+  }
+}
+
+/*
+ *  The destination limit cuts a transfer in the middle of a packet
+ */
+static void test_strip_limit(void){
+  std::vector<uint8_t> stream(4000);
+  std::vector<uint8_t> output(4000);
+  std::vector<uint8_t> transfer(4096);
+  scripted_endpoint_t ep;
+  uint32_t length = 0;
+  uint32_t written = 0;
+
+  fill_pattern(stream.data(), stream.size(), 3);
+  endpoint_init(&ep, stream.data(), stream.size(), 4096, 0, 0);
+  length = endpoint_next(&ep, transfer.data());
+  memset(output.data(), 0xEE, output.size());
+  written = ftdi_strip_modem_status(output.data(), 777, transfer.data(), length, FTDI_PACKET_SIZE);
+  CHECK(written == 777);
+  CHECK(memcmp(output.data(), stream.data(), 777) == 0);
+  CHECK(output[777] == 0xEE);
+}
+
+/*
+ *  consume_packets: responses are routed by a parser callback that does
+ *  what the driver does, large reads take the direct compaction path
+ */
+struct consume_test_t {
+  state_t * state;
+  request_t requests[4];
+  uint32_t request_count;
+  uint32_t next_request;
+  uint32_t parsed_bytes;
+  uint32_t interrupts;
+};
+
+static void consume_cb(response_parser_t *parser, int event, const uint8_t *data, uint32_t length){
+  consume_test_t * t = (consume_test_t *) parser->user_data;
+  state_t * state = t->state;
+  request_t * request = state->response_request;
+
+  switch (event){
+    case (RESPONSE_EVENT_HEADER):
+      if (parser->header.status == ((~INTERRUPT) & 0xFF)){
+        state->response_request = NULL;
+        break;
+      }
+      request = NULL;
+      if (t->next_request < t->request_count){
+        request = &t->requests[t->next_request++];
+      }
+      state->response_request = request;
+      break;
+    case (RESPONSE_EVENT_DATA):
+      t->parsed_bytes += length;
+      if (request == NULL){
+        t->interrupts++;
+        break;
+      }
+      memcpy(&request->buffer[request->buffer_pos], data, length);
+      request->buffer_pos += length;
+      state->usb_actual_pos += length;
+      break;
+    case (RESPONSE_EVENT_DONE):
+      state->response_request = NULL;
+      break;
+    default:
+      break;
+  }
+}
+
+static void append_response(std::vector<uint8_t> &stream, uint8_t command, const uint8_t *data, uint32_t size){
+  uint32_t dword_count = size / 4;
+  stream.push_back(ID_RESPONSE);
+  stream.push_back((~command) & 0xFF);
+  stream.push_back((dword_count >> 16) & 0xFF);
+  stream.push_back((dword_count >> 8) & 0xFF);
+  stream.push_back(dword_count & 0xFF);
+  for (uint32_t i = 0; i < 4; i++){
+    stream.push_back(0x00);
+  }
+  stream.insert(stream.end(), data, data + size);
+}
+
+static void test_consume_packets(uint32_t transfer_size, uint32_t short_every, uint32_t short_payload){
+  const uint32_t sizes[] = {64000, 4, 20400};
+  const uint8_t interrupt[4] = {0x00, 0x00, 0x00, 0x01};
+  std::vector<uint8_t> data[3];
+  std::vector<uint8_t> output[3];
+  std::vector<uint8_t> stream;
+  std::vector<uint8_t> transfer(transfer_size);
+  scripted_endpoint_t ep;
+  consume_test_t t;
+  uint32_t length = 0;
+  uint32_t total = 0;
+
+  memset(&t, 0, sizeof(t));
+  t.state = new state_t();
+  response_parser_init(&t.state->parser, consume_cb, &t);
+
+  //Two reads, an interrupt packet between them and a third read
+  for (uint32_t i = 0; i < 3; i++){
+    data[i].resize(sizes[i]);
+    output[i].assign(sizes[i], 0);
+    fill_pattern(data[i].data(), sizes[i], 11 + i);
+    t.requests[i].buffer = output[i].data();
+    t.requests[i].size = sizes[i];
+    t.requests[i].read = true;
+    append_response(stream, MEM_FLAG | READ, data[i].data(), sizes[i]);
+    total += sizes[i];
+    if (i == 0){
+      append_response(stream, INTERRUPT, interrupt, 4);
+    }
+  }
+  t.request_count = 3;
+
+  endpoint_init(&ep, stream.data(), stream.size(), transfer_size, short_every, short_payload);
+  while ((length = endpoint_next(&ep, transfer.data())) > 0){
+    consume_packets(t.state, transfer.data(), length);
+  }
+
+  CHECK(t.next_request == 3);
+  CHECK(t.interrupts == 1);
+  CHECK(t.state->parser.response_count == 4);
+  CHECK(t.state->parser.desync_count == 0);
+  CHECK(t.state->usb_actual_pos == total);
+  for (uint32_t i = 0; i < 3; i++){
+    CHECK(t.requests[i].buffer_pos == sizes[i]);
+    CHECK(memcmp(output[i].data(), data[i].data(), sizes[i]) == 0);
+  }
+  //Most of the large read must have gone around the parser
+  CHECK(t.parsed_bytes < (total / 2));
+  delete t.state;
+}
+
+int main(void){
+  test_strip_sizes();
+  test_strip_short_packets();
+  test_strip_limit();
+  test_consume_packets(16384, 0, 0);
+  test_consume_packets(65536, 0, 0);
+  test_consume_packets(1024, 0, 0);
+  test_consume_packets(16384, 5, 100);
+  test_consume_packets(4096, 2, 0);
+
+#if defined(DIONYSUS_NO_SIMD)
+  printf ("ftdi stream (scalar): ");
+#else
+  printf ("ftdi stream: ");
+#endif
+  if (failures > 0){
+    printf ("%d checks failed\n", failures);
+    return 1;
+  }
+  printf ("passed\n");
+  return 0;
+}
@@ -0,0 +1,260 @@
+/*
+ *  Memory allocator checks
+ *
+ *  Regions are handed out until the memory runs out, given back in
+ *  different orders and mixed with fixed reservations. Whatever happens
+ *  no two regions (or a region and a reservation) may overlap and freeing
+ *  everything has to merge the memory back into the chunks it was added
+ *  as
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "memory_allocator.hpp"
+
+static int failures = 0;
+
+#define CHECK(x) do{                                                    \
+                    if (!(x)){                                          \
+                      printf ("%s:%d: check failed: %s\n",              \
+                              __func__, __LINE__, #x);                  \
+                      failures++;                                       \
+                    }                                                   \
+                 }while(0)
+
+#define BLOCK_SIZE    0x1000
+
+/*
+ *  A region or reservation that is in use
+ */
+struct range_t {
+  uint64_t start;
+  uint64_t end;
+};
+
+static bool overlaps(const std::vector<range_t> &ranges, uint64_t start, uint64_t end){
+  for (uint32_t i = 0; i < ranges.size(); i++){
+    if ((ranges[i].start < end) && (ranges[i].end > start)){
+      return true;
+    }
+  }
+  return false;
+}
+
+static void add_range(std::vector<range_t> &ranges, uint64_t start, uint64_t end){
+  range_t range;
+  range.start = start;
+  range.end = end;
+  ranges.push_back(range);
+}
+
+/*
+ *  Allocate every size until the memory runs out, every region is aligned
+ *  to its rounded size, inside the memory and does not touch another one
+ */
+static void test_alignment(void){
+  const uint32_t sizes[] = {1, 0x1000, 0x1001, 0x3000, 0x10000, 0x7F800};
+  MemoryAllocator memory;
+  std::vector<range_t> ranges;
+  std::vector<uint32_t> addresses;
+  uint32_t address = 0;
+  uint32_t size = 0;
+
+  CHECK(memory.add_region(0x100000, 0x200000) == 0);
+  for (uint32_t i = 0; ; i++){
+    if (memory.alloc(sizes[i % 6], &address) < 0){
+      break;
+    }
+    size = memory.get_allocated_size(address);
+    CHECK(size >= sizes[i % 6]);
+    CHECK((size & (size - 1)) == 0);
+    CHECK((address & (size - 1)) == 0);
+    CHECK(address >= 0x100000);
+    CHECK(((uint64_t) address + size) <= 0x300000);
+    CHECK(!overlaps(ranges, address, (uint64_t) address + size));
+    add_range(ranges, address, (uint64_t) address + size);
+    addresses.push_back(address);
+  }
+  CHECK(addresses.size() > 6);
+  for (uint32_t i = 0; i < addresses.size(); i++){
+    CHECK(memory.free(addresses[i]) == 0);
+  }
+  CHECK(memory.get_free_size() == 0x200000);
+  CHECK(memory.get_largest_free() == 0x100000);
+}
+
+/*
+ *  Freed buddies merge back into the block they were split from, in any
+ *  order, and a region can only be freed once
+ */
+static void test_merge(void){
+  MemoryAllocator memory;
+  uint32_t addresses[16];
+
+  CHECK(memory.add_region(0, 0x10000) == 0);
+  CHECK(memory.get_largest_free() == 0x10000);
+  for (uint32_t i = 0; i < 16; i++){
+    CHECK(memory.alloc(BLOCK_SIZE, &addresses[i]) == 0);
+  }
+  CHECK(memory.get_free_size() == 0);
+  CHECK(memory.get_largest_free() == 0);
+  //Every other block first, nothing can merge yet
+  for (uint32_t i = 0; i < 16; i += 2){
+    CHECK(memory.free(addresses[i]) == 0);
+  }
+  CHECK(memory.get_free_size() == 0x8000);
+  CHECK(memory.get_largest_free() == BLOCK_SIZE);
+  for (uint32_t i = 15; i < 16; i -= 2){
+    CHECK(memory.free(addresses[i]) == 0);
+  }
+  CHECK(memory.get_largest_free() == 0x10000);
+  CHECK(memory.free(addresses[0]) == -1);
+
+  //A chunk never merges with the memory next to it
+  CHECK(memory.add_region(0x10000, 0x10000) == 0);
+  CHECK(memory.get_free_size() == 0x20000);
+  CHECK(memory.get_largest_free() == 0x10000);
+  CHECK(memory.add_region(0x8000, 0x1000) == -1);
+}
+
+/*
+ *  Take everything, nothing is left and a failed alloc changes nothing
+ */
+static void test_exhaustion(void){
+  MemoryAllocator memory;
+  uint32_t address = 0;
+  uint32_t large = 0;
+  uint32_t count = 0;
+
+  CHECK(memory.alloc(BLOCK_SIZE, &address) == -1);
+  CHECK(memory.add_region(0x20000000, 0x40000) == 0);
+  CHECK(memory.alloc(0x80000, &address) == -1);
+  CHECK(memory.alloc(0x40000, &large) == 0);
+  CHECK(large == 0x20000000);
+  CHECK(memory.alloc(BLOCK_SIZE, &address) == -1);
+  CHECK(memory.free(large) == 0);
+  while (memory.alloc(0x8000, &address) == 0){
+    count++;
+  }
+  CHECK(count == 8);
+  CHECK(memory.get_free_size() == 0);
+  CHECK(memory.alloc(1, &address) == -1);
+
+  memory.reset();
+  CHECK(memory.get_free_size() == 0);
+  CHECK(memory.alloc(1, &address) == -1);
+}
+
+/*
+ *  A reservation inside added memory is never handed out and comes back
+ *  with free
+ */
+static void test_reserve_after_seed(void){
+  MemoryAllocator memory;
+  std::vector<range_t> ranges;
+  uint32_t address = 0;
+  uint32_t size = 0;
+
+  CHECK(memory.add_region(0, 0x100000) == 0);
+  //Unaligned, it takes the blocks it touches
+  CHECK(memory.reserve(0x12345, 0x20000) == 0);
+  CHECK(memory.get_allocated_size(0x12345) == 0x20000);
+  CHECK(memory.get_free_size() == (0x100000 - 0x21000));
+  add_range(ranges, 0x12000, 0x33000);
+  while (memory.alloc(BLOCK_SIZE * 3, &address) == 0){
+    size = memory.get_allocated_size(address);
+    CHECK(!overlaps(ranges, address, (uint64_t) address + size));
+    add_range(ranges, address, (uint64_t) address + size);
+  }
+  //Regions and other reservations can not be reserved over
+  CHECK(memory.reserve(ranges[1].start, 4) == -1);
+  CHECK(memory.reserve(0x12345 + 0x1FFFF, 1) == -1);
+  CHECK(memory.reserve(0x12000, 0x1000) == -1);
+  CHECK(memory.reserve(0x12345, 0) == -1);
+  for (uint32_t i = 1; i < ranges.size(); i++){
+    CHECK(memory.free((uint32_t) ranges[i].start) == 0);
+  }
+  CHECK(memory.get_free_size() == (0x100000 - 0x21000));
+  CHECK(memory.free(0x12345) == 0);
+  CHECK(memory.free(0x12345) == -1);
+  CHECK(memory.get_free_size() == 0x100000);
+  CHECK(memory.get_largest_free() == 0x100000);
+
+  //Outside the managed memory only the range is kept
+  CHECK(memory.reserve(0x80000000, 0x10000) == 0);
+  CHECK(memory.get_free_size() == 0x100000);
+  CHECK(memory.free(0x80000000) == 0);
+}
+
+/*
+ *  Reservations made before the memory is added (no DRT yet) are cut out
+ *  of the memory when it shows up
+ */
+static void test_reserve_before_seed(void){
+  MemoryAllocator memory;
+  uint32_t address = 0;
+
+  CHECK(memory.reserve(0, 0x10000) == 0);
+  CHECK(memory.reserve(0x10000, 0x10000) == 0);
+  CHECK(memory.add_region(0, 0x100000) == 0);
+  CHECK(memory.get_free_size() == (0x100000 - 0x20000));
+  while (memory.alloc(0x10000, &address) == 0){
+    CHECK(address >= 0x20000);
+  }
+  memory.reset();
+  //reset forgets the reservations as well
+  CHECK(memory.add_region(0, 0x100000) == 0);
+  CHECK(memory.get_free_size() == 0x100000);
+}
+
+/*
+ *  Two fixed blocks that are not a multiple of the block size share the
+ *  block in the middle (the LCD frame buffers), it stays reserved until
+ *  both are freed
+ */
+static void test_shared_block(void){
+  const uint32_t size = 480 * 272 * 4;
+  MemoryAllocator memory;
+  uint32_t address = 0;
+  uint32_t rounded = (2 * size + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1);
+
+  CHECK(memory.reserve(0, size) == 0);
+  CHECK(memory.reserve(size, size) == 0);
+  CHECK(memory.reserve(size - 4, 8) == -1);
+  CHECK(memory.add_region(0, 0x200000) == 0);
+  CHECK(memory.get_free_size() == (0x200000 - rounded));
+
+  CHECK(memory.free(0) == 0);
+  //The shared block still belongs to the second reservation
+  CHECK(memory.get_free_size() == (0x200000 - rounded + (size & ~(BLOCK_SIZE - 1))));
+  while (memory.alloc(BLOCK_SIZE, &address) == 0){
+    CHECK((address + BLOCK_SIZE <= (size & ~(BLOCK_SIZE - 1))) || (address >= rounded));
+  }
+  memory.reset();
+
+  CHECK(memory.add_region(0, 0x200000) == 0);
+  CHECK(memory.reserve(0, size) == 0);
+  CHECK(memory.reserve(size, size) == 0);
+  CHECK(memory.free(size) == 0);
+  CHECK(memory.free(0) == 0);
+  CHECK(memory.get_free_size() == 0x200000);
+  CHECK(memory.get_largest_free() == 0x200000);
+}
+
+int main(void){
+  test_alignment();
+  test_merge();
+  test_exhaustion();
+  test_reserve_after_seed();
+  test_reserve_before_seed();
+  test_shared_block();
+
+  printf ("memory allocator: ");
+  if (failures > 0){
+    printf ("%d checks failed\n", failures);
+    return 1;
+  }
+  printf ("passed\n");
+  return 0;
+}
@@ -0,0 +1,424 @@
+/*
+ *  Response parser corpus
+ *
+ *  Streams of responses are fed to the parser whole, split at every byte,
+ *  in packet sized fragments and merged back to back with interrupt
+ *  packets in between. The events the parser reports have to describe the
+ *  same responses no matter how the stream was cut up
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "dionysus_local.hpp"
+
+static int failures = 0;
+
+#define CHECK(x) do{                                                    \
+                    if (!(x)){                                          \
+                      printf ("%s:%d: check failed: %s\n",              \
+                              __func__, __LINE__, #x);                  \
+                      failures++;                                       \
+                    }                                                   \
+                 }while(0)
+
+/*
+ *  A response as the parser reported it
+ */
+struct parsed_response_t {
+  uint8_t status;
+  uint32_t data_size;
+  std::vector<uint8_t> data;
+  bool done;
+};
+
+struct recorder_t {
+  std::vector<parsed_response_t> responses;
+  std::vector<uint8_t> desync;
+  //Drop the data of responses with this status (0: keep everything)
+  uint8_t drop_status;
+};
+
+static void recorder_cb(response_parser_t *parser, int event, const uint8_t *data, uint32_t length){
+  recorder_t * r = (recorder_t *) parser->user_data;
+  parsed_response_t response;
+
+  switch (event){
+    case (RESPONSE_EVENT_HEADER):
+      response.status = parser->header.status;
+      response.data_size = parser->data_size;
+      response.done = false;
+      r->responses.push_back(response);
+      break;
+    case (RESPONSE_EVENT_DATA):
+      CHECK(r->responses.size() > 0);
+      if (r->responses.back().status == r->drop_status){
+        //Nobody wants this response, the data is ignored
+        break;
+      }
+      r->responses.back().data.insert(r->responses.back().data.end(), data, data + length);
+      break;
+    case (RESPONSE_EVENT_DONE):
+      CHECK(r->responses.size() > 0);
+      r->responses.back().done = true;
+      break;
+    case (RESPONSE_EVENT_DESYNC):
+      r->desync.insert(r->desync.end(), data, data + length);
+      break;
+    default:
+      break;
+  }
+}
+
+/*
+ *  Build the responses the FPGA sends
+ */
+static void fill_pattern(std::vector<uint8_t> &data, uint32_t size, uint32_t seed){
+  data.resize(size);
+  for (uint32_t i = 0; i < size; i++){
+    seed = seed * 1103515245 + 12345;
+    data[i] = (uint8_t) (seed >> 16);
+  }
+}
+
+static void append_header(std::vector<uint8_t> &stream, uint8_t command, uint32_t dword_count){
+  stream.push_back(ID_RESPONSE);
+  stream.push_back((~command) & 0xFF);
+  if (command == PING){
+    //Ping responses carry three bytes after the status
+    stream.push_back(0x00);
+    stream.push_back(0x00);
+    stream.push_back(0x00);
+    return;
+  }
+  stream.push_back((dword_count >> 16) & 0xFF);
+  stream.push_back((dword_count >> 8) & 0xFF);
+  stream.push_back(dword_count & 0xFF);
+  stream.push_back(0x00);
+  stream.push_back(0x00);
+  stream.push_back(0x01);
+  stream.push_back(0x00);
+}
+
+static void append_read(std::vector<uint8_t> &stream, uint8_t command, const std::vector<uint8_t> &data){
+  append_header(stream, command, data.size() / 4);
+  stream.insert(stream.end(), data.begin(), data.end());
+}
+
+static void append_write_ack(std::vector<uint8_t> &stream, uint8_t command){
+  append_header(stream, command, 1);
+}
+
+static void append_interrupt(std::vector<uint8_t> &stream, uint32_t interrupts){
+  append_header(stream, INTERRUPT, 1);
+  stream.push_back((interrupts >> 24) & 0xFF);
+  stream.push_back((interrupts >> 16) & 0xFF);
+  stream.push_back((interrupts >> 8) & 0xFF);
+  stream.push_back(interrupts & 0xFF);
+}
+
+/*
+ *  Feed 'stream' in fragments, sizes come from 'cuts' round robin
+ */
+static void feed_stream(response_parser_t *parser,
+                        const std::vector<uint8_t> &stream,
+                        const std::vector<uint32_t> &cuts){
+  uint32_t pos = 0;
+  uint32_t i = 0;
+  uint32_t length = 0;
+  while (pos < stream.size()){
+    length = cuts[i++ % cuts.size()];
+    if (length > (stream.size() - pos)){
+      length = stream.size() - pos;
+    }
+    CHECK(response_parser_feed(parser, &stream[pos], length) == length);
+    pos += length;
+  }
+}
+
+/*
+ *  The corpus: memory and peripheral reads of many sizes, write
+ *  acknowledgements, pings and interrupts, back to back
+ */
+struct corpus_t {
+  std::vector<uint8_t> stream;
+  std::vector<uint8_t> status;
+  std::vector<std::vector<uint8_t> > data;
+};
+
+static void corpus_add_read(corpus_t *c, uint8_t command, uint32_t size, uint32_t seed){
+  std::vector<uint8_t> data;
+  fill_pattern(data, size, seed);
+  append_read(c->stream, command, data);
+  c->status.push_back((~command) & 0xFF);
+  c->data.push_back(data);
+}
+
+static void corpus_add_ack(corpus_t *c, uint8_t command){
+  append_write_ack(c->stream, command);
+  c->status.push_back((~command) & 0xFF);
+  c->data.push_back(std::vector<uint8_t>());
+}
+
+static void corpus_add_interrupt(corpus_t *c, uint32_t interrupts){
+  std::vector<uint8_t> data;
+  append_interrupt(c->stream, interrupts);
+  data.push_back((interrupts >> 24) & 0xFF);
+  data.push_back((interrupts >> 16) & 0xFF);
+  data.push_back((interrupts >> 8) & 0xFF);
+  data.push_back(interrupts & 0xFF);
+  c->status.push_back((~INTERRUPT) & 0xFF);
+  c->data.push_back(data);
+}
+
+static void corpus_add_ping(corpus_t *c){
+  append_header(c->stream, PING, 0);
+  c->status.push_back((~PING) & 0xFF);
+  c->data.push_back(std::vector<uint8_t>());
+}
+
+static void build_corpus(corpus_t *c){
+  corpus_add_read(c, READ, 4, 1);
+  corpus_add_ack(c, WRITE);
+  corpus_add_interrupt(c, 0x00000001);
+  corpus_add_read(c, MEM_FLAG | READ, 1020, 2);
+  corpus_add_ping(c);
+  corpus_add_ack(c, MEM_FLAG | WRITE);
+  corpus_add_interrupt(c, 0x80000000);
+  corpus_add_interrupt(c, 0x00010000);
+  corpus_add_read(c, READ, 16, 3);
+  corpus_add_read(c, MEM_FLAG | READ, 4096, 4);
+  corpus_add_ack(c, WRITE);
+  corpus_add_read(c, READ, 8, 5);
+}
+
+static void check_corpus(corpus_t *c, recorder_t *r, response_parser_t *parser){
+  CHECK(r->responses.size() == c->status.size());
+  CHECK(r->desync.size() == 0);
+  CHECK(parser->response_count == c->status.size());
+  CHECK(parser->phase == RESPONSE_PHASE_ID);
+  for (uint32_t i = 0; (i < r->responses.size()) && (i < c->status.size()); i++){
+    CHECK(r->responses[i].done);
+    CHECK(r->responses[i].status == c->status[i]);
+    CHECK(r->responses[i].data_size == c->data[i].size());
+    CHECK(r->responses[i].data == c->data[i]);
+  }
+}
+
+static void run_corpus(const std::vector<uint32_t> &cuts){
+  corpus_t c;
+  recorder_t r;
+  response_parser_t parser;
+
+  build_corpus(&c);
+  r.drop_status = 0;
+  response_parser_init(&parser, recorder_cb, &r);
+  feed_stream(&parser, c.stream, cuts);
+  check_corpus(&c, &r, &parser);
+}
+
+/*
+ *  The whole stream at once, one byte at a time and split at every
+ *  position (every header gets cut in two somewhere)
+ */
+static void test_split_streams(void){
+  corpus_t c;
+  std::vector<uint32_t> cuts;
+
+  build_corpus(&c);
+  cuts.push_back(c.stream.size());
+  run_corpus(cuts);
+
+  cuts.clear();
+  cuts.push_back(1);
+  run_corpus(cuts);
+
+  for (uint32_t split = 1; split < 40; split++){
+    cuts.clear();
+    cuts.push_back(split);
+    run_corpus(cuts);
+  }
+
+  for (uint32_t split = 1; split < c.stream.size(); split += 7){
+    recorder_t r;
+    response_parser_t parser;
+    r.drop_status = 0;
+    response_parser_init(&parser, recorder_cb, &r);
+    CHECK(response_parser_feed(&parser, &c.stream[0], split) == split);
+    CHECK(response_parser_feed(&parser, &c.stream[split], c.stream.size() - split) == (c.stream.size() - split));
+    check_corpus(&c, &r, &parser);
+  }
+}
+
+/*
+ *  Fragments the size of FTDI packet payloads and odd sizes mixed
+ */
+static void test_packet_fragments(void){
+  std::vector<uint32_t> cuts;
+
+  cuts.push_back(FTDI_PACKET_PAYLOAD);
+  run_corpus(cuts);
+
+  cuts.clear();
+  cuts.push_back(FTDI_PACKET_PAYLOAD);
+  cuts.push_back(3);
+  cuts.push_back(0);
+  cuts.push_back(9);
+  cuts.push_back(1);
+  cuts.push_back(62);
+  run_corpus(cuts);
+
+  cuts.clear();
+  cuts.push_back(2);
+  cuts.push_back(5);
+  cuts.push_back(11);
+  run_corpus(cuts);
+}
+
+/*
+ *  A response nobody is waiting for keeps the size from its header, its
+ *  data is skipped and the responses after it still parse
+ */
+static void test_stray_response(void){
+  corpus_t c;
+  recorder_t r;
+  response_parser_t parser;
+  std::vector<uint32_t> cuts;
+
+  corpus_add_read(&c, READ, 4, 9);
+  corpus_add_read(&c, MEM_FLAG | READ, 2048, 10);
+  corpus_add_read(&c, READ, 12, 11);
+  corpus_add_ack(&c, WRITE);
+
+  cuts.push_back(7);
+  cuts.push_back(FTDI_PACKET_PAYLOAD);
+  r.drop_status = (~(MEM_FLAG | READ)) & 0xFF;
+  response_parser_init(&parser, recorder_cb, &r);
+  feed_stream(&parser, c.stream, cuts);
+
+  CHECK(r.responses.size() == 4);
+  CHECK(r.desync.size() == 0);
+  CHECK(parser.desync_count == 0);
+  if (r.responses.size() == 4){
+    CHECK(r.responses[1].data_size == 2048);
+    CHECK(r.responses[1].data.size() == 0);
+    CHECK(r.responses[1].done);
+    CHECK(r.responses[2].data == c.data[2]);
+    CHECK(r.responses[3].status == ((~WRITE) & 0xFF));
+  }
+}
+
+/*
+ *  Bytes that can't start a response are reported and skipped, an ID byte
+ *  followed by something that is not a status doesn't eat the next response
+ */
+static void test_desync(void){
+  corpus_t c;
+  recorder_t r;
+  response_parser_t parser;
+  std::vector<uint8_t> stream;
+  std::vector<uint32_t> cuts;
+
+  corpus_add_read(&c, READ, 8, 12);
+  corpus_add_interrupt(&c, 0x00000004);
+
+  stream.push_back(0x00);
+  stream.push_back(0x55);
+  stream.push_back(ID_RESPONSE);
+  //Not a response status, but the start of the real response
+  stream.insert(stream.end(), c.stream.begin(), c.stream.end());
+
+  cuts.push_back(1);
+  cuts.push_back(3);
+  r.drop_status = 0;
+  response_parser_init(&parser, recorder_cb, &r);
+  feed_stream(&parser, stream, cuts);
+
+  CHECK(r.responses.size() == 2);
+  CHECK(r.desync.size() == 3);
+  CHECK(parser.desync_count == 3);
+  if (r.responses.size() == 2){
+    CHECK(r.responses[0].data == c.data[0]);
+    CHECK(r.responses[1].data == c.data[1]);
+  }
+}
+
+/*
+ *  Reset in the middle of a response drops what was parsed so far
+ */
+static void test_reset(void){
+  corpus_t c;
+  recorder_t r;
+  response_parser_t parser;
+
+  corpus_add_read(&c, MEM_FLAG | READ, 64, 13);
+  r.drop_status = 0;
+  response_parser_init(&parser, recorder_cb, &r);
+
+  //Half a header, then half of the data
+  response_parser_feed(&parser, &c.stream[0], 4);
+  CHECK(parser.phase == RESPONSE_PHASE_HEADER);
+  response_parser_reset(&parser);
+  CHECK(parser.phase == RESPONSE_PHASE_ID);
+  CHECK(response_parser_data_left(&parser) == 0);
+
+  response_parser_feed(&parser, &c.stream[0], RESPONSE_HEADER_LEN + 32);
+  CHECK(response_parser_data_left(&parser) == 32);
+  response_parser_reset(&parser);
+  CHECK(response_parser_data_left(&parser) == 0);
+
+  //A clean stream after the reset
+  r.responses.clear();
+  feed_stream(&parser, c.stream, std::vector<uint32_t>(1, 5));
+  CHECK(r.responses.size() == 1);
+  CHECK(parser.response_count == 1);
+  if (r.responses.size() == 1){
+    CHECK(r.responses[0].done);
+    CHECK(r.responses[0].data == c.data[0]);
+  }
+}
+
+/*
+ *  Data delivered around the parser (straight out of the transfer buffer)
+ */
+static void test_skip(void){
+  corpus_t c;
+  recorder_t r;
+  response_parser_t parser;
+
+  corpus_add_read(&c, MEM_FLAG | READ, 1024, 14);
+  corpus_add_ack(&c, WRITE);
+  r.drop_status = 0;
+  response_parser_init(&parser, recorder_cb, &r);
+
+  response_parser_feed(&parser, &c.stream[0], RESPONSE_HEADER_LEN + 100);
+  CHECK(response_parser_data_left(&parser) == 924);
+  response_parser_skip(&parser, 900);
+  CHECK(response_parser_data_left(&parser) == 24);
+  response_parser_feed(&parser, &c.stream[RESPONSE_HEADER_LEN + 1000], c.stream.size() - (RESPONSE_HEADER_LEN + 1000));
+
+  CHECK(r.responses.size() == 2);
+  CHECK(parser.response_count == 2);
+  if (r.responses.size() == 2){
+    CHECK(r.responses[0].done);
+    CHECK(r.responses[0].data.size() == 124);
+    CHECK(r.responses[1].status == ((~WRITE) & 0xFF));
+  }
+}
+
+int main(void){
+  test_split_streams();
+  test_packet_fragments();
+  test_stray_response();
+  test_desync();
+  test_reset();
+  test_skip();
+
+  printf ("response parser: ");
+  if (failures > 0){
+    printf ("%d checks failed\n", failures);
+    return 1;
+  }
+  printf ("passed\n");
+  return 0;
+}